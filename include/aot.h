@@ -0,0 +1,69 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "instruction.h"
+
+/* Interface between the CPU and ROMs translated ahead of time with rom2c. */
+/* Bump AOT_ABI_VERSION whenever enum Op, struct instruction or the types below change. */
+#define AOT_ABI_VERSION 2
+
+/* Name of the const struct aot_module a translated ROM exports */
+#define AOT_MODULE_SYMBOL "chip8_aot_module"
+
+typedef enum CpuResult (*aot_handler_t)(cpu_instance_t*, const struct instruction*);
+
+/* Guest state translated code works on directly, every pointer leads into the CPU instance. Instructions */
+/* with effects beyond it, such as drawing, RND, the keypad and stores to memory, call handlers[op] on inst */
+/* with program_counter pointing at them. */
+struct aot_state {
+	cpu_instance_t* inst;
+	const aot_handler_t* handlers;
+	uint8_t* v;
+	uint8_t* memory; // 4096 bytes
+	uint16_t* index_register;
+	uint16_t* program_counter;
+	uint16_t* stack;
+	uint16_t* stack_pointer;
+	uint8_t* delay_timer;
+	uint8_t* sound_timer;
+};
+
+/* Runs the block from the instruction at pc on and stops after at most budget instructions, leaving */
+/* program_counter at the next instruction. Returns how many instructions ran. */
+typedef int (*aot_block_fn_t)(const struct aot_state* s, uint16_t pc, int budget);
+
+struct aot_block {
+	uint16_t start;
+	uint16_t end;
+	aot_block_fn_t fn;
+};
+
+struct aot_module {
+	uint32_t abi_version;
+	uint32_t rom_size;
+	uint32_t rom_checksum;
+	uint32_t blocks_count;
+	const struct aot_block* blocks;
+};
+
+typedef struct aot aot_t;
+
+/* FNV-1a, used to tie a module to the ROM it was translated from */
+uint32_t aot_checksum(const uint8_t* data, size_t len);
+
+/* Returns NULL if path can't be loaded or was translated from a different ROM */
+aot_t* aot_load(const char* path, const uint8_t* rom, size_t rom_size);
+
+void aot_unload(aot_t* aot);
+
+/* Block containing the instruction at pc */
+const struct aot_block* aot_lookup(aot_t* aot, uint16_t pc);
+
+/* Disables blocks that overlap memory [addr, addr + len) */
+void aot_invalidate(aot_t* aot, uint16_t addr, uint16_t len);
+
+#endif // AOT_H
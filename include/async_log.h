@@ -0,0 +1,106 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <log.h>
+
+/* Logging for threads that must never wait on stdio, such as the CPU thread. A call copies its arguments */
+/* into a fixed size record in a lock free ring of the calling thread and returns, a background thread */
+/* formats the records and hands them to log.h every few milliseconds. Records of a thread stay in order. */
+/* When a ring is full records are dropped, and how many is logged later. The format has to be a string */
+/* literal taking at most ASYNC_LOG_MAX_ARGS arguments: integers, floating point numbers, or void and char */
+/* pointers. Strings are printed when the record is drained, so they have to live that long. */
+#define ASYNC_LOG_MAX_ARGS 4
+
+#define async_log_debug(...) ASYNC_LOG(LOG_DEBUG, 0, __VA_ARGS__)
+#define async_log_info(...)  ASYNC_LOG(LOG_INFO, 0, __VA_ARGS__)
+#define async_log_warn(...)  ASYNC_LOG(LOG_WARN, 0, __VA_ARGS__)
+#define async_log_error(...) ASYNC_LOG(LOG_ERROR, 0, __VA_ARGS__)
+
+/* Log at most once every ASYNC_LOG_LIMIT_NS from the call site, for messages that can repeat every cycle. */
+/* Calls in between are only counted, the next message that goes out says how many there were. */
+#define ASYNC_LOG_LIMIT_NS 1000000000LL
+#define async_log_info_limited(...)  ASYNC_LOG(LOG_INFO, ASYNC_LOG_LIMIT_NS, __VA_ARGS__)
+#define async_log_error_limited(...) ASYNC_LOG(LOG_ERROR, ASYNC_LOG_LIMIT_NS, __VA_ARGS__)
+
+/* Writes out everything logged so far by any thread, waiting for it */
+void async_log_flush(void);
+
+/* Everything below is used by the macros */
+
+struct async_log_site {
+	int level;
+	const char* file;
+	int line;
+	const char* fmt;
+	int64_t limit_ns;             // 0 logs every call
+	_Atomic(int64_t) next_ns;     // rate limited calls before this are only counted
+	_Atomic(uint64_t) suppressed;
+};
+
+enum AsyncLogArg {
+	ASYNC_LOG_INT,
+	ASYNC_LOG_DOUBLE,
+	ASYNC_LOG_POINTER
+};
+
+struct async_log_arg {
+	enum AsyncLogArg type;
+	union {
+		uint64_t i; // signed values are sign extended, the conversion in the format picks the type
+		double d;
+		const void* p;
+	} value;
+};
+
+void async_log_write(struct async_log_site* site, int count, const struct async_log_arg* args);
+
+static inline struct async_log_arg async_log_int(uint64_t i) {
+	struct async_log_arg arg = { ASYNC_LOG_INT, { .i = i } };
+	return arg;
+}
+
+static inline struct async_log_arg async_log_double(double d) {
+	struct async_log_arg arg = { ASYNC_LOG_DOUBLE, { .d = d } };
+	return arg;
+}
+
+static inline struct async_log_arg async_log_pointer(const void* p) {
+	struct async_log_arg arg = { ASYNC_LOG_POINTER, { .p = p } };
+	return arg;
+}
+
+#define ASYNC_LOG_ARG(x) _Generic((x), \
+	float: async_log_double, \
+	double: async_log_double, \
+	char*: async_log_pointer, \
+	const char*: async_log_pointer, \
+	void*: async_log_pointer, \
+	const void*: async_log_pointer, \
+	default: async_log_int)(x)
+
+// the format counts as an argument, more than ASYNC_LOG_MAX_ARGS others do not compile
+#define ASYNC_LOG_COUNT(...) ASYNC_LOG_COUNT_(__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+#define ASYNC_LOG_COUNT_(a1, a2, a3, a4, a5, n, ...) n
+#define ASYNC_LOG_FIRST(...) ASYNC_LOG_FIRST_(__VA_ARGS__, 0)
+#define ASYNC_LOG_FIRST_(first, ...) first
+#define ASYNC_LOG_CAT(a, b) ASYNC_LOG_CAT_(a, b)
+#define ASYNC_LOG_CAT_(a, b) a##b
+
+#define ASYNC_LOG_ARGS_1(fmt) 0, NULL
+#define ASYNC_LOG_ARGS_2(fmt, a) 1, (const struct async_log_arg[]) { ASYNC_LOG_ARG(a) }
+#define ASYNC_LOG_ARGS_3(fmt, a, b) 2, (const struct async_log_arg[]) { ASYNC_LOG_ARG(a), ASYNC_LOG_ARG(b) }
+#define ASYNC_LOG_ARGS_4(fmt, a, b, c) 3, \
+	(const struct async_log_arg[]) { ASYNC_LOG_ARG(a), ASYNC_LOG_ARG(b), ASYNC_LOG_ARG(c) }
+#define ASYNC_LOG_ARGS_5(fmt, a, b, c, d) 4, \
+	(const struct async_log_arg[]) { ASYNC_LOG_ARG(a), ASYNC_LOG_ARG(b), ASYNC_LOG_ARG(c), ASYNC_LOG_ARG(d) }
+
+#define ASYNC_LOG(lvl, limit, ...) do { \
+	static struct async_log_site async_log_site_ = { .level = lvl, .file = __FILE__, .line = __LINE__, \
+		.fmt = ASYNC_LOG_FIRST(__VA_ARGS__), .limit_ns = limit }; \
+	async_log_write(&async_log_site_, ASYNC_LOG_CAT(ASYNC_LOG_ARGS_, ASYNC_LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)); \
+} while (0)
+
+#endif // ASYNC_LOG_H
@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+/* Runs many stopped CPU instances headless on a thread pool. Each task steps one instance through a slice */
+/* of frames and queues the next slice, so instances spread over every core without a thread each. */
+typedef struct batch batch_t;
+
+struct batch_stats {
+	uint64_t frames;
+	uint64_t cycles;
+	uint64_t busy_ns; // time spent running the instance, not counting time waiting for a worker
+	uint64_t slices;
+};
+
+/* threads <= 0 uses one worker per online core */
+batch_t* batch_create(int threads);
+
+/* Frees the batch, not the instances in it */
+void batch_destroy(batch_t* batch);
+
+/* Queues frames frames of a stopped instance for the next batch_run. Returns its index for batch_get_stats. */
+/* Returns -1 if memory runs out. */
+int batch_add(batch_t* batch, cpu_instance_t* instance, uint64_t frames);
+
+/* Runs every added instance to the end in slices of slice_frames, blocking until all are done. Returns */
+/* MEMORY_ERROR if a slice could not be queued, the instances it belonged to stop short of their frames. */
+enum CpuResult batch_run(batch_t* batch, int slice_frames);
+
+void batch_get_stats(batch_t* batch, int index, struct batch_stats* stats);
+
+/* Wall clock time of the last batch_run */
+uint64_t batch_elapsed_ns(batch_t* batch);
+
+int batch_threads(batch_t* batch);
+
+/* Tasks the pool moved between workers to keep them busy */
+uint64_t batch_steals(batch_t* batch);
+
+#endif // BATCH_H
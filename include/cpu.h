@@ -1,35 +1,250 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "image.h"
-#include "sdl_wrapper.h"
+
+/* The display is always 64x32, rows of the image are packed as described in image.h */
+#define CPU_SCREEN_WIDTH IMAGE_COLS
+#define CPU_SCREEN_HEIGHT 32
 
 typedef struct cpu_instance cpu_instance_t;
 
+/* See history.h, input_log.h and histogram.h */
+struct history;
+struct input_log;
+struct histogram;
+struct trace;
+
 enum CpuResult {
 	OK,
 	IO_ERROR,
 	MEMORY_ERROR,
 	INSTRUCTION_NOT_FOUND,
 	THREAD_ERROR,
-	INVALID_STATE
+	INVALID_STATE,
+	UNSUPPORTED
+};
+
+struct cpu_fusion_stats {
+	uint64_t skip_jump;  // 3xkk/4xkk followed by 1nnn
+	uint64_t load_draw;  // 6xkk followed by Dxyn
+	uint64_t table_load; // Annn, Fx1E, Fx65
+	uint64_t delay_poll; // Fx07, 3xkk, 1nnn
+};
+
+struct cpu_frame_stats {
+	uint64_t published; // frames the CPU thread handed over
+	uint64_t presented; // frames the renderer picked up, the rest were overtaken by newer ones
+	uint64_t unchanged; // frames not handed over because nothing was drawn, updated without locking
+};
+
+/* What the frame scheduler does when it falls behind the 60 Hz deadlines */
+enum CpuSchedulePolicy {
+	CPU_SCHEDULE_CATCH_UP, // run the late frames back to back, keeps emulated time in step with the wall clock
+	CPU_SCHEDULE_DROP      // skip them, the game slows down instead of speeding up after a stall
+};
+
+struct cpu_schedule_stats {
+	uint64_t frames;
+	uint64_t missed_deadlines;   // frames that finished after the next one was due
+	uint64_t caught_up_frames;   // frames run late without sleeping to make up for it
+	uint64_t dropped_frames;     // frames skipped because the scheduler was too far behind
+	uint64_t oversleep_total_ns; // time woken up past the deadline, summed over all sleeps
+	uint64_t oversleep_max_ns;
+	uint64_t cycles;             // emulated cycles run by all frames
+	uint64_t elapsed_ns;         // wall clock time since the CPU thread started
+};
+
+/* What the CPU thread started by cpu_start times, see cpu_get_timing */
+enum CpuTiming {
+	CPU_TIMING_BATCH,     // running the instructions of a frame
+	CPU_TIMING_CALLBACK,  // the frame notify callback, for frames that changed the screen
+	CPU_TIMING_OVERSLEEP, // waking up past a frame deadline
+	CPU_TIMING_INTERVAL,  // from the start of a frame to the start of the next
+	CPU_TIMINGS
+};
+
+enum CpuInputMode {
+	CPU_INPUT_LIVE,   // keys come from cpu_key_event and cpu_set_keys
+	CPU_INPUT_RECORD, // as live, and the keypad of every frame goes into the input log
+	CPU_INPUT_REPLAY  // keys come from the input log, live ones are ignored
+};
+
+enum CpuBackend {
+	CPU_BACKEND_INTERPRETER,
+	CPU_BACKEND_JIT,
+	CPU_BACKEND_AOT // selected by cpu_init when translations are allowed and <rom>.so is found next to the ROM
 };
 
 enum CpuResult cpu_create_instance(cpu_instance_t** instance);
 
+/* Stops the CPU thread if it is running and frees everything the instance owns */
+void cpu_destroy_instance(cpu_instance_t* instance);
+
 enum CpuResult cpu_start(cpu_instance_t* instance);
 
-enum CpuResult cpu_init(
-		cpu_instance_t* cpu,
-		char* rom,
-		void(* frame_callback)(int, uint8_t*, sdl_view_t*, image_t*, pthread_mutex_t*),
-		uint8_t* rgb24,
-		sdl_view_t* view,
-		pthread_mutex_t* mu,
-		void(* key_callback)(sdl_view_t*, pthread_mutex_t*, uint8_t*));
+/* Resets the instance and loads the ROM file, along with <rom>.so if rom2c made one and cpu_set_translation */
+/* allowed it. Can be called again on a stopped instance, what it owns is recreated. */
+/* With rom NULL nothing is loaded, cpu_load_rom can be used instead. */
+enum CpuResult cpu_init(cpu_instance_t* cpu, char* rom);
+
+/* Lets cpu_init load <rom>.so, off by default and kept across cpu_init. The library is trusted code: loading */
+/* it runs its constructors before it can be checked against the ROM, so only allow it for translations you */
+/* built yourself. */
+void cpu_set_translation(cpu_instance_t* instance, bool allowed);
+
+/* Copies a ROM image to 0x200 and jumps there, the CPU must be stopped */
+enum CpuResult cpu_load_rom(cpu_instance_t* instance, const uint8_t* rom, size_t len);
 
 enum CpuResult cpu_stop(cpu_instance_t* instance);
 
+/* Can be switched while the CPU is running, the change applies from the next frame */
+enum CpuResult cpu_set_backend(cpu_instance_t* instance, enum CpuBackend backend);
+
+/* Times each superinstruction ran whole, the counters are updated by the CPU thread without locking */
+void cpu_get_fusion_stats(cpu_instance_t* instance, struct cpu_fusion_stats* stats);
+
+/* Emulated cycles spent in delay timer wait loops that were skipped instead of executed */
+uint64_t cpu_get_idle_cycles(cpu_instance_t* instance);
+
+/* Queues a press or release of keypad key 0x0-0xF. Lock free, meant for a single input thread. */
+/* The CPU picks queued keys up at the start of the next frame. */
+enum CpuResult cpu_key_event(cpu_instance_t* instance, uint8_t key, bool pressed);
+
+/* Keys held down as of the last frame, bit n for key n */
+uint16_t cpu_get_keys(cpu_instance_t* instance);
+
+/* Replaces the keys held down right away instead of at the next frame, for callers that step a stopped CPU */
+enum CpuResult cpu_set_keys(cpu_instance_t* instance, uint16_t keys);
+
+/* Run the CPU on the calling thread, which must not be done while cpu_start's thread is running. */
+/* A frame polls queued keys, runs cpu_get_cycles_per_frame cycles and publishes the image as the thread does, */
+/* without pacing. */
+enum CpuResult cpu_run_cycles(cpu_instance_t* instance, int cycles);
+
+enum CpuResult cpu_run_frames(cpu_instance_t* instance, int frames);
+
+/* Cycles run since cpu_init, only exact while the CPU is stopped */
+uint64_t cpu_get_cycles(cpu_instance_t* instance);
+
+/* notify(arg) is called on the CPU thread after every published frame, set it before cpu_start */
+void cpu_set_frame_notify(cpu_instance_t* instance, void (*notify)(void*), void* arg);
+
+void cpu_set_schedule_policy(cpu_instance_t* instance, enum CpuSchedulePolicy policy);
+
+/* Counters are updated by the CPU thread without locking */
+void cpu_get_schedule_stats(cpu_instance_t* instance, struct cpu_schedule_stats* stats);
+
+/* Histogram of timing in nanoseconds, recorded by the CPU thread and readable at any time, cpu_init clears it. */
+/* Frames run by cpu_run_frames are not timed. */
+struct histogram* cpu_get_timing(cpu_instance_t* instance, enum CpuTiming timing);
+
+/* Instructions run per 60 Hz frame, 9 by default for a 540 Hz clock. Can be changed while the CPU is running, */
+/* the new value applies from the next frame. Returns INVALID_STATE outside 1-1048576. */
+enum CpuResult cpu_set_cycles_per_frame(cpu_instance_t* instance, int cycles);
+
+int cpu_get_cycles_per_frame(cpu_instance_t* instance);
+
+/* Runs frames back to back as fast as the host allows instead of at 60 Hz. Timers still tick once per */
+/* emulated frame, so the game runs faster but behaves the same. */
+void cpu_set_turbo(cpu_instance_t* instance, bool turbo);
+
+bool cpu_get_turbo(cpu_instance_t* instance);
+
+/* Emulated cycles per second over roughly the last second, 0 until the first second has passed */
+uint64_t cpu_get_cycle_rate(cpu_instance_t* instance);
+
+/* Loads the newest frame published by the CPU thread into dst, which must have as many rows as the CPU image. */
+/* Returns false if there is nothing new since the last call. Never blocks, meant for a single render thread. */
+bool cpu_take_frame(cpu_instance_t* instance, image_t* dst);
+
+void cpu_get_frame_stats(cpu_instance_t* instance, struct cpu_frame_stats* stats);
+
+/* The image the CPU draws into, only safe to read from the CPU thread or while it is stopped */
 image_t* cpu_get_image_inst(cpu_instance_t* instance);
 
+/* Execution profile of the interpreter, collected only in builds with CPU_PROFILE defined (make PROFILE=counts). */
+/* Counting keeps the interpreter within 5% of a build without it. With CPU_PROFILE_TICKS as well (make */
+/* PROFILE=ticks) one instruction in about 256, picked at random, is timed and stands for the ones before it, */
+/* so ticks are estimates that settle over millions of instructions. That still costs around 10%, outside the */
+/* 5% budget of counting. Compiled and translated code is not profiled, only the instructions it leaves to */
+/* the interpreter. */
+#define CPU_PROFILE_HANDLERS 48
+#define CPU_PROFILE_CLASSES 17
+
+struct cpu_profile_entry {
+	const char* name; // handler such as "DRAW" or "LDREG", or opcode class such as "Dxyn"
+	uint64_t count;   // instructions run, a superinstruction counts as one
+	uint64_t ticks;   // estimated host cycles spent running them, 0 without CPU_PROFILE_TICKS
+};
+
+struct cpu_profile {
+	uint64_t count;
+	uint64_t ticks;
+	int handler_count; // handlers that ran, sorted by ticks or, without ticks, by count
+	struct cpu_profile_entry handlers[CPU_PROFILE_HANDLERS];
+	int class_count;   // classes that ran, sorted the same way
+	struct cpu_profile_entry classes[CPU_PROFILE_CLASSES];
+};
+
+/* Snapshot of the profile since cpu_init or the last reset, cpu_stop logs it as well. The counters are updated */
+/* by the CPU thread without locking, so it can be taken while the CPU runs. Returns UNSUPPORTED with an empty */
+/* profile in builds without CPU_PROFILE. */
+enum CpuResult cpu_get_profile(cpu_instance_t* instance, struct cpu_profile* profile);
+
+/* Only while the CPU is stopped */
+void cpu_reset_profile(cpu_instance_t* instance);
+
+/* Save states cover memory, registers, stack, timers, keypad, clock and screen, nothing that only makes */
+/* sense in this process. They are always CPU_STATE_SIZE bytes: a header with a magic number, the format */
+/* version, the payload length and a Fletcher-64 of the payload, followed by the payload in little endian. */
+#define CPU_STATE_VERSION 2
+#define CPU_STATE_SIZE 4468
+
+/* Writes a save state of a stopped CPU into buf, which needs CPU_STATE_SIZE bytes */
+enum CpuResult cpu_save_state(cpu_instance_t* instance, uint8_t* buf, size_t size);
+
+/* Restores a stopped CPU from a save state, leaving it alone if the state is damaged or of another version. */
+/* Only memory that differs is copied, so decoded and compiled code that is still valid is kept. */
+enum CpuResult cpu_load_state(cpu_instance_t* instance, const uint8_t* buf, size_t size);
+
+enum CpuResult cpu_save_state_file(cpu_instance_t* instance, const char* path);
+
+enum CpuResult cpu_load_state_file(cpu_instance_t* instance, const char* path);
+
+/* Records a save state into history (see history.h) before every frame, set it before cpu_start. */
+/* NULL stops recording. The history is not freed with the instance. */
+void cpu_set_history(cpu_instance_t* instance, struct history* history);
+
+/* Records every instruction into trace (see trace.h), set it before cpu_start. Tracing runs the interpreter */
+/* whatever the backend, one instruction at a time. NULL stops it. The trace is not closed with the instance. */
+void cpu_set_trace(cpu_instance_t* instance, struct trace* trace);
+
+/* While set and a history is attached, every frame goes back one frame in it instead of running, so the */
+/* game plays backwards at the frame rate. Can be changed while the CPU is running. */
+void cpu_set_rewinding(cpu_instance_t* instance, bool rewinding);
+
+bool cpu_get_rewinding(cpu_instance_t* instance);
+
+/* RND seed of instances nobody seeded, so that runs are reproducible by default */
+#define CPU_DEFAULT_SEED 0x43484950382D3820ULL
+
+/* Seeds the generator behind RND, every instance has its own. Only while the CPU is stopped. */
+void cpu_set_seed(cpu_instance_t* instance, uint64_t seed);
+
+uint64_t cpu_get_seed(cpu_instance_t* instance);
+
+/* Frames run since cpu_init, only exact while the CPU is stopped */
+uint64_t cpu_get_frame(cpu_instance_t* instance);
+
+/* Records the keypad of every frame into log, or plays it back. Attach it to a stopped CPU right after */
+/* cpu_init and setting the seed and instructions per frame, the log starts from power on. Recording stores */
+/* the seed and instructions per frame in the log, replaying applies them. The same ROM replayed from a log */
+/* goes through exactly the same states on every backend. NULL detaches it. */
+enum CpuResult cpu_set_input_log(cpu_instance_t* instance, struct input_log* log, enum CpuInputMode mode);
+
 #endif // CPU_H
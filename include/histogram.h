@@ -0,0 +1,37 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Histogram of durations in the manner of HdrHistogram: values are bucketed by their highest set bit and */
+/* then linearly within it, so each is kept to within about 3% whatever its magnitude, up to about 18 */
+/* minutes in nanoseconds. Recording is a few instructions and never allocates. A single thread records, */
+/* any thread may read, reads taken while it records can be a few records behind. */
+typedef struct histogram histogram_t;
+
+histogram_t* histogram_create(void);
+
+void histogram_destroy(histogram_t* histogram);
+
+void histogram_record(histogram_t* histogram, uint64_t value);
+
+/* Only while nothing records */
+void histogram_reset(histogram_t* histogram);
+
+/* Copies src into dst, a stable snapshot to read from while src keeps recording */
+void histogram_copy(histogram_t* dst, histogram_t* src);
+
+uint64_t histogram_count(histogram_t* histogram);
+
+/* Sum of the values recorded, exact */
+uint64_t histogram_sum(histogram_t* histogram);
+
+uint64_t histogram_max(histogram_t* histogram);
+
+/* Values recorded that are at most value, as far as the bucket precision tells */
+uint64_t histogram_count_at_most(histogram_t* histogram, uint64_t value);
+
+/* Value that fraction q of the records are at most, 0 if nothing was recorded */
+uint64_t histogram_quantile(histogram_t* histogram, double q);
+
+#endif // HISTOGRAM_H
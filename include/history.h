@@ -0,0 +1,41 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+/* Rewind history, a ring of save states (see cpu_save_state) in a fixed amount of memory. Every state is */
+/* stored as the run-length encoded XOR against the last keyframe before it, keyframes are encoded against */
+/* zeros. When the ring is full the oldest keyframe is dropped along with the deltas that depend on it. */
+typedef struct history history_t;
+
+struct history_stats {
+	uint64_t frames;              // states held
+	uint64_t keyframes;           // of the states held
+	uint64_t memory_bytes;        // allocated for the ring and its index, fixed at creation
+	uint64_t used_bytes;          // taken by the encoded states held
+	uint64_t average_delta_bytes; // encoded size of the held states that are not keyframes
+};
+
+/* Holds at most frames states in bytes bytes of encoded data, whichever runs out first. */
+/* Returns NULL if either is too small for a single state or memory runs out. */
+history_t* history_create(size_t bytes, int frames);
+
+void history_destroy(history_t* history);
+
+/* Adds a CPU_STATE_SIZE byte state as the newest, dropping the oldest ones if there is no room */
+void history_push(history_t* history, const uint8_t* state);
+
+/* Removes the newest state and decodes it into state, which needs CPU_STATE_SIZE bytes. */
+/* Returns false if the history is empty. */
+bool history_pop(history_t* history, uint8_t* state);
+
+/* States held */
+int history_frames(history_t* history);
+
+void history_get_stats(history_t* history, struct history_stats* stats);
+
+#endif // HISTORY_H
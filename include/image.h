@@ -4,19 +4,64 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Rows are packed into one word each, the most significant bit is column 0 */
+#define IMAGE_COLS 64
+
 typedef struct image image_t;
 
+enum ImageFormat {
+	IMAGE_FORMAT_RGB24,    // three bytes per pixel, red first
+	IMAGE_FORMAT_XRGB8888  // one native endian 0x00RRGGBB word per pixel
+};
+
+/* Area of the image in pixels */
+struct image_rect {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+/* Colors for unset and set pixels with lookup tables expanding four pixels at once, see image_palette_init */
+struct image_palette {
+	uint32_t off; // 0xRRGGBB
+	uint32_t on;
+	uint8_t rgb24[16][12];
+	uint32_t xrgb8888[16][4];
+};
+
+/* Returns NULL if c is not IMAGE_COLS or memory runs out */
 image_t* image_create(int r, int c);
 
-uint8_t* image_row(image_t* inst, int r);
+int image_rows(image_t* inst);
+
+uint64_t image_row(image_t* inst, int r);
 
-uint8_t* image_at(image_t* inst, int c, int r);
+/* Copies the packed rows out, dst needs room for image_rows words */
+void image_store(image_t* inst, uint64_t* dst);
+
+/* Replaces the packed rows and marks the pixels that differ dirty */
+void image_load(image_t* inst, const uint64_t* src);
+
+bool image_pixel(image_t* inst, int c, int r);
 
 void image_set_all(image_t* inst, uint8_t value);
 
-bool image_xor_sprite(image_t* inst, int c, int r, int height, uint8_t* sprite);
+/* XORs an 8 pixel wide sprite onto the image, wrapping around both edges. Returns true if any pixel was erased. */
+bool image_xor_sprite(image_t* inst, int c, int r, int height, const uint8_t* sprite);
+
+void image_palette_init(struct image_palette* palette, uint32_t off, uint32_t on);
+
+/* Area changed by drawing since the last call, widened to multiples of 8 columns. */
+/* Returns false and leaves rect alone if nothing changed, rect may be NULL. New images start out fully dirty. */
+bool image_take_dirty(image_t* inst, struct image_rect* rect);
+
+/* Expands the image into dst, pitch is the distance between rows of dst in bytes */
+void image_convert(image_t* inst, const struct image_palette* palette, enum ImageFormat format, void* dst, int pitch);
 
-void image_copy_to_rgb24(image_t* inst, uint8_t* dst, int red_scale, int green_scale, int blue_scale);
+/* Expands only rect, dst points at its top left pixel. x and w have to be multiples of 8. */
+void image_convert_rect(image_t* inst, const struct image_palette* palette, enum ImageFormat format,
+		const struct image_rect* rect, void* dst, int pitch);
 
 void image_draw_to_stdout(image_t* inst);
 
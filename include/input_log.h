@@ -0,0 +1,40 @@
+#ifndef INPUT_LOG_H
+#define INPUT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+/* Keypad of every frame of a run from power on, stored as the frames where it changed, together with the RND */
+/* seed and the instructions per frame the run started with. Replaying it on the same ROM reproduces the run */
+/* exactly, see cpu_set_input_log. */
+typedef struct input_log input_log_t;
+
+input_log_t* input_log_create(void);
+
+void input_log_destroy(input_log_t* log);
+
+void input_log_set_start(input_log_t* log, uint64_t seed, int cycles_per_frame);
+
+uint64_t input_log_seed(input_log_t* log);
+
+int input_log_cycles_per_frame(input_log_t* log);
+
+/* Records the keys held down and the keys pressed and released again during frame. Frames at or after it that */
+/* were recorded before, because the run was rewound, are dropped first. */
+enum CpuResult input_log_record(input_log_t* log, uint64_t frame, uint16_t down, uint16_t latched);
+
+/* Keys in effect at frame. cursor belongs to the caller and starts out as 0, it makes lookups of increasing */
+/* frames constant time and lets several replays share one log. */
+void input_log_keys(input_log_t* log, uint64_t frame, size_t* cursor, uint16_t* down, uint16_t* latched);
+
+/* Frames recorded */
+uint64_t input_log_frames(input_log_t* log);
+
+enum CpuResult input_log_save(input_log_t* log, const char* path);
+
+/* Returns NULL if the file cannot be read or is not an input log */
+input_log_t* input_log_load(const char* path);
+
+#endif // INPUT_LOG_H
@@ -0,0 +1,73 @@
+#ifndef INSTRUCTION_H
+#define INSTRUCTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Every instruction the interpreter knows. OP_UNKNOWN is zero so that unset decode table slots fall through to it. */
+enum Op {
+	OP_UNKNOWN,
+	OP_NOP,
+	OP_CLS,
+	OP_RET,
+	OP_JP,
+	OP_CALL,
+	OP_SE,
+	OP_SNE,
+	OP_SEREG,
+	OP_LDIM,
+	OP_ADDIM,
+	OP_LDV,
+	OP_OR,
+	OP_AND,
+	OP_XOR,
+	OP_ADD,
+	OP_SUB,
+	OP_SHR,
+	OP_SUBN,
+	OP_SHL,
+	OP_SNEREG,
+	OP_LDI,
+	OP_JPREG,
+	OP_RND,
+	OP_DRAW,
+	OP_SKEY,
+	OP_SNKEY,
+	OP_RDELAY,
+	OP_WAITKEY,
+	OP_WDELAY,
+	OP_WSOUND,
+	OP_ADDI,
+	OP_LDSPRITE,
+	OP_STBCD,
+	OP_STREG,
+	OP_LDREG,
+	OP_UNDECODED, // cache slot that has to be decoded before it runs
+	// superinstructions, never decoded from memory, the CPU rewrites hot sequences into them
+	OP_FUSED_SE_JP,          // 3xkk, 1nnn
+	OP_FUSED_SNE_JP,         // 4xkk, 1nnn
+	OP_FUSED_LDIM_DRAW,      // 6xkk, Dxyn
+	OP_FUSED_LDI_ADDI_LDREG, // Annn, Fx1E, Fx65
+	OP_FUSED_DELAY_POLL,     // Fx07, 3xkk, 1nnn
+	OP_COUNT
+};
+
+struct instruction {
+	uint16_t opcode;
+	uint16_t nnn; // nnn or addr - A 12-bit value, the lowest 12 bits of the instruction
+	uint8_t kk;   // kk or byte - An 8-bit value, the lowest 8 bits of the instruction
+	uint8_t x;    // x - A 4-bit value, the lower 4 bits of the high byte of the instruction
+	uint8_t y;    // y - A 4-bit value, the upper 4 bits of the low byte of the instruction
+	uint8_t n;    // n or nibble - A 4-bit value, the lowest 4 bits of the instruction
+	uint8_t op;   // enum Op
+};
+
+void instruction_decode(uint16_t opcode, struct instruction* ins);
+
+/* Mnemonic of an enum Op value */
+const char* instruction_name(uint8_t op);
+
+/* Disassembles opcode into buf in the usual CHIP-8 assembler syntax, DW for data. Returns what snprintf does. */
+int instruction_format(uint16_t opcode, char* buf, size_t size);
+
+#endif // INSTRUCTION_H
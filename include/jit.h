@@ -0,0 +1,76 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct jit jit_t;
+
+typedef struct jit_block jit_block_t;
+
+/* Compiled code takes the emulator instance it was generated for. Linked blocks jump straight into each other, */
+/* the call returns the last block that ran. */
+typedef jit_block_t* (*jit_fn_t)(void* ctx);
+
+struct jit_block {
+	uint16_t start;      // guest address of the first instruction
+	uint16_t end;        // guest address one past the last instruction
+	uint16_t length;     // guest instructions run by one call to fn
+	bool valid;
+	jit_fn_t fn;         // NULL if nothing at start could be compiled
+	jit_block_t* links[2]; // successors the exits of the block jump to
+	uint32_t code;       // offsets of the block and its exits in the code buffer
+	uint32_t exits;
+};
+
+bool jit_supported(void);
+
+/* Blocks count their guest instructions themselves: on entry every block takes its length off the int32_t */
+/* budget and adds it to the uint64_t cycle counter at those offsets of ctx. An exit only jumps to the block it */
+/* is linked to when the uint16_t program counter at pc_offset is its start and the budget still covers it. */
+jit_t* jit_create(int32_t pc_offset, int32_t budget_offset, int32_t cycles_offset);
+
+void jit_destroy(jit_t* jit);
+
+/* Drops every block and all generated code */
+void jit_flush(jit_t* jit);
+
+/* Bumped by every flush, blocks from an older generation must not be touched */
+uint64_t jit_generation(jit_t* jit);
+
+jit_block_t* jit_lookup(jit_t* jit, uint16_t addr);
+
+/* Patches an exit of from to jump to to, which ran right after it without from jumping there. Blocks keep the */
+/* first two successors, a taken and a fallthrough edge, later ones return to the caller. */
+void jit_link(jit_t* jit, jit_block_t* from, jit_block_t* to);
+
+/* Invalidates blocks that overlap guest memory [addr, addr + len) and unlinks the exits jumping to them */
+void jit_invalidate(jit_t* jit, uint16_t addr, uint16_t len);
+
+/* Starts emitting a block for start. Returns NULL when the cache is full and has to be flushed. */
+jit_block_t* jit_block_begin(jit_t* jit, uint16_t start);
+
+/* Finishes the block. A block with zero length is kept as a marker that start is not compilable. */
+/* Returns NULL if the code buffer overflowed, the block is dropped then. */
+jit_block_t* jit_block_end(jit_t* jit, jit_block_t* block, uint16_t end, uint16_t length);
+
+/* Emitters, offsets are relative to the ctx the block is called with */
+void jit_emit_store8(jit_t* jit, int32_t offset, uint8_t value);
+
+void jit_emit_add8(jit_t* jit, int32_t offset, uint8_t value);
+
+void jit_emit_store16(jit_t* jit, int32_t offset, uint16_t value);
+
+void jit_emit_move8(jit_t* jit, int32_t dst, int32_t src);
+
+void jit_emit_or8(jit_t* jit, int32_t dst, int32_t src);
+
+void jit_emit_and8(jit_t* jit, int32_t dst, int32_t src);
+
+void jit_emit_xor8(jit_t* jit, int32_t dst, int32_t src);
+
+/* Emits fn(ctx, arg) */
+void jit_emit_call(jit_t* jit, uintptr_t fn, uintptr_t arg);
+
+#endif // JIT_H
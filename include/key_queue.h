@@ -0,0 +1,20 @@
+#ifndef KEY_QUEUE_H
+#define KEY_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Keypad transitions passed from one producer thread to one consumer thread without locks */
+typedef struct key_queue key_queue_t;
+
+key_queue_t* key_queue_create(void);
+
+void key_queue_destroy(key_queue_t* q);
+
+/* Producer side. Returns false if the queue is full and the transition was dropped. */
+bool key_queue_push(key_queue_t* q, uint8_t key, bool pressed);
+
+/* Consumer side. Returns false if the queue is empty. */
+bool key_queue_pop(key_queue_t* q, uint8_t* key, bool* pressed);
+
+#endif // KEY_QUEUE_H
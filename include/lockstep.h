@@ -0,0 +1,65 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+/* Many copies of one ROM stepped together, one lane per copy. Registers, timers, stacks and screens are kept */
+/* as arrays indexed by lane, so lanes that are at the same address run its instruction together, with AVX2 */
+/* where the host has it. Lanes that went their own way, and instructions without a vector kernel, run one */
+/* lane at a time. Every lane behaves like an interpreter cpu_instance_t running the same ROM. */
+typedef struct lockstep lockstep_t;
+
+/* Registers of one lane, see lockstep_get_lane */
+struct lockstep_lane {
+	uint8_t v[16];
+	uint16_t i;
+	uint16_t pc;
+	uint8_t delay_timer;
+	uint8_t sound_timer;
+	uint8_t sp;
+	uint16_t stack[16];
+};
+
+struct lockstep_stats {
+	uint64_t cycles;        // steps, every lane runs one instruction per step
+	uint64_t groups;        // sets of lanes that ran an instruction together
+	uint64_t vector_lanes;  // lane instructions run by a vector kernel
+	uint64_t scalar_lanes;  // lane instructions run one lane at a time
+	uint64_t unknown;       // lane instructions that could not be decoded, the lane stays where it is
+};
+
+/* Returns NULL if lanes is not positive, the ROM does not fit or memory runs out */
+lockstep_t* lockstep_create(int lanes, const uint8_t* rom, size_t len);
+
+void lockstep_destroy(lockstep_t* l);
+
+int lockstep_lanes(lockstep_t* l);
+
+/* Instructions per 60 Hz frame, 9 by default as for cpu_instance_t */
+enum CpuResult lockstep_set_cycles_per_frame(lockstep_t* l, int cycles);
+
+/* Keypad keys held down in lane, bit n for key n */
+void lockstep_set_keys(lockstep_t* l, int lane, uint16_t keys);
+
+/* RND seed of lane, as cpu_set_seed. Lanes start out with CPU_DEFAULT_SEED and stay together until they differ. */
+void lockstep_set_seed(lockstep_t* l, int lane, uint64_t seed);
+
+void lockstep_run_cycles(lockstep_t* l, int cycles);
+
+void lockstep_run_frames(lockstep_t* l, int frames);
+
+void lockstep_get_lane(lockstep_t* l, int lane, struct lockstep_lane* state);
+
+/* Screen row r of lane, packed as in image.h */
+uint64_t lockstep_row(lockstep_t* l, int lane, int r);
+
+void lockstep_get_stats(lockstep_t* l, struct lockstep_stats* stats);
+
+/* False when the vector kernels are not available on this host and every lane runs on its own */
+bool lockstep_vectorized(lockstep_t* l);
+
+#endif // LOCKSTEP_H
@@ -0,0 +1,21 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Byte oriented LZ77 in the manner of LZ4: sequences of literals followed by a match of at least 4 bytes */
+/* up to 64 KiB back. Fast rather than tight, meant for traces that repeat a lot. */
+
+/* Largest output of lz_compress for len bytes of input */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* Compresses len bytes of src into dst, which needs LZ_BOUND(len) bytes. Returns the compressed size. */
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst);
+
+/* Decompresses size bytes of src into dst. Returns false unless src is intact and decompresses to exactly len */
+/* bytes, damaged input is never read or written past its bounds. */
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t len);
+
+#endif // LZ_H
@@ -0,0 +1,37 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#include "cpu.h"
+#include "histogram.h"
+
+/* Exports histograms in the Prometheus text format, to a file or to whoever connects to a Unix socket. */
+/* Durations are recorded in nanoseconds and exported in seconds, as Prometheus expects. */
+typedef struct metrics metrics_t;
+
+metrics_t* metrics_create(void);
+
+/* Stops serving, the histograms stay with their owners */
+void metrics_destroy(metrics_t* metrics);
+
+/* Exports histogram as name, a Prometheus metric name, with labels such as instance="1" or NULL. Series of */
+/* the same name are grouped under one help text. Everything has to be added before metrics_serve. */
+enum CpuResult metrics_add_histogram(metrics_t* metrics, const char* name, const char* help, const char* labels,
+		histogram_t* histogram);
+
+/* Adds the timing histograms of a CPU instance, see cpu_get_timing */
+enum CpuResult metrics_add_cpu(metrics_t* metrics, cpu_instance_t* instance, const char* labels);
+
+enum CpuResult metrics_write(metrics_t* metrics, FILE* f);
+
+/* Replaces path in one rename, so that a reader never sees half of it */
+enum CpuResult metrics_write_file(metrics_t* metrics, const char* path);
+
+/* Listens on a Unix socket at path from a thread of its own, every connection is sent the current metrics */
+/* and closed, socat - UNIX-CONNECT:path reads them. A stale socket at path, one that refuses connections, is */
+/* replaced, a socket something still listens on or any other file there is an error. The socket is removed */
+/* again by metrics_destroy. */
+enum CpuResult metrics_serve(metrics_t* metrics, const char* path);
+
+#endif // METRICS_H
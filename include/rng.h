@@ -0,0 +1,31 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* xorshift64*, the generator behind RND. Each CPU has its own so runs with the same seed are reproducible. */
+
+/* State for a seed, spread with splitmix64 so that close seeds start far apart. The state is never zero. */
+static inline uint64_t rng_seed(uint64_t seed) {
+	uint64_t z;
+
+	z = seed + 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return z ? z : 1;
+}
+
+/* Next random byte, the top bits of the output are the strongest */
+static inline uint8_t rng_byte(uint64_t* state) {
+	uint64_t x;
+
+	x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (x * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+#endif // RNG_H
@@ -1,6 +1,8 @@
 #ifndef SDL_WRAPPER_H
 #define SDL_WRAPPER_H
 
+#include <stdbool.h>
+
 #include <SDL2/SDL_events.h>
 
 typedef struct sdl_view sdl_view_t;
@@ -9,18 +11,33 @@ sdl_view_t* sdl_wrapper_create_view(char* title, int width, int height, int wind
 
 void sdl_wrapper_destroy_view(sdl_view_t* view);
 
-SDL_Event* sdl_wrapper_update(sdl_view_t* view, int* events_count);
+/* Presents the frame texture */
+void sdl_wrapper_update(sdl_view_t* view);
 
-void sdl_wrapper_set_frame_rgb24(sdl_view_t* view, uint8_t* rgb24, int height);
+/* Sets the window title if it differs from the current one */
+void sdl_wrapper_set_title(sdl_view_t* view, const char* title);
 
-int sdl_wrapper_get_view_height(sdl_view_t* view);
+/* Takes the next pending event, returns false if there is none */
+bool sdl_wrapper_poll_event(sdl_view_t* view, SDL_Event* event);
 
-int sdl_wrapper_get_view_width(sdl_view_t* view);
+/* Blocks until an event arrives or timeout_ms passes, returns false on timeout */
+bool sdl_wrapper_wait_event(sdl_view_t* view, SDL_Event* event, int timeout_ms);
+
+/* Wakes a thread blocked in sdl_wrapper_wait_event with a frame event. Safe to call from any thread, */
+/* at most one frame event is queued at a time and none while the window is hidden or minimized. */
+void sdl_wrapper_signal_frame(sdl_view_t* view);
 
-SDL_Event* sdl_wrapper_get_events(sdl_view_t* view);
+/* False while the window is hidden or minimized */
+bool sdl_wrapper_is_visible(sdl_view_t* view);
 
-size_t sdl_wrapper_get_events_count(sdl_view_t* view);
+/* Locks the given area of the XRGB8888 frame texture for writing, pixels points at its top left corner. */
+/* Only that area is uploaded on unlock. Every successful lock has to be followed by an unlock. */
+bool sdl_wrapper_lock_frame(sdl_view_t* view, int x, int y, int w, int h, void** pixels, int* pitch);
 
-void sdl_wrapper_set_events(sdl_view_t* view, SDL_Event* events, int events_count);
+void sdl_wrapper_unlock_frame(sdl_view_t* view);
+
+int sdl_wrapper_get_view_height(sdl_view_t* view);
+
+int sdl_wrapper_get_view_width(sdl_view_t* view);
 
 #endif // SDL_WRAPPER_H
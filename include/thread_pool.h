@@ -0,0 +1,36 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* A fixed set of worker threads with one task deque each. Workers run their own tasks newest first and */
+/* steal the oldest ones from other workers when they run out, so resubmitted tasks stay on a warm core */
+/* while idle cores take over whatever is left elsewhere. */
+typedef struct thread_pool thread_pool_t;
+
+typedef void (*thread_pool_fn_t)(void* arg);
+
+struct thread_pool_stats {
+	uint64_t executed;
+	uint64_t stolen; // tasks run by a worker other than the one they were queued on
+};
+
+/* threads <= 0 starts one worker per online core */
+thread_pool_t* thread_pool_create(int threads);
+
+/* Waits for queued tasks to finish before stopping the workers */
+void thread_pool_destroy(thread_pool_t* pool);
+
+int thread_pool_threads(thread_pool_t* pool);
+
+/* Safe from any thread. Tasks submitted by a task go to the deque of the worker running it, others are */
+/* spread over the workers in turn. Returns false if memory runs out. */
+bool thread_pool_submit(thread_pool_t* pool, thread_pool_fn_t fn, void* arg);
+
+/* Blocks until every submitted task, including the ones submitted by tasks, has finished */
+void thread_pool_wait(thread_pool_t* pool);
+
+void thread_pool_get_stats(thread_pool_t* pool, struct thread_pool_stats* stats);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+
+/* Execution trace of every instruction an instance runs, see cpu_set_trace. Each step is a variable length */
+/* record of what the instruction changed, usually 3 to 6 bytes. The CPU thread only encodes records into a */
+/* block; full blocks queue up for a writer thread, which optionally compresses them with lz.h and writes */
+/* them out. If the writer is so far behind that no buffer is free when a block fills up, the block is dropped */
+/* instead of stalling the CPU, the trace then has a gap. Blocks decode on their own and the file ends with */
+/* an index of their first cycles, so that a reader can start anywhere. */
+typedef struct trace trace_t;
+typedef struct trace_reader trace_reader_t;
+
+#define TRACE_MAGIC 0x52543843 // "C8TR"
+#define TRACE_VERSION 1
+
+/* One instruction */
+struct trace_step {
+	uint64_t cycle;       // num_cycles before it ran
+	uint16_t pc;
+	uint16_t opcode;
+	uint16_t index;       // I after it, only if index_changed
+	bool index_changed;
+	uint16_t changed;     // bit n if it changed Vn
+	uint8_t v[16];        // registers after it, only those in changed
+	uint16_t write_addr;  // memory it wrote, if write_len is not 0
+	uint8_t write_len;
+	uint8_t write[16];
+	bool tick;            // the timers ticked after it
+};
+
+struct trace_stats {
+	uint64_t steps;         // recorded
+	uint64_t dropped_steps; // in blocks the writer could not take in time, unknown for a trace that was not closed
+	uint64_t raw_bytes;     // of encoded steps
+	uint64_t file_bytes;
+};
+
+/* Starts a writer thread for a new trace file at path, compressing blocks if compress is set */
+trace_t* trace_create(const char* path, bool compress);
+
+/* Writes what is left and the index, then frees the trace. Only once no CPU records to it anymore. */
+enum CpuResult trace_close(trace_t* trace, struct trace_stats* stats);
+
+/* Called by the CPU for every instruction it runs */
+void trace_record(trace_t* trace, const struct trace_step* step);
+
+/* Returns NULL if the file cannot be read or is not a trace. A trace that was never closed, because the */
+/* process died, is read up to its last complete block. */
+trace_reader_t* trace_open(const char* path);
+
+void trace_reader_close(trace_reader_t* reader);
+
+/* Positions the reader at the first recorded step at or after cycle, false if there is none. A rewound trace */
+/* records cycles more than once, the reader goes to the last block starting at or before cycle that gets to */
+/* it, and within that block to the first step that does. */
+bool trace_seek(trace_reader_t* reader, uint64_t cycle);
+
+/* Reads the next step, false at the end of the trace or if a block is damaged */
+bool trace_next(trace_reader_t* reader, struct trace_step* step);
+
+/* Blocks in the trace, for reporting */
+size_t trace_blocks(trace_reader_t* reader);
+
+void trace_reader_stats(trace_reader_t* reader, struct trace_stats* stats);
+
+#endif // TRACE_H
@@ -0,0 +1,34 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Hands buffers from one writer thread to one reader thread without locks. The writer always has a buffer */
+/* to fill and the reader always gets the newest published one, frames published in between are dropped. */
+typedef struct triple_buffer triple_buffer_t;
+
+/* All three buffers are size bytes and start out zeroed */
+triple_buffer_t* triple_buffer_create(size_t size);
+
+void triple_buffer_destroy(triple_buffer_t* tb);
+
+/* Writer side: the buffer to fill next */
+void* triple_buffer_back(triple_buffer_t* tb);
+
+/* Writer side: makes the back buffer the newest frame and takes a free one as the new back buffer */
+void triple_buffer_publish(triple_buffer_t* tb);
+
+/* Reader side: takes the newest frame if one was published since the last call. Returns false otherwise, */
+/* the front buffer stays the same then. */
+bool triple_buffer_acquire(triple_buffer_t* tb);
+
+/* Reader side: the frame taken by the last successful triple_buffer_acquire */
+const void* triple_buffer_front(triple_buffer_t* tb);
+
+uint64_t triple_buffer_published(triple_buffer_t* tb);
+
+uint64_t triple_buffer_acquired(triple_buffer_t* tb);
+
+#endif // TRIPLE_BUFFER_H
@@ -0,0 +1,102 @@
+#include "aot.h"
+
+#include <stdlib.h>
+#include <dlfcn.h>
+
+#include <log.h>
+
+// one slot per even guest address
+#define AOT_SLOTS 2048
+
+struct aot {
+	void* handle;
+	const struct aot_module* module;
+	const struct aot_block* by_address[AOT_SLOTS];
+};
+
+uint32_t aot_checksum(const uint8_t* data, size_t len) {
+	uint32_t hash;
+	size_t i;
+
+	hash = 2166136261u;
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+aot_t* aot_load(const char* path, const uint8_t* rom, size_t rom_size) {
+	aot_t* aot;
+	const struct aot_block* block;
+	uint32_t i;
+	uint16_t addr;
+
+	aot = calloc(1, sizeof(struct aot));
+	if (!aot) {
+		return NULL;
+	}
+	aot->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!aot->handle) {
+		log_error("Unable to load translated ROM %s: %s", path, dlerror());
+		free(aot);
+		return NULL;
+	}
+	aot->module = dlsym(aot->handle, AOT_MODULE_SYMBOL);
+	if (!aot->module) {
+		log_error("%s does not export %s", path, AOT_MODULE_SYMBOL);
+		aot_unload(aot);
+		return NULL;
+	}
+	if (aot->module->abi_version != AOT_ABI_VERSION) {
+		log_error("%s was translated for ABI %u, expected %u", path, aot->module->abi_version, AOT_ABI_VERSION);
+		aot_unload(aot);
+		return NULL;
+	}
+	if (aot->module->rom_size != rom_size || aot->module->rom_checksum != aot_checksum(rom, rom_size)) {
+		log_error("%s was translated from a different ROM", path);
+		aot_unload(aot);
+		return NULL;
+	}
+	for (i = 0; i < aot->module->blocks_count; i++) {
+		block = &aot->module->blocks[i];
+		for (addr = block->start; addr < block->end && (addr >> 1) < AOT_SLOTS; addr += 2) {
+			aot->by_address[addr >> 1] = block;
+		}
+	}
+	log_info("Loaded %u translated blocks from %s", aot->module->blocks_count, path);
+	return aot;
+}
+
+void aot_unload(aot_t* aot) {
+	dlclose(aot->handle);
+	free(aot);
+}
+
+const struct aot_block* aot_lookup(aot_t* aot, uint16_t pc) {
+	if (pc & 0xF001) {
+		return NULL;
+	}
+	return aot->by_address[pc >> 1];
+}
+
+void aot_invalidate(aot_t* aot, uint16_t addr, uint16_t len) {
+	const struct aot_block* block;
+	size_t i;
+	size_t last;
+	uint16_t a;
+
+	if (len == 0) {
+		return;
+	}
+	last = ((size_t) addr + len - 1) >> 1;
+	for (i = addr >> 1; i <= last && i < AOT_SLOTS; i++) {
+		block = aot->by_address[i];
+		if (!block) {
+			continue;
+		}
+		for (a = block->start; a < block->end && (a >> 1) < AOT_SLOTS; a += 2) {
+			aot->by_address[a >> 1] = NULL;
+		}
+	}
+}
@@ -0,0 +1,340 @@
+#include "async_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+// power of two, records of a thread in flight between two drains
+#define RING_SIZE 256
+#define MESSAGE_SIZE 512
+#define NSEC_PER_SEC 1000000000LL
+/* How often the background thread drains the rings */
+static const struct timespec drain_interval = { 0, 10000000 };
+
+/* Fixed size, the site holds everything that does not change between calls */
+struct record {
+	const struct async_log_site* site;
+	uint64_t suppressed;
+	int count;
+	struct async_log_arg args[ASYNC_LOG_MAX_ARGS];
+};
+
+enum RingState {
+	RING_OWNED,  // a live thread writes to it
+	RING_CLOSED, // its thread exited, records may be left
+	RING_FREE    // drained after its thread exited, another thread can take it over
+};
+
+/* Written by one thread, read by the drain. Rings are never freed, a new thread reuses a free one. */
+struct ring {
+	struct record records[RING_SIZE];
+	_Atomic(uint32_t) head; // next record to read, written by the drain
+	_Atomic(uint32_t) tail; // next record to write, written by the owner
+	_Atomic(uint64_t) dropped[LOG_FATAL + 1]; // by level, reported at that level so log.h filters them alike
+	_Atomic(int) state;
+	struct ring* next;
+};
+
+static _Atomic(struct ring*) rings;
+static _Thread_local struct ring* thread_ring;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+// held while draining, so that records of a thread are written out in order
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drain_thread;
+static bool drain_started;
+static _Atomic(bool) draining;
+
+/* Formats a single conversion, the va_list keeps the non-literal format acceptable to -Wformat-nonliteral */
+static int format_value(char* out, size_t size, const char* spec, ...) {
+	va_list ap;
+	int len;
+
+	va_start(ap, spec);
+	len = vsnprintf(out, size, spec, ap);
+	va_end(ap);
+	return len;
+}
+
+/* Formats an argument for the conversion spec ends with, passing it as the type the conversion expects */
+static int format_arg(char* out, size_t size, const char* spec, size_t len, const struct async_log_arg* arg) {
+	char conv;
+	char modifier;
+	bool twice;
+	uint64_t i;
+
+	conv = spec[len - 1];
+	modifier = len > 2 ? spec[len - 2] : '\0';
+	twice = len > 3 && spec[len - 3] == modifier;
+	i = arg->value.i;
+	switch (conv) {
+		case 'd':
+		case 'i':
+			if (arg->type != ASYNC_LOG_INT) {
+				break;
+			}
+			switch (modifier) {
+				case 'l':
+					return twice ? format_value(out, size, spec, (long long) i) : format_value(out, size, spec, (long) i);
+				case 'j':
+					return format_value(out, size, spec, (intmax_t) i);
+				case 'z':
+					return format_value(out, size, spec, (ssize_t) i);
+				case 't':
+					return format_value(out, size, spec, (ptrdiff_t) i);
+				default:
+					return format_value(out, size, spec, (int) i);
+			}
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+			if (arg->type != ASYNC_LOG_INT) {
+				break;
+			}
+			switch (modifier) {
+				case 'l':
+					return twice ? format_value(out, size, spec, (unsigned long long) i) :
+						format_value(out, size, spec, (unsigned long) i);
+				case 'j':
+					return format_value(out, size, spec, (uintmax_t) i);
+				case 'z':
+					return format_value(out, size, spec, (size_t) i);
+				case 't':
+					return format_value(out, size, spec, (ptrdiff_t) i);
+				default:
+					return format_value(out, size, spec, (unsigned) i);
+			}
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (arg->type != ASYNC_LOG_DOUBLE) {
+				break;
+			}
+			if (modifier == 'L') {
+				return format_value(out, size, spec, (long double) arg->value.d);
+			}
+			return format_value(out, size, spec, arg->value.d);
+		case 's':
+			if (arg->type != ASYNC_LOG_POINTER) {
+				break;
+			}
+			return format_value(out, size, spec, arg->value.p ? (const char*) arg->value.p : "(null)");
+		case 'p':
+			if (arg->type != ASYNC_LOG_POINTER) {
+				break;
+			}
+			return format_value(out, size, spec, arg->value.p);
+		default:
+			break;
+	}
+	// a conversion that does not fit the argument is left as it is
+	return snprintf(out, size, "%s", spec);
+}
+
+/* Formats the record the way printf would have, a conversion without an argument is left as it is */
+static void format_record(char* out, size_t size, const struct record* record) {
+	char spec[32];
+	const char* fmt;
+	const char* start;
+	size_t used;
+	size_t len;
+	int arg;
+	int n;
+
+	fmt = record->site->fmt;
+	used = 0;
+	arg = 0;
+	while (*fmt && used < size - 1) {
+		if (*fmt != '%') {
+			out[used++] = *fmt++;
+			continue;
+		}
+		if (fmt[1] == '%') {
+			out[used++] = '%';
+			fmt += 2;
+			continue;
+		}
+		start = fmt++;
+		fmt += strspn(fmt, "-+ #0");
+		fmt += strspn(fmt, "0123456789");
+		if (*fmt == '.') {
+			fmt++;
+			fmt += strspn(fmt, "0123456789");
+		}
+		fmt += strspn(fmt, "hljztL");
+		if (*fmt) {
+			fmt++;
+		}
+		len = fmt - start;
+		if (len >= sizeof(spec)) {
+			len = sizeof(spec) - 1;
+		}
+		memcpy(spec, start, len);
+		spec[len] = '\0';
+		if (arg < record->count) {
+			n = format_arg(out + used, size - used, spec, len, &record->args[arg++]);
+		} else {
+			n = snprintf(out + used, size - used, "%s", spec);
+		}
+		used += n < 0 ? 0 : (size_t) n < size - used ? (size_t) n : size - used - 1;
+	}
+	out[used] = '\0';
+}
+
+static void write_record(const struct record* record) {
+	char message[MESSAGE_SIZE];
+
+	format_record(message, sizeof(message), record);
+	if (record->suppressed) {
+		log_log(record->site->level, record->site->file, record->site->line, "%s (%llu more suppressed)", message,
+				(unsigned long long) record->suppressed);
+	} else {
+		log_log(record->site->level, record->site->file, record->site->line, "%s", message);
+	}
+}
+
+static void drain(void) {
+	struct ring* ring;
+	uint32_t head;
+	uint64_t dropped;
+	bool closed;
+	int level;
+
+	pthread_mutex_lock(&drain_lock);
+	for (ring = atomic_load(&rings); ring; ring = ring->next) {
+		// read first, whatever a thread wrote before it exited is then visible below
+		closed = atomic_load(&ring->state) == RING_CLOSED;
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		while (head != atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+			write_record(&ring->records[head % RING_SIZE]);
+			head++;
+			atomic_store_explicit(&ring->head, head, memory_order_release);
+		}
+		for (level = LOG_TRACE; level <= LOG_FATAL; level++) {
+			dropped = atomic_exchange(&ring->dropped[level], 0);
+			if (dropped) {
+				log_log(level, __FILE__, __LINE__, "Log ring full, dropped %llu records", (unsigned long long) dropped);
+			}
+		}
+		if (closed) {
+			atomic_store(&ring->state, RING_FREE);
+		}
+	}
+	pthread_mutex_unlock(&drain_lock);
+}
+
+void async_log_flush(void) {
+	drain();
+}
+
+static void* drain_loop(void* arg) {
+	(void) arg;
+	while (atomic_load(&draining)) {
+		nanosleep(&drain_interval, NULL);
+		drain();
+	}
+	return NULL;
+}
+
+/* Writes out what is left when the process exits */
+static void stop(void) {
+	if (drain_started) {
+		atomic_store(&draining, false);
+		pthread_join(drain_thread, NULL);
+	}
+	drain();
+}
+
+static void close_ring(void* ring) {
+	atomic_store(&((struct ring*) ring)->state, RING_CLOSED);
+}
+
+static void start(void) {
+	pthread_key_create(&ring_key, close_ring);
+	atomic_store(&draining, true);
+	drain_started = pthread_create(&drain_thread, NULL, drain_loop, NULL) == 0;
+	// without the thread records only go out on async_log_flush and at exit
+	atexit(stop);
+}
+
+/* Gives the calling thread a ring of its own, NULL if there is no memory for one */
+static struct ring* attach_ring(void) {
+	struct ring* ring;
+	int state;
+
+	pthread_once(&start_once, start);
+	for (ring = atomic_load(&rings); ring; ring = ring->next) {
+		state = RING_FREE;
+		if (atomic_compare_exchange_strong(&ring->state, &state, RING_OWNED)) {
+			break;
+		}
+	}
+	if (!ring) {
+		ring = calloc(1, sizeof(struct ring));
+		if (!ring) {
+			return NULL;
+		}
+		atomic_init(&ring->state, RING_OWNED);
+		ring->next = atomic_load(&rings);
+		while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+		}
+	}
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+static int64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+void async_log_write(struct async_log_site* site, int count, const struct async_log_arg* args) {
+	struct record* record;
+	struct ring* ring;
+	uint64_t suppressed;
+	uint32_t tail;
+	int64_t now;
+
+	suppressed = 0;
+	if (site->limit_ns) {
+		now = now_ns();
+		if (now < atomic_load_explicit(&site->next_ns, memory_order_relaxed)) {
+			atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+			return;
+		}
+		atomic_store_explicit(&site->next_ns, now + site->limit_ns, memory_order_relaxed);
+		suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+	}
+	ring = thread_ring ? thread_ring : attach_ring();
+	if (!ring) {
+		return;
+	}
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped[site->level], 1, memory_order_relaxed);
+		return;
+	}
+	record = &ring->records[tail % RING_SIZE];
+	record->site = site;
+	record->suppressed = suppressed;
+	record->count = count;
+	if (count > 0) {
+		memcpy(record->args, args, count * sizeof(struct async_log_arg));
+	}
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
@@ -0,0 +1,159 @@
+#include "batch.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <log.h>
+
+#include <thread_pool.h>
+
+#define NSEC_PER_SEC 1000000000LL
+
+struct job {
+	batch_t* batch;
+	cpu_instance_t* instance;
+	uint64_t frames_left;
+	bool dropped;             // the next slice could not be queued, frames_left were never run
+	struct batch_stats stats; // only touched by the worker running the current slice
+};
+
+struct batch {
+	thread_pool_t* pool;
+	struct job** jobs; // separately allocated so workers never write next to each other's jobs
+	int count;
+	int capacity;
+	int slice_frames;
+	uint64_t elapsed_ns;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+batch_t* batch_create(int threads) {
+	batch_t* batch;
+
+	batch = calloc(1, sizeof(struct batch));
+	if (!batch) {
+		return NULL;
+	}
+	batch->pool = thread_pool_create(threads);
+	if (!batch->pool) {
+		log_error("Unable to start batch workers");
+		free(batch);
+		return NULL;
+	}
+	return batch;
+}
+
+void batch_destroy(batch_t* batch) {
+	int i;
+
+	thread_pool_destroy(batch->pool);
+	for (i = 0; i < batch->count; i++) {
+		free(batch->jobs[i]);
+	}
+	free(batch->jobs);
+	free(batch);
+}
+
+int batch_add(batch_t* batch, cpu_instance_t* instance, uint64_t frames) {
+	struct job** grown;
+	struct job* job;
+	int capacity;
+
+	if (batch->count == batch->capacity) {
+		capacity = batch->capacity ? batch->capacity * 2 : 16;
+		grown = realloc(batch->jobs, capacity * sizeof(struct job*));
+		if (!grown) {
+			return -1;
+		}
+		batch->jobs = grown;
+		batch->capacity = capacity;
+	}
+	job = calloc(1, sizeof(struct job));
+	if (!job) {
+		return -1;
+	}
+	job->batch = batch;
+	job->instance = instance;
+	job->frames_left = frames;
+	batch->jobs[batch->count] = job;
+	return batch->count++;
+}
+
+/* Runs one slice of a job and queues the next one on the same worker, other workers steal it if they idle */
+static void run_slice(void* arg) {
+	struct job* job;
+	uint64_t start;
+	uint64_t cycles;
+	int frames;
+
+	job = arg;
+	frames = job->frames_left < (uint64_t) job->batch->slice_frames ? (int) job->frames_left : job->batch->slice_frames;
+	start = now_ns();
+	cycles = cpu_get_cycles(job->instance);
+	cpu_run_frames(job->instance, frames);
+	job->stats.busy_ns += now_ns() - start;
+	job->stats.cycles += cpu_get_cycles(job->instance) - cycles;
+	job->stats.frames += frames;
+	job->stats.slices++;
+	job->frames_left -= frames;
+	if (job->frames_left > 0 && !thread_pool_submit(job->batch->pool, run_slice, job)) {
+		log_error("Dropping the remaining %llu frames of a batch instance", (unsigned long long) job->frames_left);
+		job->dropped = true;
+	}
+}
+
+enum CpuResult batch_run(batch_t* batch, int slice_frames) {
+	uint64_t start;
+	int i;
+	enum CpuResult res;
+
+	if (slice_frames < 1) {
+		log_error("Batch slices need at least one frame");
+		return INVALID_STATE;
+	}
+	batch->slice_frames = slice_frames;
+	start = now_ns();
+	for (i = 0; i < batch->count; i++) {
+		batch->jobs[i]->dropped = false;
+		if (batch->jobs[i]->frames_left > 0 && !thread_pool_submit(batch->pool, run_slice, batch->jobs[i])) {
+			thread_pool_wait(batch->pool);
+			return MEMORY_ERROR;
+		}
+	}
+	thread_pool_wait(batch->pool);
+	batch->elapsed_ns = now_ns() - start;
+	// waiting for the pool makes what the workers wrote into the jobs visible here
+	res = OK;
+	for (i = 0; i < batch->count; i++) {
+		if (batch->jobs[i]->dropped) {
+			res = MEMORY_ERROR;
+		}
+	}
+	return res;
+}
+
+void batch_get_stats(batch_t* batch, int index, struct batch_stats* stats) {
+	*stats = batch->jobs[index]->stats;
+}
+
+uint64_t batch_elapsed_ns(batch_t* batch) {
+	return batch->elapsed_ns;
+}
+
+int batch_threads(batch_t* batch) {
+	return thread_pool_threads(batch->pool);
+}
+
+uint64_t batch_steals(batch_t* batch) {
+	struct thread_pool_stats stats;
+
+	thread_pool_get_stats(batch->pool, &stats);
+	return stats.stolen;
+}
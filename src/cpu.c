@@ -6,29 +6,88 @@
 #include <memory.h>
 #include <stdatomic.h>
 #include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
 
 #include <log.h>
+#include <async_log.h>
 
 #include <utils.h>
 #include <image.h>
-#include "sdl_wrapper.h"
+#include <jit.h>
+#include <instruction.h>
+#include <aot.h>
+#include <triple_buffer.h>
+#include <key_queue.h>
+#include <history.h>
+#include <histogram.h>
+#include <input_log.h>
+#include <trace.h>
+#include <rng.h>
+
+#if defined(CPU_PROFILE_TICKS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 static const int refresh_rate_hz = 60;
+// the default clock, cpu_set_cycles_per_frame changes it per instance
 static const int cycle_speed_hz = refresh_rate_hz * 9;
-static const int cycles_per_frame = cycle_speed_hz / refresh_rate_hz;
+static const int default_cycles_per_frame = cycle_speed_hz / refresh_rate_hz;
+static const int max_cycles_per_frame = 1 << 20;
+
+#define NSEC_PER_SEC 1000000000LL
+static const int64_t frame_period_ns = NSEC_PER_SEC / refresh_rate_hz;
+// frames the catch up policy runs back to back before giving up and dropping the rest
+static const int64_t max_catch_up_frames = 5;
 
 #ifdef DEBUG
-#define dbg(...) log_debug(__VA_ARGS__);
+#define dbg(...) async_log_debug(__VA_ARGS__);
 #else
 #define dbg(...)
 #endif
 
+/* One decoded instruction per even address */
+#define ICACHE_ENTRIES 2048
+
+/* Jumps to an address before the code after it is scanned for superinstructions */
+#define FUSION_THRESHOLD 64
+/* Instructions scanned per fusion pass */
+#define FUSION_WINDOW 32
+#define OP_FUSED_FIRST OP_FUSED_SE_JP
+#define FUSED_OPS (OP_COUNT - OP_FUSED_FIRST)
+
+/* Upper bound for guest instructions in one compiled block */
+#define JIT_MAX_BLOCK_LENGTH 64
+
+/* Mean instructions between two timed ones of the ticks profile */
+#define PROFILE_SAMPLE_INTERVAL 256
+
+#define STATE_MAGIC 0x53533843 // "C8SS"
+#define STATE_HEADER_SIZE 20
+#define STATE_PAYLOAD_SIZE (CPU_STATE_SIZE - STATE_HEADER_SIZE)
+/* Restoring compares memory in pages, code is only invalidated in the ones that changed */
+#define STATE_PAGE 64
+
 struct cpu_instance {
 	uint16_t current_opcode;
 	uint8_t memory[4096];
+	struct instruction icache[ICACHE_ENTRIES];
+	struct instruction uncached;
+	uint8_t jump_counts[ICACHE_ENTRIES];
+	uint64_t fusion_hits[FUSED_OPS];
+	int fuse_limit; // cycles a superinstruction may use, keeps it from running past a timer tick
+	uint64_t idle_cycles; // cycles of delay timer polling skipped over instead of run
+#ifdef CPU_PROFILE
+	uint64_t profile_counts[OP_COUNT]; // instructions run per handler, superinstructions count once
+	uint64_t profile_ticks[OP_COUNT];  // host cycles spent in them, only with CPU_PROFILE_TICKS
+#ifdef CPU_PROFILE_TICKS
+	uint32_t profile_countdown; // instructions until the next timed one
+	uint32_t profile_gap;       // instructions the next timed one stands for
+	uint32_t profile_rng;
+#endif
+#endif
 	uint8_t v_registers[16];
 	uint16_t index_register;
 	uint16_t program_counter;
@@ -36,21 +95,46 @@ struct cpu_instance {
 	uint8_t sound_timer;
 	uint16_t stack[16];
 	uint16_t stack_pointer;
-	uint8_t keypad_state[16];
+	key_queue_t* key_events;
+	_Atomic(uint16_t) keys_down; // bit per key, only written by the CPU thread
+	uint16_t keys_latched; // keys pressed during the current frame, even if already released
 	uint64_t num_cycles;
+	uint64_t frame; // frames run since cpu_init, input logs are keyed by it
+	uint64_t seed;
+	uint64_t rng;   // RND generator state
+	struct input_log* input_log;
+	enum CpuInputMode input_mode;
+	size_t input_cursor;
+	int cycles_per_frame; // CPU thread only, takes new_cycles_per_frame at the start of a frame
+	_Atomic(int) new_cycles_per_frame;
+	uint64_t tick_at; // num_cycles at the next timer tick
+	_Atomic(bool) turbo;
+	_Atomic(uint64_t) cycle_rate; // emulated cycles per wall clock second, measured about once a second
 	_Atomic(bool) is_running;
+	_Atomic(int) backend;
+	bool load_translations; // whether cpu_init looks for <rom>.so, kept across cpu_init
+	jit_t* jit;
+	int32_t jit_budget; // cycles linked blocks may still run before they return
+	aot_t* aot;
+	struct aot_state aot_state; // what translated blocks run on, points into this instance
 	image_t* image;
+	triple_buffer_t* frames; // packed image rows handed to the renderer
+	uint64_t frames_unchanged;
+	void (*frame_notify)(void*);
+	void* frame_notify_arg;
+	history_t* history; // a state is pushed before every frame when set
+	trace_t* trace;     // every instruction is recorded into it when set
+	struct trace_step* traced; // the step being recorded, collects the memory it writes
+	_Atomic(bool) rewinding;
+	_Atomic(int) schedule_policy;
+	struct cpu_schedule_stats schedule; // written by the CPU thread only
+	histogram_t* timing[CPU_TIMINGS];   // recorded by the CPU thread started by cpu_start only
 	pthread_t thread;
-	void (*frame_callback)(int, uint8_t*, sdl_view_t*, image_t*, pthread_mutex_t*);
-	void (*key_callback)(sdl_view_t*, pthread_mutex_t*, uint8_t*);
-	uint8_t* rgb24;
-	sdl_view_t* view;
-	pthread_mutex_t* frame_mutex;
-	pthread_mutex_t* key_mutex;
 };
 
 enum CpuResult cpu_create_instance(cpu_instance_t** inst) {
-	*inst = malloc(sizeof(struct cpu_instance));
+	// zeroed so that an instance cpu_init never finished with can still be destroyed
+	*inst = calloc(1, sizeof(struct cpu_instance));
 	if (*inst == NULL) {
 		return MEMORY_ERROR;
 	}
@@ -82,33 +166,100 @@ static enum CpuResult read_file(char* filename, char** buf, unsigned long* len)
 	return OK;
 }
 
-static enum CpuResult load_rom(cpu_instance_t* inst, char* rom) {
+static void bind_aot_state(cpu_instance_t* inst);
+
+/* Picks up <rom>.so produced by rom2c, if there is one */
+static void load_translation(cpu_instance_t* inst, char* rom, unsigned long len) {
+	char path[4096];
+
+	// dlopen searches the library path for names without a slash
+	snprintf(path, sizeof(path), "%s%s.so", strchr(rom, '/') ? "" : "./", rom);
+	if (access(path, R_OK) != 0) {
+		return;
+	}
+	inst->aot = aot_load(path, inst->memory + 0x200, len);
+	if (inst->aot) {
+		bind_aot_state(inst);
+		atomic_store(&inst->backend, CPU_BACKEND_AOT);
+	}
+}
+
+static enum CpuResult load_rom_file(cpu_instance_t* inst, char* rom) {
 	char* buf;
 	unsigned long len;
 	enum CpuResult res;
 	res = read_file(rom, &buf, &len);
 	if (res != OK) {
-		free(inst);
 		return res;
 	}
-	memcpy(inst->memory + 0x200, buf, len);
-	log_info("Loaded %d bytes size rom", len);
+	res = cpu_load_rom(inst, (const uint8_t*) buf, len);
+	free(buf);
+	if (res != OK) {
+		return res;
+	}
+	log_info("Loaded %lu bytes size rom", len);
+	if (inst->load_translations) {
+		load_translation(inst, rom, len);
+	}
 	return res;
 }
 
-enum CpuResult cpu_init(
-		cpu_instance_t* inst,
-		char* rom,
-		void(* frame_callback)(int, uint8_t*, sdl_view_t*, image_t*, pthread_mutex_t*),
-		uint8_t* rgb24,
-		sdl_view_t* view, pthread_mutex_t* mu,
-		void(* key_callback)(sdl_view_t*, pthread_mutex_t*, uint8_t*)) {
+/* Drops the cached decodes that overlap memory[addr, addr + len), the range must lie within memory */
+static void drop_code(cpu_instance_t* inst, uint16_t addr, uint16_t len) {
+	size_t i;
+	size_t last;
+
+	last = ((size_t) addr + len - 1) >> 1;
+	// superinstructions read up to two slots ahead of their own
+	for (i = addr >> 1 > 2 ? (addr >> 1) - 2 : 0; i < addr >> 1; i++) {
+		if (inst->icache[i].op >= OP_FUSED_FIRST) {
+			inst->icache[i].op = OP_UNDECODED;
+		}
+	}
+	for (i = addr >> 1; i <= last && i < ICACHE_ENTRIES; i++) {
+		inst->icache[i].op = OP_UNDECODED;
+		inst->jump_counts[i] = 0;
+	}
+	if (inst->jit) {
+		jit_invalidate(inst->jit, addr, len);
+	}
+	if (inst->aot) {
+		aot_invalidate(inst->aot, addr, len);
+	}
+}
+
+/* Drops the cached decodes that overlap memory[addr, addr + len), wrapping around the end of memory */
+/* the way the stores through I do */
+static void invalidate_code(cpu_instance_t* inst, uint16_t addr, uint16_t len) {
+	size_t i;
+
+	if (len == 0) {
+		return;
+	}
+	addr &= 0xFFF;
+	if (inst->traced) {
+		inst->traced->write_addr = addr;
+		inst->traced->write_len = len < sizeof(inst->traced->write) ? len : sizeof(inst->traced->write);
+		for (i = 0; i < inst->traced->write_len; i++) {
+			inst->traced->write[i] = inst->memory[(addr + i) & 0xFFF];
+		}
+	}
+	if ((size_t) addr + len > sizeof(inst->memory)) {
+		drop_code(inst, 0, addr + len - sizeof(inst->memory));
+		len = sizeof(inst->memory) - addr;
+	}
+	drop_code(inst, addr, len);
+}
 
-	int width, height;
+enum CpuResult cpu_init(cpu_instance_t* inst, char* rom) {
+	int i;
 
+	if (atomic_load(&inst->is_running)) {
+		log_error("CPU must be stopped to reset it");
+		return INVALID_STATE;
+	}
 	memset(inst->memory, 0, sizeof(inst->memory));
 	memset(inst->v_registers, 0, sizeof(inst->v_registers));
-	memset(inst->keypad_state, 0, sizeof(inst->keypad_state));
 	memset(inst->stack, 0, sizeof(inst->stack));
 	inst->current_opcode = 0;
 	inst->index_register = 0;
@@ -117,8 +268,35 @@ enum CpuResult cpu_init(
 	inst->sound_timer = 0;
 	inst->stack_pointer = 0;
 	inst->num_cycles = 0;
+	inst->frame = 0;
+	inst->seed = CPU_DEFAULT_SEED;
+	inst->rng = rng_seed(CPU_DEFAULT_SEED);
+	inst->input_log = NULL;
+	inst->input_mode = CPU_INPUT_LIVE;
+	inst->input_cursor = 0;
+	inst->cycles_per_frame = default_cycles_per_frame;
+	atomic_init(&inst->new_cycles_per_frame, default_cycles_per_frame);
+	inst->tick_at = default_cycles_per_frame;
+	atomic_init(&inst->turbo, false);
+	atomic_init(&inst->cycle_rate, 0);
+	inst->fuse_limit = 0;
+	inst->idle_cycles = 0;
+	memset(inst->fusion_hits, 0, sizeof(inst->fusion_hits));
+#ifdef CPU_PROFILE
+	cpu_reset_profile(inst);
+#endif
 
 	atomic_init(&inst->is_running, false);
+	atomic_init(&inst->backend, CPU_BACKEND_INTERPRETER);
+	// compiled code and translations of the previous ROM, if the instance is reset
+	if (inst->jit) {
+		jit_destroy(inst->jit);
+		inst->jit = NULL;
+	}
+	if (inst->aot) {
+		aot_unload(inst->aot);
+		inst->aot = NULL;
+	}
 
 	// for 0:
 	// 0xF0 is 1111 0000 -> XXXX
@@ -144,17 +322,110 @@ enum CpuResult cpu_init(
 	};
 	memcpy(inst->memory + 0x50, fontset, sizeof(fontset));
 
-	width = sdl_wrapper_get_view_width(view);
-	height = sdl_wrapper_get_view_height(view);
-	inst->image = image_create(height,width);
-	image_set_all(inst->image, 0);
-	inst->frame_callback = frame_callback;
-	inst->rgb24 = rgb24;
-	inst->view = view;
-	inst->frame_mutex = mu;
-	inst->key_callback = key_callback;
+	if (inst->image) {
+		image_destroy(inst->image);
+	}
+	inst->image = image_create(CPU_SCREEN_HEIGHT, CPU_SCREEN_WIDTH);
+	if (!inst->image) {
+		log_error("Unable to create %dx%d image", CPU_SCREEN_WIDTH, CPU_SCREEN_HEIGHT);
+		return MEMORY_ERROR;
+	}
+	if (inst->frames) {
+		triple_buffer_destroy(inst->frames);
+	}
+	inst->frames = triple_buffer_create(CPU_SCREEN_HEIGHT * sizeof(uint64_t));
+	if (!inst->frames) {
+		log_error("Unable to create frame buffers");
+		return MEMORY_ERROR;
+	}
+	inst->frames_unchanged = 0;
+	inst->frame_notify = NULL;
+	inst->frame_notify_arg = NULL;
+	inst->history = NULL;
+	inst->trace = NULL;
+	inst->traced = NULL;
+	atomic_init(&inst->rewinding, false);
+	atomic_init(&inst->schedule_policy, CPU_SCHEDULE_CATCH_UP);
+	memset(&inst->schedule, 0, sizeof(inst->schedule));
+	for (i = 0; i < CPU_TIMINGS; i++) {
+		if (!inst->timing[i]) {
+			inst->timing[i] = histogram_create();
+		}
+		if (!inst->timing[i]) {
+			log_error("Unable to create timing histograms");
+			return MEMORY_ERROR;
+		}
+		histogram_reset(inst->timing[i]);
+	}
+	if (inst->key_events) {
+		key_queue_destroy(inst->key_events);
+	}
+	inst->key_events = key_queue_create();
+	if (!inst->key_events) {
+		log_error("Unable to create key queue");
+		return MEMORY_ERROR;
+	}
+	atomic_init(&inst->keys_down, 0);
+	inst->keys_latched = 0;
+	invalidate_code(inst, 0, sizeof(inst->memory));
+
+	if (!rom) {
+		return OK;
+	}
+	return load_rom_file(inst, rom);
+}
+
+enum CpuResult cpu_load_rom(cpu_instance_t* inst, const uint8_t* rom, size_t len) {
+	if (atomic_load(&inst->is_running)) {
+		log_error("CPU must be stopped to load a ROM");
+		return INVALID_STATE;
+	}
+	if (len > sizeof(inst->memory) - 0x200) {
+		log_error("ROM of %zu bytes does not fit into memory", len);
+		return MEMORY_ERROR;
+	}
+	// a translation belongs to the ROM it was made from
+	if (inst->aot) {
+		aot_unload(inst->aot);
+		inst->aot = NULL;
+		if (atomic_load(&inst->backend) == CPU_BACKEND_AOT) {
+			atomic_store(&inst->backend, CPU_BACKEND_INTERPRETER);
+		}
+	}
+	memset(inst->memory + 0x200, 0, sizeof(inst->memory) - 0x200);
+	memcpy(inst->memory + 0x200, rom, len);
+	invalidate_code(inst, 0x200, sizeof(inst->memory) - 0x200);
+	inst->program_counter = 0x200;
+	return OK;
+}
+
+void cpu_destroy_instance(cpu_instance_t* instance) {
+	int i;
 
-	return load_rom(inst, rom);
+	if (atomic_load(&instance->is_running)) {
+		cpu_stop(instance);
+	}
+	if (instance->jit) {
+		jit_destroy(instance->jit);
+	}
+	if (instance->aot) {
+		aot_unload(instance->aot);
+	}
+	if (instance->image) {
+		image_destroy(instance->image);
+	}
+	if (instance->frames) {
+		triple_buffer_destroy(instance->frames);
+	}
+	if (instance->key_events) {
+		key_queue_destroy(instance->key_events);
+	}
+	for (i = 0; i < CPU_TIMINGS; i++) {
+		if (instance->timing[i]) {
+			histogram_destroy(instance->timing[i]);
+		}
+	}
+	free(instance);
 }
 
 /* 1nnn - JP addr */
@@ -322,7 +593,7 @@ static void jpreg(cpu_instance_t* inst, uint16_t addr) {
 /* The interpreter generates a random number from 0 to 255, which is then ANDed with the value kk. */
 /* The results are stored in Vx. See instruction 8xy2 for more information on AND. */
 static void rnd(cpu_instance_t* inst, uint8_t reg_x, uint8_t value) {
-	inst->v_registers[reg_x] = (rand() % 256) & value;
+	inst->v_registers[reg_x] = rng_byte(&inst->rng) & value;
 	next(inst);
 }
 
@@ -337,28 +608,47 @@ static void draw(cpu_instance_t* inst, uint8_t reg_x, uint8_t reg_y, uint8_t n_r
 	uint8_t x;
 	uint8_t y;
 	bool pixels_unset;
+	const uint8_t* sprite;
+	uint8_t wrapped[16];
+	uint16_t i;
+	uint8_t row;
 
 	x = inst->v_registers[reg_x];
 	y = inst->v_registers[reg_y];
-	pixels_unset = image_xor_sprite(inst->image, x, y, n_rows, inst->memory + inst->index_register);
+	i = inst->index_register & 0xFFF;
+	sprite = inst->memory + i;
+	// a sprite running past the end of memory continues from its start
+	if (i + n_rows > sizeof(inst->memory)) {
+		for (row = 0; row < n_rows; row++) {
+			wrapped[row] = inst->memory[(i + row) & 0xFFF];
+		}
+		sprite = wrapped;
+	}
+	pixels_unset = image_xor_sprite(inst->image, x, y, n_rows, sprite);
 	inst->v_registers[0xF] = pixels_unset;
 	next(inst);
 }
 
+/* Keys tapped within the frame count as pressed for all of it, so short presses are not lost */
+static bool key_pressed(cpu_instance_t* inst, uint8_t key) {
+	uint16_t keys;
+
+	keys = atomic_load_explicit(&inst->keys_down, memory_order_relaxed) | inst->keys_latched;
+	return (keys >> (key & 0xF)) & 1;
+}
+
 /* Ex9E - SKP Vx */
 /* Skip next instruction if key with the value of Vx is pressed. */
 /* Checks the keyboard, and if the key corresponding to the value of Vx is currently in the down position, PC is increased by 2. */
 static void skey(cpu_instance_t* inst, uint8_t reg_x) {
-	inst->keypad_state[inst->v_registers[reg_x]] ? skip(inst) : next(inst);
-	inst->keypad_state[inst->v_registers[reg_x]] = 0; // reset button
+	key_pressed(inst, inst->v_registers[reg_x]) ? skip(inst) : next(inst);
 }
 
 /* ExA1 - SKNP Vx */
 /* Skip next instruction if key with the value of Vx is not pressed. */
 /* Checks the keyboard, and if the key corresponding to the value of Vx is currently in the up position, PC is increased by 2. */
 static void snkey(cpu_instance_t* inst, uint8_t reg) {
-	inst->keypad_state[inst->v_registers[reg]] ? next(inst) : skip(inst);
-	inst->keypad_state[inst->v_registers[reg]] = 0; // reset button
+	key_pressed(inst, inst->v_registers[reg]) ? next(inst) : skip(inst);
 }
 
 /* Fx07 - LD Vx, DT */
@@ -430,9 +720,10 @@ static void stbcd(cpu_instance_t* inst, uint8_t reg) {
 	tens = (value / 10) % 10;
 	ones = (value % 100) % 10;
 	i = inst->index_register;
-	inst->memory[i] = hundreds;
-	inst->memory[i + 1] = tens;
-	inst->memory[i + 2] = ones;
+	inst->memory[i & 0xFFF] = hundreds;
+	inst->memory[(i + 1) & 0xFFF] = tens;
+	inst->memory[(i + 2) & 0xFFF] = ones;
+	invalidate_code(inst, i, 3);
 	dbg("LD (store BCD) value: %d, res: %d%d%d", value, hundreds, tens, ones);
 	next(inst);
 }
@@ -444,8 +735,9 @@ static void streg(cpu_instance_t* inst, uint8_t reg) {
 	uint8_t v;
 
 	for (v = 0; v <= reg; v++) {
-		inst->memory[inst->index_register + v] = inst->v_registers[v];
+		inst->memory[(inst->index_register + v) & 0xFFF] = inst->v_registers[v];
 	}
+	invalidate_code(inst, inst->index_register, reg + 1);
 	next(inst);
 }
 
@@ -456,8 +748,9 @@ static void ldreg(cpu_instance_t* inst, uint8_t reg) {
 	uint8_t v;
 
 	for (v = 0; v <= reg; v++) {
-		dbg("(V%d <== M[%X] {%d})", v, inst->index_register + v, inst->memory[inst->index_register + v]);
-		inst->v_registers[v] = inst->memory[inst->index_register + v];
+		dbg("(V%d <== M[%X] {%d})", v, (inst->index_register + v) & 0xFFF,
+				inst->memory[(inst->index_register + v) & 0xFFF]);
+		inst->v_registers[v] = inst->memory[(inst->index_register + v) & 0xFFF];
 	}
 	next(inst);
 }
@@ -472,279 +765,1950 @@ static void ret(cpu_instance_t* inst) {
 	dbg("RET -- POPPED pc=0x%X off the stack.", inst->program_counter);
 }
 
-static enum CpuResult execute_instruction(cpu_instance_t* inst) {
-	uint16_t opcode;
-	uint16_t nnn; // nnn or addr - A 12-bit value, the lowest 12 bits of the instruction
-	uint8_t kk;   // kk or byte - An 8-bit value, the lowest 8 bits of the instruction
-	uint8_t x;    // x - A 4-bit value, the lower 4 bits of the high byte of the instruction
-	uint8_t y;    // y - A 4-bit value, the upper 4 bits of the low byte of the instruction
-	uint8_t n;    // n or nibble - A 4-bit value, the lowest 4 bits of the instruction
-
-	opcode = inst->current_opcode;
-	nnn = opcode & 0x0FFF;
-	kk = opcode & 0x00FF;
-	x = (opcode & 0x0F00) >> 8;
-	y = (opcode & 0x00F0) >> 4;
-	n = opcode & 0x000F;
-
-	if ( (opcode & 0xF000) == 0x1000 ) {
-		dbg("JP");
-		jp(inst, nnn);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0x2000 ) {
-		dbg("CALL");
-		call(inst, nnn);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0x3000 ) {
-		dbg("SE");
-		se(inst, x, kk);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0x4000 ) {
-		dbg("SNE");
-		sne(inst, x, kk);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x5000 ) {
-		dbg("SEREG");
-		sereg(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0x6000 ) {
-		dbg("LDIM");
-		ldim(inst, x, kk);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0x7000 ) {
-		dbg("ADDIM");
-		addim(inst, x, kk);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8000 ) {
-		dbg("LDV");
-		ldv(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8001 ) {
-		dbg("OR");
-		or(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8002 ) {
-		dbg("AND");
-		and(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8003 ) {
-		dbg("XOR");
-		xor(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8004 ) {
-		dbg("ADD");
-		add(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8005 ) {
-		dbg("SUB");
-		sub(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8006 ) {
-		dbg("SHR");
-		shr(inst, x);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x8007 ) {
-		dbg("SUBN");
-		subn(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x800E ) {
-		dbg("SHL");
-		shl(inst, x);
-		return OK;
-	} else if ( (opcode & 0xF00F) == 0x9000 ) {
-		dbg("SNEREG");
-		snereg(inst, x, y);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0xA000 ) {
-		dbg("LDI");
-		ldi(inst, nnn);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0xB000 ) {
-		dbg("JPREG");
-		jpreg(inst, nnn);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0xC000 ) {
-		dbg("RND");
-		rnd(inst, x, kk);
-		return OK;
-	} else if ( (opcode & 0xF000) == 0xD000 ) {
-		dbg("DRAW");
-		draw(inst, x, y, n);
-		return OK;
-	} else if ( (opcode & 0xF0FF) == 0xE09E ) {
-		dbg("SKEY");
-		skey(inst, x);
-		return OK;
-	} else if ( (opcode & 0xF0FF) == 0xE0A1 ) {
-		dbg("SNKEY");
-		snkey(inst, x);
-		return OK;
-	} else if ( (opcode & 0xF0FF) == 0xF007 ) {
-		dbg("RDELAY");
-      	rdelay(inst, x);
-		return OK;
-    } else if ( (opcode & 0xF0FF) == 0xF00A ) {
-		dbg("WAIT");
-      	waitkey(inst, x);
-		return OK;
-    } else if ( (opcode & 0xF0FF) == 0xF015 ) {
-		dbg("DELAY");
-      	wdelay(inst, x);
-		return OK;
-    } else if ( (opcode & 0xF0FF) == 0xF018 ) {
-		dbg("SOUND");
-      	wsound(inst, x);
-		return OK;
-    } else if ( (opcode & 0xF0FF) == 0xF01E ) {
-		dbg("ADDI");
-      	addi(inst, x);
-		return OK;
-    } else if ( (opcode & 0xF0FF) == 0xF029 ) {
-		dbg("LDSPRITE");
-      	ldsprite(inst, x);
-		return OK;
-    } else if ( (opcode & 0xF0FF) == 0xF033 ) {
-		dbg("STBCD");
-      	stbcd(inst, x);
-		return OK;
-    } else if ((opcode & 0xF0FF) == 0xF055 ) {
-		dbg("STREG");
-      	streg(inst, x);
-		return OK;
-    } else if ( (opcode & 0xF0FF) == 0xF065 ) {
-		dbg("LDREG");
-      	ldreg(inst, x);
-		return OK;
-    } else if (opcode == 0x00E0) {
-		dbg("CLS");
-		cls(inst);
-		return OK;
-	} else if (opcode == 0x00EE) {
-		dbg("RET");
-		ret(inst);
-		return OK;
-	} else if (opcode == 0x0) {
-		return OK;
+/* Decodes the instruction at the program counter into its icache slot */
+static const struct instruction* decode_cached(cpu_instance_t* inst) {
+	struct instruction* ins;
+	uint16_t pc;
+
+	pc = inst->program_counter;
+	ins = &inst->icache[pc >> 1];
+	instruction_decode(inst->memory[pc] << 8 | inst->memory[pc + 1], ins);
+#ifdef CPU_PROFILE
+	// execute_instruction counted the slot before it was decoded
+	inst->profile_counts[OP_UNDECODED]--;
+	inst->profile_counts[ins->op]++;
+#endif
+	return ins;
+}
+
+#ifdef CPU_DISPATCH_CHAIN
+/* Decodes the instruction at the program counter through the mask chain on every fetch, the way it ran */
+/* before the instruction cache, so that make bench-dispatch compares the cache against it. Superinstructions */
+/* are never fetched from the cache and do not run either. */
+static const struct instruction* fetch(cpu_instance_t* inst) {
+	uint16_t pc;
+
+	pc = inst->program_counter;
+	instruction_decode(inst->memory[pc & 0xFFF] << 8 | inst->memory[(pc + 1) & 0xFFF], &inst->uncached);
+	return &inst->uncached;
+}
+#else
+/* Returns the instruction at the program counter, which may still be OP_UNDECODED. */
+/* Odd and out of range addresses bypass the cache and are decoded on every fetch. */
+static const struct instruction* fetch(cpu_instance_t* inst) {
+	uint16_t pc;
+
+	pc = inst->program_counter;
+	if (pc & 0xF001) {
+		instruction_decode(inst->memory[pc & 0xFFF] << 8 | inst->memory[(pc + 1) & 0xFFF], &inst->uncached);
+		return &inst->uncached;
 	}
+	return &inst->icache[pc >> 1];
+}
+#endif
+
+typedef enum CpuResult (*op_handler_t)(cpu_instance_t*, const struct instruction*);
 
+static void note_jump_target(cpu_instance_t* inst, uint16_t addr);
+
+static enum CpuResult op_unknown(cpu_instance_t* inst, const struct instruction* ins) {
+	inst->current_opcode = ins->opcode;
 	return INSTRUCTION_NOT_FOUND;
 }
 
-static void run_cycle(cpu_instance_t* inst) {
-	enum CpuResult res;
+static enum CpuResult op_nop(cpu_instance_t* inst, const struct instruction* ins) {
+	UNUSED(inst);
+	UNUSED(ins);
+	return OK;
+}
 
-	inst->current_opcode = inst->memory[inst->program_counter] << 8 | inst->memory[inst->program_counter + 1];
-	res = execute_instruction(inst);
-	if (res != OK) {
-		log_error("Instruction not found for opcode 0x%X", inst->current_opcode);
-	}
-	inst->num_cycles++;
-	if (inst->num_cycles % cycles_per_frame == 0) {
-		if (inst->delay_timer > 0) {
-			inst->delay_timer--;
-		}
-		if (inst->sound_timer > 0) {
-			log_info("Beeping");
-			inst->sound_timer--;
-		}
-	}
+static enum CpuResult op_cls(cpu_instance_t* inst, const struct instruction* ins) {
+	UNUSED(ins);
+	dbg("CLS");
+	cls(inst);
+	return OK;
 }
 
-static struct timespec diff_timespec(struct timespec t1, struct timespec t2) {
-	struct timespec diff;
+static enum CpuResult op_ret(cpu_instance_t* inst, const struct instruction* ins) {
+	UNUSED(ins);
+	dbg("RET");
+	ret(inst);
+	return OK;
+}
 
-	diff.tv_sec = t1.tv_sec - t2.tv_sec;
-	diff.tv_nsec = t1.tv_nsec - t2.tv_nsec;
-	if (diff.tv_nsec < 0) {
-		diff.tv_nsec += 1000000000; // nsec/sec
-    	diff.tv_sec--;
-	}
-	return diff;
+static enum CpuResult op_jp(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("JP");
+	jp(inst, ins->nnn);
+	note_jump_target(inst, ins->nnn);
+	return OK;
 }
 
-static void loop(cpu_instance_t* inst) {
-	struct timespec start_time;
-	struct timespec frame_start_time;
-	struct timespec now;
-	struct timespec delta;
-	struct timespec delay;
-	int vsync;
-	int cycle;
-	int height;
+static enum CpuResult op_call(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("CALL");
+	call(inst, ins->nnn);
+	return OK;
+}
 
-	while (atomic_load(&inst->is_running)) {
-		clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
-		for (vsync = 0; vsync < refresh_rate_hz; vsync++) {
-			clock_gettime(CLOCK_MONOTONIC_RAW, &frame_start_time);
-			inst->key_callback(inst->view, inst->frame_mutex, inst->keypad_state);
-			for (cycle = 0; cycle < cycles_per_frame; cycle++) {
-				run_cycle(inst);
-			}
-			height = sdl_wrapper_get_view_height(inst->view);
-			inst->frame_callback(height, inst->rgb24, inst->view, inst->image, inst->frame_mutex);
-			clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-			delta = diff_timespec(now, frame_start_time);
-			delay.tv_sec = 0;
-			delay.tv_nsec = 15000000;
-			delta = diff_timespec(delay, delta);
-			nanosleep(&delta, NULL);
-		}
+static enum CpuResult op_se(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SE");
+	se(inst, ins->x, ins->kk);
+	return OK;
+}
 
-		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-		delta = diff_timespec(now, start_time);
-		delay.tv_sec = 1;
-		delta = diff_timespec(delay, delta);
-		if (delta.tv_sec > 0 || delta.tv_nsec > 0) {
-			dbg("CPU sleeping for %lld.%.9ld", (long long) delta.tv_sec, delta.tv_nsec);
-			nanosleep(&delta, NULL);
-		}
-	}
+static enum CpuResult op_sne(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SNE");
+	sne(inst, ins->x, ins->kk);
+	return OK;
 }
 
+static enum CpuResult op_sereg(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SEREG");
+	sereg(inst, ins->x, ins->y);
+	return OK;
+}
 
-static void* thread_routine(void* data) {
-	cpu_instance_t* inst;
+static enum CpuResult op_ldim(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("LDIM");
+	ldim(inst, ins->x, ins->kk);
+	return OK;
+}
 
-	inst = (cpu_instance_t*) data;
-	log_info("Starting emulation loop");
-	atomic_store(&inst->is_running, true);
-	loop(inst);
-	pthread_exit(NULL);
+static enum CpuResult op_addim(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("ADDIM");
+	addim(inst, ins->x, ins->kk);
+	return OK;
 }
 
-enum CpuResult cpu_start(cpu_instance_t* instance) {
-	int res;
+static enum CpuResult op_ldv(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("LDV");
+	ldv(inst, ins->x, ins->y);
+	return OK;
+}
 
-	if (atomic_load(&instance->is_running)) {
-		log_error("CPU is already running");
-		return INVALID_STATE;
-	}
-	atomic_store(&instance->is_running, true);
-	log_info("Starting CPU...");
-	res = pthread_create(&instance->thread, NULL, thread_routine, (void*) instance);
-	if (res != 0) {
-		log_error("CPU thread start error");
-		return THREAD_ERROR;
-	}
+static enum CpuResult op_or(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("OR");
+	or(inst, ins->x, ins->y);
 	return OK;
 }
 
-enum CpuResult cpu_stop(cpu_instance_t* instance) {
-	int res;
+static enum CpuResult op_and(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("AND");
+	and(inst, ins->x, ins->y);
+	return OK;
+}
 
-	if (!atomic_load(&instance->is_running)) {
-		log_error("CPU must start() before stopping");
-		return INVALID_STATE;
-	}
-	atomic_store(&instance->is_running, false);
-	res = pthread_join(instance->thread, NULL);
-	if (res != 0) {
-		log_error("CPU thred join error");
-		return THREAD_ERROR;
-	}
+static enum CpuResult op_xor(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("XOR");
+	xor(inst, ins->x, ins->y);
 	return OK;
 }
 
-image_t* cpu_get_image_inst(cpu_instance_t* instance) {
-	return instance->image;
+static enum CpuResult op_add(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("ADD");
+	add(inst, ins->x, ins->y);
+	return OK;
+}
+
+static enum CpuResult op_sub(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SUB");
+	sub(inst, ins->x, ins->y);
+	return OK;
+}
+
+static enum CpuResult op_shr(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SHR");
+	shr(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_subn(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SUBN");
+	subn(inst, ins->x, ins->y);
+	return OK;
+}
+
+static enum CpuResult op_shl(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SHL");
+	shl(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_snereg(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SNEREG");
+	snereg(inst, ins->x, ins->y);
+	return OK;
+}
+
+static enum CpuResult op_ldi(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("LDI");
+	ldi(inst, ins->nnn);
+	return OK;
+}
+
+static enum CpuResult op_jpreg(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("JPREG");
+	jpreg(inst, ins->nnn);
+	return OK;
+}
+
+static enum CpuResult op_rnd(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("RND");
+	rnd(inst, ins->x, ins->kk);
+	return OK;
+}
+
+static enum CpuResult op_draw(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("DRAW");
+	draw(inst, ins->x, ins->y, ins->n);
+	return OK;
+}
+
+static enum CpuResult op_skey(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SKEY");
+	skey(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_snkey(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SNKEY");
+	snkey(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_rdelay(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("RDELAY");
+	rdelay(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_waitkey(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("WAIT");
+	waitkey(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_wdelay(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("DELAY");
+	wdelay(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_wsound(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("SOUND");
+	wsound(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_addi(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("ADDI");
+	addi(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_ldsprite(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("LDSPRITE");
+	ldsprite(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_stbcd(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("STBCD");
+	stbcd(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_streg(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("STREG");
+	streg(inst, ins->x);
+	return OK;
+}
+
+static enum CpuResult op_ldreg(cpu_instance_t* inst, const struct instruction* ins) {
+	dbg("LDREG");
+	ldreg(inst, ins->x);
+	return OK;
+}
+
+/* Decodes the slot for addr if needed, addr has to be even and inside memory */
+static struct instruction* decoded_slot(cpu_instance_t* inst, uint16_t addr) {
+	struct instruction* ins;
+
+	ins = &inst->icache[addr >> 1];
+	if (ins->op == OP_UNDECODED) {
+		instruction_decode(inst->memory[addr] << 8 | inst->memory[addr + 1], ins);
+	}
+	return ins;
+}
+
+/* Plain instruction a superinstruction starts with */
+static uint8_t base_op(uint8_t op) {
+	switch (op) {
+		case OP_FUSED_SE_JP:
+			return OP_SE;
+		case OP_FUSED_SNE_JP:
+			return OP_SNE;
+		case OP_FUSED_LDIM_DRAW:
+			return OP_LDIM;
+		case OP_FUSED_LDI_ADDI_LDREG:
+			return OP_LDI;
+		case OP_FUSED_DELAY_POLL:
+			return OP_RDELAY;
+		default:
+			return op;
+	}
+}
+
+/* Peephole pass over the straight line code from a hot jump target. The first slot of every recognised */
+/* sequence is rewritten into a superinstruction, the slots after it stay as they are so that jumps into */
+/* the middle of a sequence still work. */
+static void fuse(cpu_instance_t* inst, uint16_t start) {
+	struct instruction* a;
+	uint8_t b;
+	uint8_t c;
+	uint16_t pc;
+	int i;
+
+	for (pc = start, i = 0; i < FUSION_WINDOW && (size_t) pc + 6 <= sizeof(inst->memory); pc += 2, i++) {
+		a = decoded_slot(inst, pc);
+		b = base_op(decoded_slot(inst, pc + 2)->op);
+		c = base_op(decoded_slot(inst, pc + 4)->op);
+		switch (a->op) {
+			case OP_SE:
+				a->op = b == OP_JP ? OP_FUSED_SE_JP : a->op;
+				break;
+			case OP_SNE:
+				a->op = b == OP_JP ? OP_FUSED_SNE_JP : a->op;
+				break;
+			case OP_LDIM:
+				a->op = b == OP_DRAW ? OP_FUSED_LDIM_DRAW : a->op;
+				break;
+			case OP_LDI:
+				a->op = b == OP_ADDI && c == OP_LDREG ? OP_FUSED_LDI_ADDI_LDREG : a->op;
+				break;
+			case OP_RDELAY:
+				a->op = b == OP_SE && c == OP_JP ? OP_FUSED_DELAY_POLL : a->op;
+				// compiled blocks linked to the loop would keep running it rather than leave it to be skipped
+				if (a->op == OP_FUSED_DELAY_POLL && inst->jit) {
+					jit_invalidate(inst->jit, pc, 2);
+				}
+				break;
+			case OP_JP:
+			case OP_RET:
+			case OP_JPREG:
+			case OP_UNKNOWN:
+				return;
+			default:
+				break;
+		}
+	}
+}
+
+/* Jump targets are where loops start, the code after one that is taken often gets fused once */
+static void note_jump_target(cpu_instance_t* inst, uint16_t addr) {
+	uint8_t* count;
+
+	if (addr & 0xF001) {
+		return;
+	}
+	count = &inst->jump_counts[addr >> 1];
+	if (*count < FUSION_THRESHOLD) {
+		if (++*count == FUSION_THRESHOLD) {
+			fuse(inst, addr);
+		}
+	}
+}
+
+/* Superinstructions run their parts through the regular handlers. They only run whole when every part */
+/* fits before the next timer tick, otherwise just the first instruction runs. The cycles of all parts */
+/* after the first are accounted here, run_cycle adds the first one. */
+
+static enum CpuResult op_fused_se_jp(cpu_instance_t* inst, const struct instruction* ins) {
+	uint16_t pc;
+
+	pc = inst->program_counter;
+	se(inst, ins->x, ins->kk);
+	if (inst->program_counter == pc + 2 && inst->fuse_limit >= 2) {
+		jp(inst, ins[1].nnn);
+		inst->num_cycles++;
+		inst->fusion_hits[OP_FUSED_SE_JP - OP_FUSED_FIRST]++;
+	}
+	return OK;
+}
+
+static enum CpuResult op_fused_sne_jp(cpu_instance_t* inst, const struct instruction* ins) {
+	uint16_t pc;
+
+	pc = inst->program_counter;
+	sne(inst, ins->x, ins->kk);
+	if (inst->program_counter == pc + 2 && inst->fuse_limit >= 2) {
+		jp(inst, ins[1].nnn);
+		inst->num_cycles++;
+		inst->fusion_hits[OP_FUSED_SNE_JP - OP_FUSED_FIRST]++;
+	}
+	return OK;
+}
+
+static enum CpuResult op_fused_ldim_draw(cpu_instance_t* inst, const struct instruction* ins) {
+	ldim(inst, ins->x, ins->kk);
+	if (inst->fuse_limit >= 2) {
+		draw(inst, ins[1].x, ins[1].y, ins[1].n);
+		inst->num_cycles++;
+		inst->fusion_hits[OP_FUSED_LDIM_DRAW - OP_FUSED_FIRST]++;
+	}
+	return OK;
+}
+
+static enum CpuResult op_fused_ldi_addi_ldreg(cpu_instance_t* inst, const struct instruction* ins) {
+	ldi(inst, ins->nnn);
+	if (inst->fuse_limit >= 3) {
+		addi(inst, ins[1].x);
+		ldreg(inst, ins[2].x);
+		inst->num_cycles += 2;
+		inst->fusion_hits[OP_FUSED_LDI_ADDI_LDREG - OP_FUSED_FIRST]++;
+	}
+	return OK;
+}
+
+/* Fx07, 3xkk, 1nnn jumping back to the Fx07 with the same register and a delay timer that does not match yet */
+/* only waits for the next timer tick. Nothing else can change the outcome, so the whole iterations up to the */
+/* tick are skipped at once. */
+static bool idle_loop(cpu_instance_t* inst, const struct instruction* ins) {
+	return ins[1].x == ins->x && ins[2].nnn == inst->program_counter && inst->delay_timer != ins[1].kk;
+}
+
+static enum CpuResult op_fused_delay_poll(cpu_instance_t* inst, const struct instruction* ins) {
+	uint16_t pc;
+	int iterations;
+
+	pc = inst->program_counter;
+	if (inst->fuse_limit >= 3 && idle_loop(inst, ins)) {
+		iterations = inst->fuse_limit / 3;
+		inst->v_registers[ins->x] = inst->delay_timer;
+		inst->num_cycles += 3 * iterations - 1;
+		inst->idle_cycles += 3 * iterations;
+		inst->fusion_hits[OP_FUSED_DELAY_POLL - OP_FUSED_FIRST]++;
+		return OK;
+	}
+	rdelay(inst, ins->x);
+	if (inst->fuse_limit >= 3) {
+		se(inst, ins[1].x, ins[1].kk);
+		inst->num_cycles++;
+		if (inst->program_counter == pc + 4) {
+			jp(inst, ins[2].nnn);
+			inst->num_cycles++;
+		}
+		inst->fusion_hits[OP_FUSED_DELAY_POLL - OP_FUSED_FIRST]++;
+	}
+	return OK;
+}
+
+static enum CpuResult op_undecoded(cpu_instance_t* inst, const struct instruction* ins);
+
+static const op_handler_t op_handlers[OP_COUNT] = {
+	[OP_UNKNOWN] = op_unknown,
+	[OP_NOP] = op_nop,
+	[OP_CLS] = op_cls,
+	[OP_RET] = op_ret,
+	[OP_JP] = op_jp,
+	[OP_CALL] = op_call,
+	[OP_SE] = op_se,
+	[OP_SNE] = op_sne,
+	[OP_SEREG] = op_sereg,
+	[OP_LDIM] = op_ldim,
+	[OP_ADDIM] = op_addim,
+	[OP_LDV] = op_ldv,
+	[OP_OR] = op_or,
+	[OP_AND] = op_and,
+	[OP_XOR] = op_xor,
+	[OP_ADD] = op_add,
+	[OP_SUB] = op_sub,
+	[OP_SHR] = op_shr,
+	[OP_SUBN] = op_subn,
+	[OP_SHL] = op_shl,
+	[OP_SNEREG] = op_snereg,
+	[OP_LDI] = op_ldi,
+	[OP_JPREG] = op_jpreg,
+	[OP_RND] = op_rnd,
+	[OP_DRAW] = op_draw,
+	[OP_SKEY] = op_skey,
+	[OP_SNKEY] = op_snkey,
+	[OP_RDELAY] = op_rdelay,
+	[OP_WAITKEY] = op_waitkey,
+	[OP_WDELAY] = op_wdelay,
+	[OP_WSOUND] = op_wsound,
+	[OP_ADDI] = op_addi,
+	[OP_LDSPRITE] = op_ldsprite,
+	[OP_STBCD] = op_stbcd,
+	[OP_STREG] = op_streg,
+	[OP_LDREG] = op_ldreg,
+	[OP_UNDECODED] = op_undecoded,
+	[OP_FUSED_SE_JP] = op_fused_se_jp,
+	[OP_FUSED_SNE_JP] = op_fused_sne_jp,
+	[OP_FUSED_LDIM_DRAW] = op_fused_ldim_draw,
+	[OP_FUSED_LDI_ADDI_LDREG] = op_fused_ldi_addi_ldreg,
+	[OP_FUSED_DELAY_POLL] = op_fused_delay_poll
+};
+
+static enum CpuResult op_undecoded(cpu_instance_t* inst, const struct instruction* ins) {
+	ins = decode_cached(inst);
+	return op_handlers[ins->op](inst, ins);
+}
+
+#if defined(CPU_DISPATCH_GOTO) && defined(__GNUC__)
+/* Labels as values are a GNU extension */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+static enum CpuResult dispatch(cpu_instance_t* inst, const struct instruction* ins) {
+	static const void* const labels[OP_COUNT] = {
+		[OP_UNKNOWN] = &&l_unknown,
+		[OP_NOP] = &&l_nop,
+		[OP_CLS] = &&l_cls,
+		[OP_RET] = &&l_ret,
+		[OP_JP] = &&l_jp,
+		[OP_CALL] = &&l_call,
+		[OP_SE] = &&l_se,
+		[OP_SNE] = &&l_sne,
+		[OP_SEREG] = &&l_sereg,
+		[OP_LDIM] = &&l_ldim,
+		[OP_ADDIM] = &&l_addim,
+		[OP_LDV] = &&l_ldv,
+		[OP_OR] = &&l_or,
+		[OP_AND] = &&l_and,
+		[OP_XOR] = &&l_xor,
+		[OP_ADD] = &&l_add,
+		[OP_SUB] = &&l_sub,
+		[OP_SHR] = &&l_shr,
+		[OP_SUBN] = &&l_subn,
+		[OP_SHL] = &&l_shl,
+		[OP_SNEREG] = &&l_snereg,
+		[OP_LDI] = &&l_ldi,
+		[OP_JPREG] = &&l_jpreg,
+		[OP_RND] = &&l_rnd,
+		[OP_DRAW] = &&l_draw,
+		[OP_SKEY] = &&l_skey,
+		[OP_SNKEY] = &&l_snkey,
+		[OP_RDELAY] = &&l_rdelay,
+		[OP_WAITKEY] = &&l_waitkey,
+		[OP_WDELAY] = &&l_wdelay,
+		[OP_WSOUND] = &&l_wsound,
+		[OP_ADDI] = &&l_addi,
+		[OP_LDSPRITE] = &&l_ldsprite,
+		[OP_STBCD] = &&l_stbcd,
+		[OP_STREG] = &&l_streg,
+		[OP_LDREG] = &&l_ldreg,
+		[OP_UNDECODED] = &&l_undecoded,
+		[OP_FUSED_SE_JP] = &&l_fused_se_jp,
+		[OP_FUSED_SNE_JP] = &&l_fused_sne_jp,
+		[OP_FUSED_LDIM_DRAW] = &&l_fused_ldim_draw,
+		[OP_FUSED_LDI_ADDI_LDREG] = &&l_fused_ldi_addi_ldreg,
+		[OP_FUSED_DELAY_POLL] = &&l_fused_delay_poll
+	};
+
+	goto *labels[ins->op];
+
+l_undecoded:
+	ins = decode_cached(inst);
+	goto *labels[ins->op];
+l_unknown:
+	inst->current_opcode = ins->opcode;
+	return INSTRUCTION_NOT_FOUND;
+l_nop:
+	return OK;
+l_cls:
+	cls(inst);
+	return OK;
+l_ret:
+	ret(inst);
+	return OK;
+l_jp:
+	jp(inst, ins->nnn);
+	note_jump_target(inst, ins->nnn);
+	return OK;
+l_call:
+	call(inst, ins->nnn);
+	return OK;
+l_se:
+	se(inst, ins->x, ins->kk);
+	return OK;
+l_sne:
+	sne(inst, ins->x, ins->kk);
+	return OK;
+l_sereg:
+	sereg(inst, ins->x, ins->y);
+	return OK;
+l_ldim:
+	ldim(inst, ins->x, ins->kk);
+	return OK;
+l_addim:
+	addim(inst, ins->x, ins->kk);
+	return OK;
+l_ldv:
+	ldv(inst, ins->x, ins->y);
+	return OK;
+l_or:
+	or(inst, ins->x, ins->y);
+	return OK;
+l_and:
+	and(inst, ins->x, ins->y);
+	return OK;
+l_xor:
+	xor(inst, ins->x, ins->y);
+	return OK;
+l_add:
+	add(inst, ins->x, ins->y);
+	return OK;
+l_sub:
+	sub(inst, ins->x, ins->y);
+	return OK;
+l_shr:
+	shr(inst, ins->x);
+	return OK;
+l_subn:
+	subn(inst, ins->x, ins->y);
+	return OK;
+l_shl:
+	shl(inst, ins->x);
+	return OK;
+l_snereg:
+	snereg(inst, ins->x, ins->y);
+	return OK;
+l_ldi:
+	ldi(inst, ins->nnn);
+	return OK;
+l_jpreg:
+	jpreg(inst, ins->nnn);
+	return OK;
+l_rnd:
+	rnd(inst, ins->x, ins->kk);
+	return OK;
+l_draw:
+	draw(inst, ins->x, ins->y, ins->n);
+	return OK;
+l_skey:
+	skey(inst, ins->x);
+	return OK;
+l_snkey:
+	snkey(inst, ins->x);
+	return OK;
+l_rdelay:
+	rdelay(inst, ins->x);
+	return OK;
+l_waitkey:
+	waitkey(inst, ins->x);
+	return OK;
+l_wdelay:
+	wdelay(inst, ins->x);
+	return OK;
+l_wsound:
+	wsound(inst, ins->x);
+	return OK;
+l_addi:
+	addi(inst, ins->x);
+	return OK;
+l_ldsprite:
+	ldsprite(inst, ins->x);
+	return OK;
+l_stbcd:
+	stbcd(inst, ins->x);
+	return OK;
+l_streg:
+	streg(inst, ins->x);
+	return OK;
+l_ldreg:
+	ldreg(inst, ins->x);
+	return OK;
+l_fused_se_jp:
+	return op_fused_se_jp(inst, ins);
+l_fused_sne_jp:
+	return op_fused_sne_jp(inst, ins);
+l_fused_ldim_draw:
+	return op_fused_ldim_draw(inst, ins);
+l_fused_ldi_addi_ldreg:
+	return op_fused_ldi_addi_ldreg(inst, ins);
+l_fused_delay_poll:
+	return op_fused_delay_poll(inst, ins);
+}
+#pragma GCC diagnostic pop
+#else
+/* Runs ins, the instruction at the program counter */
+static enum CpuResult dispatch(cpu_instance_t* inst, const struct instruction* ins) {
+	return op_handlers[ins->op](inst, ins);
+}
+#endif
+
+#ifdef CPU_PROFILE
+#ifdef CPU_PROFILE_TICKS
+static uint64_t profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+#endif
+}
+
+/* Instructions until the next timed one, random so that loops whose length divides the mean are not always */
+/* timed at the same instruction */
+static uint32_t profile_next_gap(cpu_instance_t* inst) {
+	inst->profile_rng ^= inst->profile_rng << 13;
+	inst->profile_rng ^= inst->profile_rng >> 17;
+	inst->profile_rng ^= inst->profile_rng << 5;
+	return 1 + inst->profile_rng % (2 * PROFILE_SAMPLE_INTERVAL - 1);
+}
+
+/* Times the instruction and charges it for the whole gap that led up to it, which estimates the ticks of every */
+/* handler without reading the clock around each instruction */
+static __attribute__((noinline)) enum CpuResult execute_timed(cpu_instance_t* inst, const struct instruction* ins) {
+	enum CpuResult res;
+	uint64_t start;
+	uint32_t gap;
+	uint8_t op;
+
+	if (ins->op == OP_UNDECODED) {
+		ins = decode_cached(inst);
+	}
+	// the handler may rewrite its own cache slot
+	op = ins->op;
+	gap = inst->profile_gap;
+	inst->profile_gap = profile_next_gap(inst);
+	inst->profile_countdown = inst->profile_gap;
+	start = profile_clock();
+	res = dispatch(inst, ins);
+	inst->profile_ticks[op] += (profile_clock() - start) * gap;
+	return res;
+}
+#endif
+
+/* Counts the instruction against its handler. A slot that is still undecoded is counted as such, decoding it */
+/* moves the count to what it holds, which keeps the check off the path of every instruction. */
+static enum CpuResult execute_instruction(cpu_instance_t* inst) {
+	const struct instruction* ins;
+
+	ins = fetch(inst);
+	inst->profile_counts[ins->op]++;
+#ifdef CPU_PROFILE_TICKS
+	if (--inst->profile_countdown == 0) {
+		return execute_timed(inst, ins);
+	}
+#endif
+	// counting before the handler keeps the dispatch a tail call
+	return dispatch(inst, ins);
+}
+#else
+static enum CpuResult execute_instruction(cpu_instance_t* inst) {
+	return dispatch(inst, fetch(inst));
+}
+#endif
+
+/* Ends an emulated frame, the timers tick once per frame however many cycles it has */
+static void tick_timers(cpu_instance_t* inst) {
+	inst->tick_at += inst->cycles_per_frame;
+	if (inst->delay_timer > 0) {
+		inst->delay_timer--;
+	}
+	if (inst->sound_timer > 0) {
+		async_log_info_limited("Beeping");
+		inst->sound_timer--;
+	}
+}
+
+/* Runs one instruction, or one superinstruction of at most limit cycles. Returns the cycles it took. */
+static int run_cycle(cpu_instance_t* inst, int limit) {
+	enum CpuResult res;
+	uint64_t start;
+	int until_tick;
+
+	start = inst->num_cycles;
+	until_tick = inst->tick_at - inst->num_cycles;
+	inst->fuse_limit = limit < until_tick ? limit : until_tick;
+	res = execute_instruction(inst);
+	if (res != OK) {
+		async_log_error_limited("Instruction not found for opcode 0x%X", inst->current_opcode);
+	}
+	inst->num_cycles++;
+	if (inst->num_cycles == inst->tick_at) {
+		tick_timers(inst);
+	}
+	return inst->num_cycles - start;
+}
+
+/* Runs one instruction and records what it changed. Superinstructions are held to a single instruction, so */
+/* that every step is one. */
+static int run_traced_cycle(cpu_instance_t* inst) {
+	struct trace_step step;
+	uint8_t v[16];
+	uint16_t pc;
+	uint16_t index;
+	uint64_t tick_at;
+	int ran;
+	int i;
+
+	pc = inst->program_counter;
+	step.cycle = inst->num_cycles;
+	step.pc = pc;
+	step.opcode = inst->memory[pc & 0xFFF] << 8 | inst->memory[(pc + 1) & 0xFFF];
+	step.write_len = 0;
+	memcpy(v, inst->v_registers, sizeof(v));
+	index = inst->index_register;
+	tick_at = inst->tick_at;
+	inst->traced = &step;
+	ran = run_cycle(inst, 1);
+	inst->traced = NULL;
+	step.index = inst->index_register;
+	step.index_changed = step.index != index;
+	step.changed = 0;
+	for (i = 0; i < 16; i++) {
+		step.v[i] = inst->v_registers[i];
+		if (step.v[i] != v[i]) {
+			step.changed |= 1 << i;
+		}
+	}
+	step.tick = inst->tick_at != tick_at;
+	trace_record(inst->trace, &step);
+	return ran;
+}
+
+/* Compiled and translated code leaves idle loops to the interpreter, which skips them */
+static bool at_idle_loop(cpu_instance_t* inst) {
+	const struct instruction* ins;
+
+	ins = fetch(inst);
+	return ins->op == OP_FUSED_DELAY_POLL && idle_loop(inst, ins);
+}
+
+/* Emits a call to the interpreter handler of ins, with the guest program counter stored first if the block */
+/* has not kept it up to date. Handlers that fall through leave it pointing past the instruction. */
+static void jit_emit_handler(cpu_instance_t* inst, uint8_t op, const struct instruction* ins, uint16_t pc, uint16_t* synced_pc) {
+	if (*synced_pc != pc) {
+		jit_emit_store16(inst->jit, offsetof(struct cpu_instance, program_counter), pc);
+	}
+	jit_emit_call(inst->jit, (uintptr_t) op_handlers[op], (uintptr_t) ins);
+	*synced_pc = pc + 2;
+}
+
+/* Translates the basic block at the program counter. Register and index loads are emitted inline, */
+/* everything else calls the interpreter handler. Blocks end at jumps, skips, DRW, key ops and memory stores, */
+/* the stores so that a block never keeps running code it has just overwritten. A block never spans more */
+/* than a frame worth of cycles, longer ones could not run between two timer ticks. */
+static jit_block_t* jit_compile(cpu_instance_t* inst) {
+	jit_block_t* block;
+	const struct instruction* ins;
+	uint16_t pc;
+	uint16_t synced_pc;
+	uint16_t length;
+	bool ended;
+	int32_t v;
+	uint8_t op;
+
+	block = jit_block_begin(inst->jit, inst->program_counter);
+	if (!block) {
+		jit_flush(inst->jit);
+		block = jit_block_begin(inst->jit, inst->program_counter);
+	}
+	v = offsetof(struct cpu_instance, v_registers);
+	pc = inst->program_counter;
+	synced_pc = pc;
+	length = 0;
+	ended = false;
+	while (!ended && length < JIT_MAX_BLOCK_LENGTH && length < inst->cycles_per_frame && pc < sizeof(inst->memory)) {
+		ins = &inst->icache[pc >> 1];
+		if (ins->op == OP_UNDECODED) {
+			instruction_decode(inst->memory[pc] << 8 | inst->memory[pc + 1], &inst->icache[pc >> 1]);
+		}
+		// blocks count every instruction themselves, superinstructions are compiled as their first part
+		op = base_op(ins->op);
+		switch (op) {
+			case OP_UNKNOWN:
+			case OP_NOP:
+				// left to the interpreter, NOP does not advance the program counter
+				goto done;
+			case OP_LDIM:
+				jit_emit_store8(inst->jit, v + ins->x, ins->kk);
+				break;
+			case OP_ADDIM:
+				jit_emit_add8(inst->jit, v + ins->x, ins->kk);
+				break;
+			case OP_LDV:
+				jit_emit_move8(inst->jit, v + ins->x, v + ins->y);
+				break;
+			case OP_OR:
+				jit_emit_or8(inst->jit, v + ins->x, v + ins->y);
+				break;
+			case OP_AND:
+				jit_emit_and8(inst->jit, v + ins->x, v + ins->y);
+				break;
+			case OP_XOR:
+				jit_emit_xor8(inst->jit, v + ins->x, v + ins->y);
+				break;
+			case OP_LDI:
+				jit_emit_store16(inst->jit, offsetof(struct cpu_instance, index_register), ins->nnn);
+				break;
+			case OP_JP:
+			case OP_CALL:
+			case OP_RET:
+			case OP_JPREG:
+			case OP_SE:
+			case OP_SNE:
+			case OP_SEREG:
+			case OP_SNEREG:
+			case OP_DRAW:
+			case OP_SKEY:
+			case OP_SNKEY:
+			case OP_WAITKEY:
+			case OP_STBCD:
+			case OP_STREG:
+				jit_emit_handler(inst, op, ins, pc, &synced_pc);
+				ended = true;
+				break;
+			default:
+				jit_emit_handler(inst, op, ins, pc, &synced_pc);
+				break;
+		}
+		pc += 2;
+		length++;
+	}
+done:
+	if (!ended && length > 0 && synced_pc != pc) {
+		jit_emit_store16(inst->jit, offsetof(struct cpu_instance, program_counter), pc);
+	}
+	return jit_block_end(inst->jit, block, pc, length);
+}
+
+/* Runs compiled blocks while they fit before the next timer tick, single steps through the interpreter otherwise. */
+/* A block that runs right after another is linked to it, so that the next time the first one jumps straight */
+/* into it as long as the budget of cycles up to the tick covers it, without coming back here. Blocks at idle */
+/* loops are never linked to, fusing one invalidates the block so that the links into it are dropped. */
+static void run_jit(cpu_instance_t* inst, int cycles) {
+	jit_block_t* block;
+	jit_block_t* prev;
+	uint64_t generation;
+	uint16_t pc;
+	int until_tick;
+	int budget;
+	int ran;
+
+	prev = NULL;
+	while (cycles > 0) {
+		pc = inst->program_counter;
+		block = jit_lookup(inst->jit, pc);
+		if (!block && !(pc & 0xF001)) {
+			generation = jit_generation(inst->jit);
+			block = jit_compile(inst);
+			// a flush took the previous block with it
+			if (generation != jit_generation(inst->jit)) {
+				prev = NULL;
+			}
+		}
+		until_tick = inst->tick_at - inst->num_cycles;
+		budget = cycles < until_tick ? cycles : until_tick;
+		if (!block || !block->fn || block->length > budget || at_idle_loop(inst)) {
+			cycles -= run_cycle(inst, cycles);
+			prev = NULL;
+			continue;
+		}
+		if (prev) {
+			jit_link(inst->jit, prev, block);
+		}
+		inst->jit_budget = budget;
+		prev = block->fn(inst);
+		ran = budget - inst->jit_budget;
+		cycles -= ran;
+		if (ran == until_tick) {
+			tick_timers(inst);
+		}
+	}
+}
+
+/* Points the state translated blocks run on at the instance */
+static void bind_aot_state(cpu_instance_t* inst) {
+	inst->aot_state.inst = inst;
+	inst->aot_state.handlers = op_handlers;
+	inst->aot_state.v = inst->v_registers;
+	inst->aot_state.memory = inst->memory;
+	inst->aot_state.index_register = &inst->index_register;
+	inst->aot_state.program_counter = &inst->program_counter;
+	inst->aot_state.stack = inst->stack;
+	inst->aot_state.stack_pointer = &inst->stack_pointer;
+	inst->aot_state.delay_timer = &inst->delay_timer;
+	inst->aot_state.sound_timer = &inst->sound_timer;
+}
+
+/* Runs translated blocks where there are any, the interpreter covers everything rom2c could not reach */
+static void run_aot(cpu_instance_t* inst, int cycles) {
+	const struct aot_block* block;
+	int until_tick;
+	int budget;
+	int ran;
+
+	while (cycles > 0) {
+		block = aot_lookup(inst->aot, inst->program_counter);
+		until_tick = inst->tick_at - inst->num_cycles;
+		budget = cycles < until_tick ? cycles : until_tick;
+		ran = block && !at_idle_loop(inst) ? block->fn(&inst->aot_state, inst->program_counter, budget) : 0;
+		if (ran == 0) {
+			cycles -= run_cycle(inst, cycles);
+			continue;
+		}
+		inst->num_cycles += ran;
+		cycles -= ran;
+		if (ran == until_tick) {
+			tick_timers(inst);
+		}
+	}
+}
+
+static void run_cycles(cpu_instance_t* inst, int cycles) {
+	if (inst->trace) {
+		while (cycles > 0) {
+			cycles -= run_traced_cycle(inst);
+		}
+		return;
+	}
+	if (atomic_load(&inst->backend) == CPU_BACKEND_AOT && inst->aot) {
+		run_aot(inst, cycles);
+		return;
+	}
+	if (atomic_load(&inst->backend) == CPU_BACKEND_JIT) {
+		if (!inst->jit) {
+			inst->jit = jit_create(offsetof(struct cpu_instance, program_counter),
+					offsetof(struct cpu_instance, jit_budget), offsetof(struct cpu_instance, num_cycles));
+		}
+		if (inst->jit) {
+			run_jit(inst, cycles);
+			return;
+		}
+		async_log_error("JIT unavailable, falling back to the interpreter");
+		atomic_store(&inst->backend, CPU_BACKEND_INTERPRETER);
+	}
+	while (cycles > 0) {
+		cycles -= run_cycle(inst, cycles);
+	}
+}
+
+/* Folds the key transitions queued since the last frame into the keypad mask */
+static void poll_keys(cpu_instance_t* inst) {
+	uint16_t down;
+	uint8_t key;
+	bool pressed;
+
+	down = atomic_load_explicit(&inst->keys_down, memory_order_relaxed);
+	inst->keys_latched = 0;
+	while (key_queue_pop(inst->key_events, &key, &pressed)) {
+		if (pressed) {
+			down |= 1 << key;
+			inst->keys_latched |= 1 << key;
+		} else {
+			down &= ~(1 << key);
+		}
+	}
+	atomic_store_explicit(&inst->keys_down, down, memory_order_relaxed);
+}
+
+static int64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/* Hands the image to the renderer if it changed, never waits for it. Times the callback if timed. */
+static void publish_frame(cpu_instance_t* inst, bool timed) {
+	int64_t start;
+
+	if (!image_take_dirty(inst->image, NULL)) {
+		inst->frames_unchanged++;
+		return;
+	}
+	image_store(inst->image, triple_buffer_back(inst->frames));
+	triple_buffer_publish(inst->frames);
+	if (inst->frame_notify) {
+		start = timed ? now_ns() : 0;
+		inst->frame_notify(inst->frame_notify_arg);
+		if (timed) {
+			histogram_record(inst->timing[CPU_TIMING_CALLBACK], now_ns() - start);
+		}
+	}
+}
+
+/* Sleeps until the absolute CLOCK_MONOTONIC time deadline */
+static void sleep_until(int64_t deadline) {
+	struct timespec ts;
+#if defined(TIMER_ABSTIME)
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+#else
+	int64_t left;
+
+	// no absolute sleeps on this platform, relative ones only ever wake late so this cannot return early
+	while ((left = deadline - now_ns()) > 0) {
+		ts.tv_sec = left / NSEC_PER_SEC;
+		ts.tv_nsec = left % NSEC_PER_SEC;
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+/* Records the keypad of the frame about to run, or replaces it with the recorded one */
+static void log_input(cpu_instance_t* inst) {
+	uint16_t down;
+	uint16_t latched;
+
+	switch (inst->input_mode) {
+		case CPU_INPUT_RECORD:
+			input_log_record(inst->input_log, inst->frame, atomic_load_explicit(&inst->keys_down, memory_order_relaxed),
+					inst->keys_latched);
+			break;
+		case CPU_INPUT_REPLAY:
+			input_log_keys(inst->input_log, inst->frame, &inst->input_cursor, &down, &latched);
+			atomic_store_explicit(&inst->keys_down, down, memory_order_relaxed);
+			inst->keys_latched = latched;
+			break;
+		case CPU_INPUT_LIVE:
+		default:
+			break;
+	}
+}
+
+static void save_state(cpu_instance_t* instance, uint8_t* buf);
+static void seal_state(uint8_t* buf);
+static enum CpuResult load_state(cpu_instance_t* instance, const uint8_t* buf, size_t size, bool keypad,
+		const char** error);
+
+/* Goes back to the start of the newest frame in the history and drops it, stays put once it runs out. */
+/* The keypad is left as the player holds it now so that no key gets stuck. */
+static void rewind_frame(cpu_instance_t* inst, bool timed) {
+	uint8_t state[CPU_STATE_SIZE];
+	const char* error;
+
+	poll_keys(inst);
+	if (history_pop(inst->history, state)) {
+		// the frame counter goes back with the state
+		seal_state(state);
+		// the history only holds states saved here, refusing one is a bug, so rewinding stops rather than
+		// dropping the rest of the history one frame at a time
+		if (load_state(inst, state, sizeof(state), false, &error) != OK) {
+			async_log_error_limited("Rewinding stopped: %s", error);
+			atomic_store_explicit(&inst->rewinding, false, memory_order_relaxed);
+		}
+	}
+	publish_frame(inst, timed);
+	inst->schedule.frames++;
+}
+
+/* Runs one frame, timing it into the timing histograms if timed */
+static void run_frame(cpu_instance_t* inst, bool timed) {
+	uint8_t state[CPU_STATE_SIZE];
+	int64_t start;
+	int cycles;
+
+	if (inst->history && atomic_load_explicit(&inst->rewinding, memory_order_relaxed)) {
+		rewind_frame(inst, timed);
+		return;
+	}
+
+	// frames normally start right after a tick, so a new frame length takes effect cleanly here
+	cycles = atomic_load_explicit(&inst->new_cycles_per_frame, memory_order_relaxed);
+	if (cycles != inst->cycles_per_frame) {
+		inst->cycles_per_frame = cycles;
+		inst->tick_at = inst->num_cycles + cycles;
+	}
+	poll_keys(inst);
+	log_input(inst);
+	if (inst->history) {
+		// kept without a header, its checksum changes every frame and would only bloat the deltas
+		memset(state, 0, STATE_HEADER_SIZE);
+		save_state(inst, state);
+		history_push(inst->history, state);
+	}
+	start = timed ? now_ns() : 0;
+	run_cycles(inst, cycles);
+	if (timed) {
+		histogram_record(inst->timing[CPU_TIMING_BATCH], now_ns() - start);
+	}
+	inst->frame++;
+	publish_frame(inst, timed);
+	inst->schedule.frames++;
+	inst->schedule.cycles += cycles;
+}
+
+/* Paces frames against absolute deadlines one frame period apart, so sleeping late or running slow never */
+/* accumulates into drift. A frame that ends past its deadline is a missed deadline. With the catch up */
+/* policy the frames owed are run back to back, up to max_catch_up_frames, with the drop policy they are */
+/* skipped. Either way the schedule restarts from now once it is further behind than that. */
+/* In turbo mode frames run back to back and the schedule restarts from now when it is switched off. */
+static void loop(cpu_instance_t* inst) {
+	int64_t start;
+	int64_t deadline;
+	int64_t now;
+	int64_t next;
+	int64_t frame_start;
+	int64_t behind;
+	int64_t oversleep;
+	int64_t rate_start;
+	uint64_t rate_cycles;
+
+	start = now_ns();
+	deadline = start;
+	frame_start = start;
+	rate_start = start;
+	rate_cycles = inst->schedule.cycles;
+	while (atomic_load(&inst->is_running)) {
+		run_frame(inst, true);
+		deadline += frame_period_ns;
+		now = now_ns();
+		inst->schedule.elapsed_ns = now - start;
+		if (now - rate_start >= NSEC_PER_SEC) {
+			atomic_store_explicit(&inst->cycle_rate,
+					(inst->schedule.cycles - rate_cycles) * NSEC_PER_SEC / (now - rate_start), memory_order_relaxed);
+			rate_start = now;
+			rate_cycles = inst->schedule.cycles;
+		}
+		// the next frame starts right away unless there is time to sleep
+		next = now;
+		if (atomic_load_explicit(&inst->turbo, memory_order_relaxed)) {
+			deadline = now;
+		} else if (now <= deadline) {
+			sleep_until(deadline);
+			next = now_ns();
+			oversleep = next - deadline;
+			inst->schedule.oversleep_total_ns += oversleep;
+			if ((uint64_t) oversleep > inst->schedule.oversleep_max_ns) {
+				inst->schedule.oversleep_max_ns = oversleep;
+			}
+			histogram_record(inst->timing[CPU_TIMING_OVERSLEEP], oversleep);
+		} else {
+			inst->schedule.missed_deadlines++;
+			behind = (now - deadline) / frame_period_ns;
+			if (atomic_load(&inst->schedule_policy) == CPU_SCHEDULE_CATCH_UP && behind < max_catch_up_frames) {
+				// the next frame is already due, the loop runs it without sleeping
+				inst->schedule.caught_up_frames++;
+			} else {
+				inst->schedule.dropped_frames += behind;
+				deadline += behind * frame_period_ns;
+			}
+		}
+		histogram_record(inst->timing[CPU_TIMING_INTERVAL], next - frame_start);
+		frame_start = next;
+	}
+}
+
+static void* thread_routine(void* data) {
+	cpu_instance_t* inst;
+
+	inst = (cpu_instance_t*) data;
+	async_log_info("Starting emulation loop");
+	atomic_store(&inst->is_running, true);
+	loop(inst);
+	pthread_exit(NULL);
+}
+
+enum CpuResult cpu_start(cpu_instance_t* instance) {
+	int res;
+
+	if (atomic_load(&instance->is_running)) {
+		log_error("CPU is already running");
+		return INVALID_STATE;
+	}
+	atomic_store(&instance->is_running, true);
+	log_info("Starting CPU...");
+	res = pthread_create(&instance->thread, NULL, thread_routine, (void*) instance);
+	if (res != 0) {
+		log_error("CPU thread start error");
+		// there is no thread for cpu_stop to join
+		atomic_store(&instance->is_running, false);
+		return THREAD_ERROR;
+	}
+	return OK;
+}
+
+static void report_fusion(cpu_instance_t* inst) {
+	int i;
+
+	if (inst->idle_cycles > 0) {
+		log_info("Skipped %llu of %llu cycles in idle loops", (unsigned long long) inst->idle_cycles,
+				(unsigned long long) inst->num_cycles);
+	}
+	for (i = 0; i < FUSED_OPS; i++) {
+		if (inst->fusion_hits[i] > 0) {
+			log_info("Superinstruction %s ran %llu times", instruction_name(OP_FUSED_FIRST + i),
+					(unsigned long long) inst->fusion_hits[i]);
+		}
+	}
+}
+
+static void report_schedule(cpu_instance_t* inst) {
+	const struct cpu_schedule_stats* s;
+
+	s = &inst->schedule;
+	log_info("Ran %llu frames, %llu missed their deadline, %llu caught up, %llu dropped",
+			(unsigned long long) s->frames, (unsigned long long) s->missed_deadlines,
+			(unsigned long long) s->caught_up_frames, (unsigned long long) s->dropped_frames);
+	if (s->frames > 0) {
+		log_info("Oversleep %llu us on average, %llu us at most",
+				(unsigned long long) (s->oversleep_total_ns / s->frames / 1000),
+				(unsigned long long) (s->oversleep_max_ns / 1000));
+	}
+	if (s->elapsed_ns > 0) {
+		log_info("Emulated %.3f MHz on average", (double) s->cycles * 1e3 / s->elapsed_ns);
+	}
+}
+
+#ifdef CPU_PROFILE
+static_assert(OP_COUNT <= CPU_PROFILE_HANDLERS, "profile snapshots hold every handler");
+
+/* Opcode class of every handler, the one of their first instruction for superinstructions */
+static const char* const profile_classes[CPU_PROFILE_CLASSES] = {
+	"0nnn", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+	"8xyn", "9xy0", "Annn", "Bnnn", "Cxkk", "Dxyn", "Exkk", "Fxkk", "invalid"
+};
+
+static int profile_class(uint8_t op) {
+	switch (base_op(op)) {
+		case OP_UNKNOWN:
+		case OP_UNDECODED:
+			return CPU_PROFILE_CLASSES - 1;
+		case OP_NOP:
+		case OP_CLS:
+		case OP_RET:
+			return 0x0;
+		case OP_JP:
+			return 0x1;
+		case OP_CALL:
+			return 0x2;
+		case OP_SE:
+			return 0x3;
+		case OP_SNE:
+			return 0x4;
+		case OP_SEREG:
+			return 0x5;
+		case OP_LDIM:
+			return 0x6;
+		case OP_ADDIM:
+			return 0x7;
+		case OP_LDV:
+		case OP_OR:
+		case OP_AND:
+		case OP_XOR:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_SHR:
+		case OP_SUBN:
+		case OP_SHL:
+			return 0x8;
+		case OP_SNEREG:
+			return 0x9;
+		case OP_LDI:
+			return 0xA;
+		case OP_JPREG:
+			return 0xB;
+		case OP_RND:
+			return 0xC;
+		case OP_DRAW:
+			return 0xD;
+		case OP_SKEY:
+		case OP_SNKEY:
+			return 0xE;
+		case OP_RDELAY:
+		case OP_WAITKEY:
+		case OP_WDELAY:
+		case OP_WSOUND:
+		case OP_ADDI:
+		case OP_LDSPRITE:
+		case OP_STBCD:
+		case OP_STREG:
+		case OP_LDREG:
+			return 0xF;
+		case OP_FUSED_SE_JP:
+		case OP_FUSED_SNE_JP:
+		case OP_FUSED_LDIM_DRAW:
+		case OP_FUSED_LDI_ADDI_LDREG:
+		case OP_FUSED_DELAY_POLL:
+		case OP_COUNT:
+		default:
+			return CPU_PROFILE_CLASSES - 1;
+	}
+}
+
+/* Most ticks first, most executions when there are no ticks, then by name so that snapshots are stable */
+static int compare_profile_entries(const void* a, const void* b) {
+	const struct cpu_profile_entry* x = a;
+	const struct cpu_profile_entry* y = b;
+
+	if (x->ticks != y->ticks) {
+		return x->ticks < y->ticks ? 1 : -1;
+	}
+	if (x->count != y->count) {
+		return x->count < y->count ? 1 : -1;
+	}
+	return strcmp(x->name, y->name);
+}
+#endif
+
+enum CpuResult cpu_get_profile(cpu_instance_t* instance, struct cpu_profile* profile) {
+#ifdef CPU_PROFILE
+	struct cpu_profile_entry* entry;
+	uint64_t count;
+	uint64_t ticks;
+	int op;
+	int i;
+
+	memset(profile, 0, sizeof(*profile));
+	for (i = 0; i < CPU_PROFILE_CLASSES; i++) {
+		profile->classes[i].name = profile_classes[i];
+	}
+	for (op = 0; op < OP_COUNT; op++) {
+		count = instance->profile_counts[op];
+		ticks = instance->profile_ticks[op];
+		if (count == 0) {
+			continue;
+		}
+		entry = &profile->handlers[profile->handler_count++];
+		entry->name = instruction_name(op);
+		entry->count = count;
+		entry->ticks = ticks;
+		entry = &profile->classes[profile_class(op)];
+		entry->count += count;
+		entry->ticks += ticks;
+		profile->count += count;
+		profile->ticks += ticks;
+	}
+	qsort(profile->handlers, profile->handler_count, sizeof(struct cpu_profile_entry), compare_profile_entries);
+	qsort(profile->classes, CPU_PROFILE_CLASSES, sizeof(struct cpu_profile_entry), compare_profile_entries);
+	// classes that never ran sort last and are left out
+	profile->class_count = 0;
+	for (i = 0; i < CPU_PROFILE_CLASSES; i++) {
+		if (profile->classes[i].count > 0) {
+			profile->class_count++;
+		}
+	}
+	return OK;
+#else
+	UNUSED(instance);
+	memset(profile, 0, sizeof(*profile));
+	return UNSUPPORTED;
+#endif
+}
+
+void cpu_reset_profile(cpu_instance_t* instance) {
+#ifdef CPU_PROFILE
+	memset(instance->profile_counts, 0, sizeof(instance->profile_counts));
+	memset(instance->profile_ticks, 0, sizeof(instance->profile_ticks));
+#ifdef CPU_PROFILE_TICKS
+	instance->profile_rng = 0x9E3779B9;
+	instance->profile_gap = profile_next_gap(instance);
+	instance->profile_countdown = instance->profile_gap;
+#endif
+#else
+	UNUSED(instance);
+#endif
+}
+
+#ifdef CPU_PROFILE
+static void report_profile(cpu_instance_t* inst) {
+	struct cpu_profile profile;
+	const struct cpu_profile_entry* e;
+	int i;
+
+	cpu_get_profile(inst, &profile);
+	if (profile.count == 0) {
+		return;
+	}
+	log_info("Profile of %llu interpreted instructions, %llu host ticks", (unsigned long long) profile.count,
+			(unsigned long long) profile.ticks);
+	for (i = 0; i < profile.handler_count; i++) {
+		e = &profile.handlers[i];
+		log_info("%16s %12llu %5.1f%% %14llu ticks %5.1f%%", e->name, (unsigned long long) e->count,
+				100.0 * e->count / profile.count, (unsigned long long) e->ticks,
+				profile.ticks > 0 ? 100.0 * e->ticks / profile.ticks : 0.0);
+	}
+}
+#endif
+
+enum CpuResult cpu_stop(cpu_instance_t* instance) {
+	int res;
+
+	if (!atomic_load(&instance->is_running)) {
+		log_error("CPU must start() before stopping");
+		return INVALID_STATE;
+	}
+	atomic_store(&instance->is_running, false);
+	res = pthread_join(instance->thread, NULL);
+	if (res != 0) {
+		log_error("CPU thred join error");
+		return THREAD_ERROR;
+	}
+	// what the CPU thread logged goes out before the reports
+	async_log_flush();
+	report_fusion(instance);
+	report_schedule(instance);
+#ifdef CPU_PROFILE
+	report_profile(instance);
+#endif
+	return OK;
+}
+
+enum CpuResult cpu_set_backend(cpu_instance_t* instance, enum CpuBackend backend) {
+	if (backend == CPU_BACKEND_JIT && !jit_supported()) {
+		log_error("JIT backend is not supported on this platform");
+		return UNSUPPORTED;
+	}
+	if (backend == CPU_BACKEND_AOT && !instance->aot) {
+		log_error("No translated ROM was loaded");
+		return INVALID_STATE;
+	}
+	atomic_store(&instance->backend, backend);
+	return OK;
+}
+
+void cpu_get_fusion_stats(cpu_instance_t* instance, struct cpu_fusion_stats* stats) {
+	stats->skip_jump = instance->fusion_hits[OP_FUSED_SE_JP - OP_FUSED_FIRST] +
+		instance->fusion_hits[OP_FUSED_SNE_JP - OP_FUSED_FIRST];
+	stats->load_draw = instance->fusion_hits[OP_FUSED_LDIM_DRAW - OP_FUSED_FIRST];
+	stats->table_load = instance->fusion_hits[OP_FUSED_LDI_ADDI_LDREG - OP_FUSED_FIRST];
+	stats->delay_poll = instance->fusion_hits[OP_FUSED_DELAY_POLL - OP_FUSED_FIRST];
+}
+
+uint64_t cpu_get_idle_cycles(cpu_instance_t* instance) {
+	return instance->idle_cycles;
+}
+
+enum CpuResult cpu_key_event(cpu_instance_t* instance, uint8_t key, bool pressed) {
+	if (key > 0xF) {
+		log_error("Key %d is not on the keypad", key);
+		return INVALID_STATE;
+	}
+	if (!key_queue_push(instance->key_events, key, pressed)) {
+		log_error("Key queue is full, dropping key %d", key);
+		return IO_ERROR;
+	}
+	return OK;
+}
+
+uint16_t cpu_get_keys(cpu_instance_t* instance) {
+	return atomic_load_explicit(&instance->keys_down, memory_order_relaxed);
+}
+
+enum CpuResult cpu_set_keys(cpu_instance_t* instance, uint16_t keys) {
+	uint16_t down;
+
+	if (atomic_load(&instance->is_running)) {
+		log_error("CPU must be stopped to set keys directly");
+		return INVALID_STATE;
+	}
+	down = atomic_load_explicit(&instance->keys_down, memory_order_relaxed);
+	instance->keys_latched |= keys & ~down;
+	atomic_store_explicit(&instance->keys_down, keys, memory_order_relaxed);
+	return OK;
+}
+
+enum CpuResult cpu_run_cycles(cpu_instance_t* instance, int cycles) {
+	if (atomic_load(&instance->is_running)) {
+		log_error("CPU must be stopped to step it");
+		return INVALID_STATE;
+	}
+	run_cycles(instance, cycles);
+	return OK;
+}
+
+enum CpuResult cpu_run_frames(cpu_instance_t* instance, int frames) {
+	int i;
+
+	if (atomic_load(&instance->is_running)) {
+		log_error("CPU must be stopped to step it");
+		return INVALID_STATE;
+	}
+	for (i = 0; i < frames; i++) {
+		run_frame(instance, false);
+	}
+	return OK;
+}
+
+uint64_t cpu_get_cycles(cpu_instance_t* instance) {
+	return instance->num_cycles;
+}
+
+void cpu_set_frame_notify(cpu_instance_t* instance, void (*notify)(void*), void* arg) {
+	instance->frame_notify = notify;
+	instance->frame_notify_arg = arg;
+}
+
+void cpu_set_schedule_policy(cpu_instance_t* instance, enum CpuSchedulePolicy policy) {
+	atomic_store(&instance->schedule_policy, policy);
+}
+
+void cpu_get_schedule_stats(cpu_instance_t* instance, struct cpu_schedule_stats* stats) {
+	*stats = instance->schedule;
+}
+
+struct histogram* cpu_get_timing(cpu_instance_t* instance, enum CpuTiming timing) {
+	return instance->timing[timing];
+}
+
+enum CpuResult cpu_set_cycles_per_frame(cpu_instance_t* instance, int cycles) {
+	if (cycles < 1 || cycles > max_cycles_per_frame) {
+		log_error("%d cycles per frame is out of range 1-%d", cycles, max_cycles_per_frame);
+		return INVALID_STATE;
+	}
+	atomic_store_explicit(&instance->new_cycles_per_frame, cycles, memory_order_relaxed);
+	return OK;
+}
+
+int cpu_get_cycles_per_frame(cpu_instance_t* instance) {
+	return atomic_load_explicit(&instance->new_cycles_per_frame, memory_order_relaxed);
+}
+
+void cpu_set_turbo(cpu_instance_t* instance, bool turbo) {
+	atomic_store_explicit(&instance->turbo, turbo, memory_order_relaxed);
+}
+
+bool cpu_get_turbo(cpu_instance_t* instance) {
+	return atomic_load_explicit(&instance->turbo, memory_order_relaxed);
+}
+
+uint64_t cpu_get_cycle_rate(cpu_instance_t* instance) {
+	return atomic_load_explicit(&instance->cycle_rate, memory_order_relaxed);
+}
+
+bool cpu_take_frame(cpu_instance_t* instance, image_t* dst) {
+	if (!triple_buffer_acquire(instance->frames)) {
+		return false;
+	}
+	image_load(dst, triple_buffer_front(instance->frames));
+	return true;
+}
+
+void cpu_get_frame_stats(cpu_instance_t* instance, struct cpu_frame_stats* stats) {
+	stats->published = triple_buffer_published(instance->frames);
+	stats->presented = triple_buffer_acquired(instance->frames);
+	stats->unchanged = instance->frames_unchanged;
+}
+
+image_t* cpu_get_image_inst(cpu_instance_t* instance) {
+	return instance->image;
+}
+
+
+static uint8_t* put16(uint8_t* p, uint16_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	return p + 2;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t value) {
+	return put16(put16(p, value), value >> 16);
+}
+
+static uint8_t* put64(uint8_t* p, uint64_t value) {
+	return put32(put32(p, value), value >> 32);
+}
+
+static uint16_t get16(const uint8_t** p) {
+	uint16_t value;
+
+	value = (*p)[0] | (*p)[1] << 8;
+	*p += 2;
+	return value;
+}
+
+static uint32_t get32(const uint8_t** p) {
+	uint32_t value;
+
+	value = get16(p);
+	return value | (uint32_t) get16(p) << 16;
+}
+
+static uint64_t get64(const uint8_t** p) {
+	uint64_t value;
+
+	value = get32(p);
+	return value | (uint64_t) get32(p) << 32;
+}
+
+/* Fletcher-64 over little endian words, len must be a multiple of 4. The sums of a payload this small cannot */
+/* overflow, so the modulo is only taken once at the end. */
+static uint64_t fletcher64(const uint8_t* data, size_t len) {
+	uint64_t a;
+	uint64_t b;
+	size_t i;
+
+	a = 0;
+	b = 0;
+	for (i = 0; i < len; i += 4) {
+		a += data[i] | data[i + 1] << 8 | data[i + 2] << 16 | (uint32_t) data[i + 3] << 24;
+		b += a;
+	}
+	return (b % 0xFFFFFFFF) << 32 | a % 0xFFFFFFFF;
+}
+
+static_assert(STATE_PAYLOAD_SIZE % 4 == 0, "save state payload is checksummed in words");
+static_assert(STATE_PAYLOAD_SIZE == 4096 + 16 + 3 * 2 + 16 * 2 + 2 + 2 * 2 + 8 + 4 + 8 + 8 + 8 + CPU_SCREEN_HEIGHT * 8,
+		"CPU_STATE_SIZE does not match the payload");
+
+/* Writes the payload of a state, the header is left alone */
+static void save_state(cpu_instance_t* instance, uint8_t* buf) {
+	uint8_t* p;
+	int i;
+
+	p = buf + STATE_HEADER_SIZE;
+	memcpy(p, instance->memory, sizeof(instance->memory));
+	p += sizeof(instance->memory);
+	memcpy(p, instance->v_registers, sizeof(instance->v_registers));
+	p += sizeof(instance->v_registers);
+	p = put16(p, instance->index_register);
+	p = put16(p, instance->program_counter);
+	p = put16(p, instance->stack_pointer);
+	for (i = 0; i < 16; i++) {
+		p = put16(p, instance->stack[i]);
+	}
+	*p++ = instance->delay_timer;
+	*p++ = instance->sound_timer;
+	p = put16(p, atomic_load_explicit(&instance->keys_down, memory_order_relaxed));
+	p = put16(p, instance->keys_latched);
+	p = put64(p, instance->num_cycles);
+	p = put32(p, instance->cycles_per_frame);
+	p = put64(p, instance->tick_at);
+	p = put64(p, instance->frame);
+	p = put64(p, instance->rng);
+	for (i = 0; i < CPU_SCREEN_HEIGHT; i++) {
+		p = put64(p, image_row(instance->image, i));
+	}
+}
+
+/* Writes the header of a state whose payload is complete */
+static void seal_state(uint8_t* buf) {
+	uint8_t* p;
+
+	p = put32(buf, STATE_MAGIC);
+	p = put16(p, CPU_STATE_VERSION);
+	p = put16(p, 0);
+	p = put32(p, STATE_PAYLOAD_SIZE);
+	put64(p, fletcher64(buf + STATE_HEADER_SIZE, STATE_PAYLOAD_SIZE));
+}
+
+enum CpuResult cpu_save_state(cpu_instance_t* instance, uint8_t* buf, size_t size) {
+	if (atomic_load(&instance->is_running)) {
+		log_error("CPU must be stopped to save its state");
+		return INVALID_STATE;
+	}
+	if (size < CPU_STATE_SIZE) {
+		log_error("Save states need %d bytes, got %zu", CPU_STATE_SIZE, size);
+		return MEMORY_ERROR;
+	}
+	save_state(instance, buf);
+	seal_state(buf);
+	return OK;
+}
+
+/* Restores a state saved by save_state, the keypad too if keypad. Refusing it, error says why and nothing */
+/* is logged, so that the CPU thread can log it without waiting. */
+static enum CpuResult load_state(cpu_instance_t* instance, const uint8_t* buf, size_t size, bool keypad,
+		const char** error) {
+	const uint8_t* p;
+	const uint8_t* memory;
+	const uint8_t* v;
+	uint64_t rows[CPU_SCREEN_HEIGHT];
+	uint16_t index_register;
+	uint16_t program_counter;
+	uint16_t stack_pointer;
+	uint16_t stack[16];
+	uint8_t delay_timer;
+	uint8_t sound_timer;
+	uint16_t keys_down;
+	uint16_t keys_latched;
+	uint64_t num_cycles;
+	uint32_t cycles_per_frame;
+	uint64_t tick_at;
+	uint64_t frame;
+	uint64_t rng;
+	uint16_t version;
+	int i;
+
+	p = buf;
+	if (size < CPU_STATE_SIZE || get32(&p) != STATE_MAGIC) {
+		*error = "Not a save state";
+		return INVALID_STATE;
+	}
+	version = get16(&p);
+	if (version != CPU_STATE_VERSION) {
+		*error = "Save state version is not supported";
+		return UNSUPPORTED;
+	}
+	get16(&p);
+	if (get32(&p) != STATE_PAYLOAD_SIZE || get64(&p) != fletcher64(buf + STATE_HEADER_SIZE, STATE_PAYLOAD_SIZE)) {
+		*error = "Save state is damaged";
+		return INVALID_STATE;
+	}
+
+	// everything is checked before the instance is touched
+	memory = p;
+	p += sizeof(instance->memory);
+	v = p;
+	p += sizeof(instance->v_registers);
+	index_register = get16(&p);
+	program_counter = get16(&p);
+	stack_pointer = get16(&p);
+	for (i = 0; i < 16; i++) {
+		stack[i] = get16(&p);
+	}
+	delay_timer = *p++;
+	sound_timer = *p++;
+	keys_down = get16(&p);
+	keys_latched = get16(&p);
+	num_cycles = get64(&p);
+	cycles_per_frame = get32(&p);
+	tick_at = get64(&p);
+	frame = get64(&p);
+	rng = get64(&p);
+	for (i = 0; i < CPU_SCREEN_HEIGHT; i++) {
+		rows[i] = get64(&p);
+	}
+	// ADD I and JP V0 carry I and the program counter past 0xFFF in running games, so any value is kept,
+	// memory accesses through them wrap around
+	if (stack_pointer > 16 || cycles_per_frame < 1 || cycles_per_frame > (uint32_t) max_cycles_per_frame ||
+			tick_at <= num_cycles || tick_at - num_cycles > cycles_per_frame || rng == 0) {
+		*error = "Save state holds an impossible CPU state";
+		return INVALID_STATE;
+	}
+
+	for (i = 0; i < (int) sizeof(instance->memory); i += STATE_PAGE) {
+		if (memcmp(instance->memory + i, memory + i, STATE_PAGE) != 0) {
+			memcpy(instance->memory + i, memory + i, STATE_PAGE);
+			invalidate_code(instance, i, STATE_PAGE);
+		}
+	}
+	memcpy(instance->v_registers, v, sizeof(instance->v_registers));
+	instance->index_register = index_register;
+	instance->program_counter = program_counter;
+	instance->stack_pointer = stack_pointer;
+	memcpy(instance->stack, stack, sizeof(stack));
+	instance->delay_timer = delay_timer;
+	instance->sound_timer = sound_timer;
+	if (keypad) {
+		atomic_store_explicit(&instance->keys_down, keys_down, memory_order_relaxed);
+		instance->keys_latched = keys_latched;
+	}
+	instance->num_cycles = num_cycles;
+	instance->cycles_per_frame = cycles_per_frame;
+	atomic_store_explicit(&instance->new_cycles_per_frame, cycles_per_frame, memory_order_relaxed);
+	instance->tick_at = tick_at;
+	instance->frame = frame;
+	instance->rng = rng;
+	image_load(instance->image, rows);
+	return OK;
+}
+
+enum CpuResult cpu_load_state(cpu_instance_t* instance, const uint8_t* buf, size_t size) {
+	enum CpuResult res;
+	const char* error;
+
+	if (atomic_load(&instance->is_running)) {
+		log_error("CPU must be stopped to load a state");
+		return INVALID_STATE;
+	}
+	res = load_state(instance, buf, size, true, &error);
+	if (res != OK) {
+		log_error("%s", error);
+	}
+	return res;
+}
+
+enum CpuResult cpu_save_state_file(cpu_instance_t* instance, const char* path) {
+	uint8_t buf[CPU_STATE_SIZE];
+	enum CpuResult res;
+	FILE* f;
+
+	res = cpu_save_state(instance, buf, sizeof(buf));
+	if (res != OK) {
+		return res;
+	}
+	f = fopen(path, "wb");
+	if (!f) {
+		log_error("Unable to open file %s", path);
+		return IO_ERROR;
+	}
+	if (fwrite(buf, sizeof(buf), 1, f) != 1) {
+		log_error("Unable to write save state to %s", path);
+		fclose(f);
+		return IO_ERROR;
+	}
+	if (fclose(f) != 0) {
+		log_error("Unable to write save state to %s", path);
+		return IO_ERROR;
+	}
+	return OK;
+}
+
+enum CpuResult cpu_load_state_file(cpu_instance_t* instance, const char* path) {
+	uint8_t buf[CPU_STATE_SIZE];
+	size_t len;
+	FILE* f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		log_error("Unable to open file %s", path);
+		return IO_ERROR;
+	}
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	return cpu_load_state(instance, buf, len);
+}
+
+void cpu_set_history(cpu_instance_t* instance, struct history* history) {
+	instance->history = history;
+}
+
+void cpu_set_translation(cpu_instance_t* instance, bool allowed) {
+	instance->load_translations = allowed;
+}
+
+void cpu_set_trace(cpu_instance_t* instance, struct trace* trace) {
+	instance->trace = trace;
+}
+
+void cpu_set_rewinding(cpu_instance_t* instance, bool rewinding) {
+	atomic_store_explicit(&instance->rewinding, rewinding, memory_order_relaxed);
+}
+
+bool cpu_get_rewinding(cpu_instance_t* instance) {
+	return atomic_load_explicit(&instance->rewinding, memory_order_relaxed);
+}
+
+void cpu_set_seed(cpu_instance_t* instance, uint64_t seed) {
+	instance->seed = seed;
+	instance->rng = rng_seed(seed);
+}
+
+uint64_t cpu_get_seed(cpu_instance_t* instance) {
+	return instance->seed;
+}
+
+uint64_t cpu_get_frame(cpu_instance_t* instance) {
+	return instance->frame;
+}
+
+enum CpuResult cpu_set_input_log(cpu_instance_t* instance, struct input_log* log, enum CpuInputMode mode) {
+	enum CpuResult res;
+
+	if (atomic_load(&instance->is_running)) {
+		log_error("CPU must be stopped to attach an input log");
+		return INVALID_STATE;
+	}
+	if (log && mode == CPU_INPUT_RECORD) {
+		input_log_set_start(log, instance->seed, atomic_load_explicit(&instance->new_cycles_per_frame, memory_order_relaxed));
+	}
+	if (log && mode == CPU_INPUT_REPLAY) {
+		res = cpu_set_cycles_per_frame(instance, input_log_cycles_per_frame(log));
+		if (res != OK) {
+			return res;
+		}
+		cpu_set_seed(instance, input_log_seed(log));
+	}
+	instance->input_log = log;
+	instance->input_mode = log ? mode : CPU_INPUT_LIVE;
+	instance->input_cursor = 0;
+	return OK;
 }
@@ -0,0 +1,155 @@
+#include "histogram.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* Linear sub-buckets per power of two, 32 keeps values to within 1/32 */
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+/* Values from 2^MAX_BITS up are counted as the largest one below it */
+#define MAX_BITS 40
+#define MAX_VALUE ((1ULL << MAX_BITS) - 1)
+/* Values below 2 * SUB_COUNT have a bucket each, every power of two above them has SUB_COUNT */
+#define BUCKETS ((MAX_BITS - SUB_BITS + 1) * SUB_COUNT)
+
+/* Counters only change on the recording thread, atomics keep the reads of other threads well defined */
+struct histogram {
+	_Atomic(uint64_t) counts[BUCKETS];
+	_Atomic(uint64_t) sum;
+	_Atomic(uint64_t) max;
+};
+
+histogram_t* histogram_create(void) {
+	histogram_t* histogram;
+
+	histogram = malloc(sizeof(struct histogram));
+	if (histogram) {
+		histogram_reset(histogram);
+	}
+	return histogram;
+}
+
+void histogram_destroy(histogram_t* histogram) {
+	free(histogram);
+}
+
+static unsigned bucket(uint64_t value) {
+	unsigned bit;
+
+	if (value < 2 * SUB_COUNT) {
+		return value;
+	}
+	if (value > MAX_VALUE) {
+		value = MAX_VALUE;
+	}
+	bit = 63 - __builtin_clzll(value);
+	// the SUB_BITS + 1 bits from the highest set one pick the bucket
+	return (bit - SUB_BITS) * SUB_COUNT + (value >> (bit - SUB_BITS));
+}
+
+/* Largest value that lands in bucket i */
+static uint64_t bucket_high(unsigned i) {
+	unsigned bit;
+
+	if (i < 2 * SUB_COUNT) {
+		return i;
+	}
+	bit = i / SUB_COUNT + SUB_BITS - 1;
+	return ((uint64_t) (i % SUB_COUNT + SUB_COUNT + 1) << (bit - SUB_BITS)) - 1;
+}
+
+static uint64_t get(_Atomic(uint64_t)* counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void set(_Atomic(uint64_t)* counter, uint64_t value) {
+	atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+void histogram_record(histogram_t* histogram, uint64_t value) {
+	_Atomic(uint64_t)* count;
+
+	count = &histogram->counts[bucket(value)];
+	set(count, get(count) + 1);
+	set(&histogram->sum, get(&histogram->sum) + value);
+	if (value > get(&histogram->max)) {
+		set(&histogram->max, value);
+	}
+}
+
+void histogram_reset(histogram_t* histogram) {
+	unsigned i;
+
+	for (i = 0; i < BUCKETS; i++) {
+		set(&histogram->counts[i], 0);
+	}
+	set(&histogram->sum, 0);
+	set(&histogram->max, 0);
+}
+
+void histogram_copy(histogram_t* dst, histogram_t* src) {
+	unsigned i;
+
+	for (i = 0; i < BUCKETS; i++) {
+		set(&dst->counts[i], get(&src->counts[i]));
+	}
+	set(&dst->sum, get(&src->sum));
+	set(&dst->max, get(&src->max));
+}
+
+uint64_t histogram_count(histogram_t* histogram) {
+	uint64_t count;
+	unsigned i;
+
+	count = 0;
+	for (i = 0; i < BUCKETS; i++) {
+		count += get(&histogram->counts[i]);
+	}
+	return count;
+}
+
+uint64_t histogram_sum(histogram_t* histogram) {
+	return get(&histogram->sum);
+}
+
+uint64_t histogram_max(histogram_t* histogram) {
+	return get(&histogram->max);
+}
+
+uint64_t histogram_count_at_most(histogram_t* histogram, uint64_t value) {
+	uint64_t count;
+	unsigned i;
+
+	count = 0;
+	for (i = 0; i < BUCKETS && bucket_high(i) <= value; i++) {
+		count += get(&histogram->counts[i]);
+	}
+	return count;
+}
+
+uint64_t histogram_quantile(histogram_t* histogram, double q) {
+	uint64_t target;
+	uint64_t count;
+	uint64_t high;
+	unsigned i;
+
+	count = histogram_count(histogram);
+	if (count == 0) {
+		return 0;
+	}
+	q = q < 0 ? 0 : q > 1 ? 1 : q;
+	// the smallest number of records that covers q, at least one
+	target = q * count;
+	target += target < q * count;
+	target = target < 1 ? 1 : target;
+	count = 0;
+	for (i = 0; i < BUCKETS; i++) {
+		count += get(&histogram->counts[i]);
+		if (count >= target) {
+			break;
+		}
+	}
+	// the bucket bound can be past the largest value that was actually recorded
+	high = bucket_high(i < BUCKETS ? i : BUCKETS - 1);
+	return high < histogram_max(histogram) ? high : histogram_max(histogram);
+}
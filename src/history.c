@@ -0,0 +1,266 @@
+#include "history.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+
+/* Deltas grow as the state drifts away from their keyframe, two keyframes a second kept the total smallest */
+/* on the ROMs tried */
+static const unsigned keyframe_interval = 30;
+/* Unchanged runs shorter than this are kept in the literal around them, a new segment costs more */
+#define MIN_MATCH 4
+/* Upper bound of an encoded state, a segment costs at most 7 bytes for every 5 it covers */
+#define MAX_ENCODED (CPU_STATE_SIZE * 2)
+
+struct entry {
+	uint32_t offset;
+	uint32_t length;
+	bool key;
+};
+
+struct history {
+	uint8_t* data; // encoded states, each one contiguous, in the order of entries
+	size_t size;
+	size_t used;
+	struct entry* entries; // ring, the oldest is at first and always a keyframe
+	unsigned capacity;
+	unsigned first;
+	unsigned count;
+	unsigned since_key;   // deltas after the newest keyframe
+	uint64_t keyframes;
+	uint64_t delta_bytes; // encoded size of the deltas held
+	uint8_t key[CPU_STATE_SIZE]; // the newest keyframe decoded, new deltas are encoded against it
+	uint8_t encoded[MAX_ENCODED];
+};
+
+static const uint8_t zeros[CPU_STATE_SIZE];
+
+history_t* history_create(size_t bytes, int frames) {
+	history_t* history;
+
+	if (frames < 1 || bytes < MAX_ENCODED || bytes > UINT32_MAX) {
+		log_error("History of %d frames in %zu bytes is out of range", frames, bytes);
+		return NULL;
+	}
+	history = calloc(1, sizeof(struct history));
+	if (!history) {
+		return NULL;
+	}
+	history->data = malloc(bytes);
+	history->entries = calloc(frames, sizeof(struct entry));
+	if (!history->data || !history->entries) {
+		history_destroy(history);
+		return NULL;
+	}
+	history->size = bytes;
+	history->capacity = frames;
+	return history;
+}
+
+void history_destroy(history_t* history) {
+	free(history->data);
+	free(history->entries);
+	free(history);
+}
+
+static uint8_t* put_varint(uint8_t* p, size_t value) {
+	while (value >= 0x80) {
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+static size_t get_varint(const uint8_t** p) {
+	size_t value;
+	int shift;
+
+	value = 0;
+	shift = 0;
+	while (**p & 0x80) {
+		value |= (size_t) (*(*p)++ & 0x7F) << shift;
+		shift += 7;
+	}
+	return value | (size_t) *(*p)++ << shift;
+}
+
+/* Encodes state as segments of an unchanged byte count, a literal byte count and the literal bytes XORed */
+/* with ref. Bytes after the last literal are unchanged. Returns the encoded size. */
+static size_t encode(uint8_t* out, const uint8_t* state, const uint8_t* ref) {
+	uint8_t* p;
+	size_t i;
+	size_t unchanged;
+	size_t literal;
+	size_t end;
+	unsigned matched;
+
+	p = out;
+	i = 0;
+	while (i < CPU_STATE_SIZE) {
+		unchanged = i;
+		while (i < CPU_STATE_SIZE && state[i] == ref[i]) {
+			i++;
+		}
+		if (i == CPU_STATE_SIZE) {
+			break;
+		}
+		literal = i;
+		matched = 0;
+		while (i < CPU_STATE_SIZE && matched < MIN_MATCH) {
+			matched = state[i] == ref[i] ? matched + 1 : 0;
+			i++;
+		}
+		end = i - matched;
+		p = put_varint(p, literal - unchanged);
+		p = put_varint(p, end - literal);
+		for (i = literal; i < end; i++) {
+			*p++ = state[i] ^ ref[i];
+		}
+	}
+	return p - out;
+}
+
+static void decode(uint8_t* state, const uint8_t* ref, const uint8_t* in, size_t len) {
+	const uint8_t* p;
+	size_t pos;
+	size_t n;
+
+	memcpy(state, ref, CPU_STATE_SIZE);
+	p = in;
+	pos = 0;
+	while (p < in + len) {
+		pos += get_varint(&p);
+		n = get_varint(&p);
+		while (n-- > 0) {
+			state[pos++] ^= *p++;
+		}
+	}
+}
+
+/* Entry i counting from the oldest */
+static struct entry* entry_at(history_t* history, unsigned i) {
+	return &history->entries[(history->first + i) % history->capacity];
+}
+
+/* Drops the oldest keyframe and the deltas that depend on it */
+static void drop_oldest(history_t* history) {
+	struct entry* e;
+
+	do {
+		e = entry_at(history, 0);
+		if (e->key) {
+			history->keyframes--;
+		} else {
+			history->delta_bytes -= e->length;
+		}
+		history->used -= e->length;
+		history->first = (history->first + 1) % history->capacity;
+		history->count--;
+	} while (history->count > 0 && !entry_at(history, 0)->key);
+}
+
+/* Offset where length bytes fit after the newest state without touching the oldest, or -1 */
+static long find_room(history_t* history, size_t length) {
+	const struct entry* oldest;
+	const struct entry* newest;
+	size_t end;
+
+	if (history->count == 0) {
+		return 0;
+	}
+	oldest = entry_at(history, 0);
+	newest = entry_at(history, history->count - 1);
+	end = newest->offset + newest->length;
+	if (newest->offset >= oldest->offset) {
+		// not wrapped around yet, there is room after the newest or before the oldest
+		if (history->size - end >= length) {
+			return end;
+		}
+		return oldest->offset >= length ? 0 : -1;
+	}
+	return oldest->offset - end >= length ? (long) end : -1;
+}
+
+void history_push(history_t* history, const uint8_t* state) {
+	struct entry* e;
+	size_t length;
+	long offset;
+	bool key;
+
+	offset = 0;
+	key = history->count == 0 || history->since_key + 1 >= keyframe_interval;
+	length = encode(history->encoded, state, key ? zeros : history->key);
+	for (;;) {
+		// making room can drop the keyframe the delta was encoded against
+		if (history->count == 0 && !key) {
+			key = true;
+			length = encode(history->encoded, state, zeros);
+		}
+		if (history->count < history->capacity && (offset = find_room(history, length)) >= 0) {
+			break;
+		}
+		drop_oldest(history);
+	}
+	memcpy(history->data + offset, history->encoded, length);
+	e = entry_at(history, history->count);
+	e->offset = offset;
+	e->length = length;
+	e->key = key;
+	history->count++;
+	history->used += length;
+	if (key) {
+		memcpy(history->key, state, CPU_STATE_SIZE);
+		history->since_key = 0;
+		history->keyframes++;
+	} else {
+		history->since_key++;
+		history->delta_bytes += length;
+	}
+}
+
+bool history_pop(history_t* history, uint8_t* state) {
+	const struct entry* e;
+	unsigned i;
+
+	if (history->count == 0) {
+		return false;
+	}
+	e = entry_at(history, history->count - 1);
+	decode(state, e->key ? zeros : history->key, history->data + e->offset, e->length);
+	history->count--;
+	history->used -= e->length;
+	if (!e->key) {
+		history->since_key--;
+		history->delta_bytes -= e->length;
+		return true;
+	}
+	history->keyframes--;
+	// the keyframe before becomes the one new deltas are encoded against
+	i = history->count;
+	while (i > 0 && !entry_at(history, i - 1)->key) {
+		i--;
+	}
+	if (i > 0) {
+		e = entry_at(history, i - 1);
+		decode(history->key, zeros, history->data + e->offset, e->length);
+	}
+	history->since_key = history->count - i;
+	return true;
+}
+
+int history_frames(history_t* history) {
+	return history->count;
+}
+
+void history_get_stats(history_t* history, struct history_stats* stats) {
+	uint64_t deltas;
+
+	deltas = history->count - history->keyframes;
+	stats->frames = history->count;
+	stats->keyframes = history->keyframes;
+	stats->memory_bytes = sizeof(struct history) + history->size + (uint64_t) history->capacity * sizeof(struct entry);
+	stats->used_bytes = history->used;
+	stats->average_delta_bytes = deltas > 0 ? history->delta_bytes / deltas : 0;
+}
@@ -6,65 +6,157 @@
 
 #include <log.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define IMAGE_SIMD
+#include <immintrin.h>
+#endif
+
 struct image {
-	int cols;
 	int rows;
-	uint8_t* data;
+	uint64_t* data;
+	bool dirty;
+	// changed region since the last image_take_dirty, end exclusive
+	int dirty_left;
+	int dirty_right;
+	int dirty_top;
+	int dirty_bottom;
 };
 
+static void mark_dirty(image_t* inst, int left, int right, int top, int bottom) {
+	if (!inst->dirty) {
+		inst->dirty = true;
+		inst->dirty_left = left;
+		inst->dirty_right = right;
+		inst->dirty_top = top;
+		inst->dirty_bottom = bottom;
+		return;
+	}
+	inst->dirty_left = left < inst->dirty_left ? left : inst->dirty_left;
+	inst->dirty_right = right > inst->dirty_right ? right : inst->dirty_right;
+	inst->dirty_top = top < inst->dirty_top ? top : inst->dirty_top;
+	inst->dirty_bottom = bottom > inst->dirty_bottom ? bottom : inst->dirty_bottom;
+}
+
 image_t* image_create(int r, int c) {
 	image_t* i;
 
+	if (c != IMAGE_COLS) {
+		log_error("Image has to be %d columns wide, got %d", IMAGE_COLS, c);
+		return NULL;
+	}
 	i = malloc(sizeof(struct image));
+	if (!i) {
+		return NULL;
+	}
 	i->rows = r;
-	i->cols = c;
-	i->data = malloc(sizeof(uint8_t) * r * c);
+	i->data = calloc(r, sizeof(uint64_t));
+	if (!i->data) {
+		free(i);
+		return NULL;
+	}
+	i->dirty = false;
+	mark_dirty(i, 0, IMAGE_COLS, 0, r);
 
 	return i;
 }
 
-uint8_t* image_row(image_t* inst, int r) {
-	if (r < 0 || r > inst->rows) {
+int image_rows(image_t* inst) {
+	return inst->rows;
+}
+
+void image_store(image_t* inst, uint64_t* dst) {
+	memcpy(dst, inst->data, inst->rows * sizeof(uint64_t));
+}
+
+void image_load(image_t* inst, const uint64_t* src) {
+	int r;
+	int top, bottom;
+	int left, right;
+	uint64_t changed;
+	uint64_t columns;
+
+	top = -1;
+	bottom = 0;
+	columns = 0;
+	for (r = 0; r < inst->rows; r++) {
+		changed = inst->data[r] ^ src[r];
+		if (changed) {
+			top = top < 0 ? r : top;
+			bottom = r + 1;
+			columns |= changed;
+		}
+		inst->data[r] = src[r];
+	}
+	if (top < 0) {
+		return;
+	}
+	left = 0;
+	while (!(columns >> (IMAGE_COLS - 1 - left) & 1)) {
+		left++;
+	}
+	right = IMAGE_COLS;
+	while (!(columns >> (IMAGE_COLS - right) & 1)) {
+		right--;
+	}
+	mark_dirty(inst, left, right, top, bottom);
+}
+
+uint64_t image_row(image_t* inst, int r) {
+	if (r < 0 || r >= inst->rows) {
 		log_error("Row=%d out of bounds", r);
 		exit(1);
 	}
-	return &inst->data[r * inst->cols];
+	return inst->data[r];
 }
 
-static bool xor(image_t* inst, int c, int r, uint8_t value) {
-	uint8_t* current_value;
-	uint8_t prev_value;
+bool image_pixel(image_t* inst, int c, int r) {
+	if (c < 0 || c >= IMAGE_COLS) {
+		log_error("Column=%d is out of bounds", c);
+		exit(1);
+	}
+	return (image_row(inst, r) >> (IMAGE_COLS - 1 - c)) & 1;
+}
 
-	current_value = image_at(inst, c, r);
-	prev_value = *current_value;
-	*current_value ^= value;
-	return current_value == 0 && prev_value > 0;
+static uint64_t rotate_right(uint64_t bits, int n) {
+	return (bits >> n) | (bits << ((IMAGE_COLS - n) & (IMAGE_COLS - 1)));
 }
 
-bool image_xor_sprite(image_t *inst, int c, int r, int height, uint8_t *sprite) {
+bool image_xor_sprite(image_t *inst, int c, int r, int height, const uint8_t *sprite) {
 	bool pixel_disabled;
-	int y, x;
-	int cur_r, cur_c;
-	uint8_t sprite_byte;
-	uint8_t sprite_val;
+	int y;
+	uint64_t* row;
+	uint64_t bits;
+	int left, right;
+	int top, bottom;
 
 	pixel_disabled = false;
+	if (height <= 0) {
+		return false;
+	}
+	c %= IMAGE_COLS;
+	r %= inst->rows;
+	// sprites wrapping around an edge dirty the whole width or height
+	if (c > IMAGE_COLS - 8) {
+		left = 0;
+		right = IMAGE_COLS;
+	} else {
+		left = c;
+		right = c + 8;
+	}
+	if (height > inst->rows - r) {
+		top = 0;
+		bottom = inst->rows;
+	} else {
+		top = r;
+		bottom = r + height;
+	}
+	mark_dirty(inst, left, right, top, bottom);
 	for (y = 0; y < height; y++) {
-		cur_r = r + y;
-		while (cur_r >= inst->rows) {
-			cur_r -= inst->rows;
-		}
-		sprite_byte = sprite[y];
-		for (x = 0; x < 8; x++) {
-			cur_c = c + x;
-			while (cur_c >= inst->cols) {
-				cur_c -= inst->cols;
-			}
-			//scanning sprite byte from msb to lsb and check if it is disabled§
-			//getting x bit from sprite_byte
-			sprite_val = (sprite_byte & (0x80 >> x)) >> (7 - x);
-			pixel_disabled |= xor(inst, cur_c, cur_r, sprite_val);
-		}
+		row = &inst->data[(r + y) % inst->rows];
+		// sprite byte in the top bits is column c after the rotate, columns past the edge wrap to the left
+		bits = rotate_right((uint64_t) sprite[y] << (IMAGE_COLS - 8), c);
+		pixel_disabled |= (*row & bits) != 0;
+		*row ^= bits;
 	}
 	return pixel_disabled;
 }
@@ -72,30 +164,35 @@ bool image_xor_sprite(image_t *inst, int c, int r, int height, uint8_t *sprite)
 
 void image_draw_to_stdout(image_t* inst) {
 	int r, c;
+	uint64_t bits;
 
 	for (r = 0; r < inst->rows; r++) {
-		for (c = 0; c < inst->cols; c++) {
-			if (*image_at(inst, c, r) > 0) {
-				printf("X");
-			} else {
-				printf(" ");
-			}
+		bits = inst->data[r];
+		for (c = 0; c < IMAGE_COLS; c++, bits <<= 1) {
+			printf(bits >> (IMAGE_COLS - 1) ? "X" : " ");
 		}
 		printf("\n");
 	}
 	printf("\n");
 }
 
-uint8_t* image_at(image_t* inst, int c, int r) {
-	if (c < 0 || c >= inst->cols) {
-		log_error("Column=%d is out of bounds", c);
-		exit(1);
-	}
-	return &image_row(inst, r)[c];
+void image_set_all(image_t *inst, uint8_t value) {
+	memset(inst->data, value ? 0xFF : 0, inst->rows * sizeof(uint64_t));
+	mark_dirty(inst, 0, IMAGE_COLS, 0, inst->rows);
 }
 
-void image_set_all(image_t *inst, uint8_t value) {
-	memset(inst->data, value, inst->rows * inst->cols);
+bool image_take_dirty(image_t* inst, struct image_rect* rect) {
+	if (!inst->dirty) {
+		return false;
+	}
+	if (rect) {
+		rect->x = inst->dirty_left & ~7;
+		rect->w = ((inst->dirty_right + 7) & ~7) - rect->x;
+		rect->y = inst->dirty_top;
+		rect->h = inst->dirty_bottom - inst->dirty_top;
+	}
+	inst->dirty = false;
+	return true;
 }
 
 void image_destroy(image_t* inst) {
@@ -103,14 +200,124 @@ void image_destroy(image_t* inst) {
 	free(inst);
 }
 
-void image_copy_to_rgb24(image_t* inst, uint8_t* dst, int red_scale, int green_scale, int blue_scale) {
+void image_palette_init(struct image_palette* palette, uint32_t off, uint32_t on) {
+	int nibble;
+	int x;
+	uint32_t color;
+
+	palette->off = off;
+	palette->on = on;
+	for (nibble = 0; nibble < 16; nibble++) {
+		for (x = 0; x < 4; x++) {
+			color = (nibble >> (3 - x)) & 1 ? on : off;
+			palette->xrgb8888[nibble][x] = color & 0xFFFFFF;
+			palette->rgb24[nibble][x * 3] = color >> 16;
+			palette->rgb24[nibble][x * 3 + 1] = color >> 8;
+			palette->rgb24[nibble][x * 3 + 2] = color;
+		}
+	}
+}
+
+static void convert_rgb24(image_t* inst, const struct image_palette* palette, const struct image_rect* rect, uint8_t* dst, int pitch) {
 	int row, col;
+	uint64_t bits;
 
-	for (row = 0; row < inst->rows; row++) {
-		for (col = 0; col < inst->cols; col++) {
-			dst[(row * inst->cols + col) * 3] = *image_at(inst, col, row) * red_scale;
-			dst[(row * inst->cols + col) * 3 + 1] = *image_at(inst, col, row) * green_scale;
-			dst[(row * inst->cols + col) * 3 + 2] = *image_at(inst, col, row) * blue_scale;
+	for (row = rect->y; row < rect->y + rect->h; row++, dst += pitch) {
+		bits = inst->data[row] << rect->x;
+		for (col = 0; col < rect->w / 4; col++, bits <<= 4) {
+			memcpy(dst + col * 12, palette->rgb24[bits >> (IMAGE_COLS - 4)], 12);
 		}
 	}
 }
+
+#if defined(IMAGE_SIMD)
+/* Every pixel becomes off ^ ((on ^ off) & mask), the mask comes from comparing the broadcast row bits */
+/* against one bit per lane. SSE2 is always there on x86-64, AVX2 is picked at run time. */
+static void convert_xrgb8888_sse2(image_t* inst, const struct image_palette* palette, const struct image_rect* rect, uint8_t* dst, int pitch) {
+	int row, col;
+	uint64_t bits;
+	__m128i lanes;
+	__m128i mask;
+	__m128i off;
+	__m128i diff;
+
+	lanes = _mm_set_epi32(1, 2, 4, 8);
+	off = _mm_set1_epi32(palette->off & 0xFFFFFF);
+	diff = _mm_set1_epi32((palette->on ^ palette->off) & 0xFFFFFF);
+	for (row = rect->y; row < rect->y + rect->h; row++, dst += pitch) {
+		bits = inst->data[row] << rect->x;
+		for (col = 0; col < rect->w / 4; col++, bits <<= 4) {
+			mask = _mm_and_si128(_mm_set1_epi32(bits >> (IMAGE_COLS - 4)), lanes);
+			mask = _mm_cmpeq_epi32(mask, lanes);
+			_mm_storeu_si128((__m128i*) (dst + col * 16), _mm_xor_si128(off, _mm_and_si128(diff, mask)));
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void convert_xrgb8888_avx2(image_t* inst, const struct image_palette* palette, const struct image_rect* rect, uint8_t* dst, int pitch) {
+	int row, col;
+	uint64_t bits;
+	__m256i lanes;
+	__m256i mask;
+	__m256i off;
+	__m256i diff;
+
+	lanes = _mm256_set_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	off = _mm256_set1_epi32(palette->off & 0xFFFFFF);
+	diff = _mm256_set1_epi32((palette->on ^ palette->off) & 0xFFFFFF);
+	for (row = rect->y; row < rect->y + rect->h; row++, dst += pitch) {
+		bits = inst->data[row] << rect->x;
+		for (col = 0; col < rect->w / 8; col++, bits <<= 8) {
+			mask = _mm256_and_si256(_mm256_set1_epi32(bits >> (IMAGE_COLS - 8)), lanes);
+			mask = _mm256_cmpeq_epi32(mask, lanes);
+			_mm256_storeu_si256((__m256i*) (dst + col * 32), _mm256_xor_si256(off, _mm256_and_si256(diff, mask)));
+		}
+	}
+}
+
+static void convert_xrgb8888(image_t* inst, const struct image_palette* palette, const struct image_rect* rect, uint8_t* dst, int pitch) {
+	if (__builtin_cpu_supports("avx2")) {
+		convert_xrgb8888_avx2(inst, palette, rect, dst, pitch);
+	} else {
+		convert_xrgb8888_sse2(inst, palette, rect, dst, pitch);
+	}
+}
+#else
+static void convert_xrgb8888(image_t* inst, const struct image_palette* palette, const struct image_rect* rect, uint8_t* dst, int pitch) {
+	int row, col;
+	uint64_t bits;
+
+	for (row = rect->y; row < rect->y + rect->h; row++, dst += pitch) {
+		bits = inst->data[row] << rect->x;
+		for (col = 0; col < rect->w / 4; col++, bits <<= 4) {
+			memcpy(dst + col * 16, palette->xrgb8888[bits >> (IMAGE_COLS - 4)], 16);
+		}
+	}
+}
+#endif
+
+void image_convert(image_t* inst, const struct image_palette* palette, enum ImageFormat format, void* dst, int pitch) {
+	struct image_rect rect;
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.w = IMAGE_COLS;
+	rect.h = inst->rows;
+	image_convert_rect(inst, palette, format, &rect, dst, pitch);
+}
+
+void image_convert_rect(image_t* inst, const struct image_palette* palette, enum ImageFormat format,
+		const struct image_rect* rect, void* dst, int pitch) {
+	switch (format) {
+		case IMAGE_FORMAT_RGB24:
+			convert_rgb24(inst, palette, rect, dst, pitch);
+			break;
+		case IMAGE_FORMAT_XRGB8888:
+			convert_xrgb8888(inst, palette, rect, dst, pitch);
+			break;
+		default:
+			log_error("Unknown image format %d", format);
+			break;
+	}
+}
@@ -0,0 +1,270 @@
+#include "input_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <log.h>
+
+#define INPUT_LOG_MAGIC 0x4E493843 // "C8IN"
+#define INPUT_LOG_VERSION 1
+#define INPUT_LOG_HEADER_SIZE 32
+/* Largest encoded event, a 64 bit varint frame delta and two key masks */
+#define MAX_EVENT_SIZE (10 + 2 + 2)
+
+struct input_event {
+	uint64_t frame;
+	uint16_t down;
+	uint16_t latched;
+};
+
+struct input_log {
+	struct input_event* events; // frames where the keypad changed, in order, nothing is held before the first
+	size_t count;
+	size_t capacity;
+	uint64_t frames;
+	uint64_t seed;
+	int cycles_per_frame;
+};
+
+input_log_t* input_log_create(void) {
+	return calloc(1, sizeof(struct input_log));
+}
+
+void input_log_destroy(input_log_t* log) {
+	free(log->events);
+	free(log);
+}
+
+void input_log_set_start(input_log_t* log, uint64_t seed, int cycles_per_frame) {
+	log->seed = seed;
+	log->cycles_per_frame = cycles_per_frame;
+}
+
+uint64_t input_log_seed(input_log_t* log) {
+	return log->seed;
+}
+
+int input_log_cycles_per_frame(input_log_t* log) {
+	return log->cycles_per_frame;
+}
+
+enum CpuResult input_log_record(input_log_t* log, uint64_t frame, uint16_t down, uint16_t latched) {
+	struct input_event* grown;
+	struct input_event* last;
+	size_t capacity;
+
+	// a rewound run plays these frames again, what was recorded for them no longer happened
+	while (log->count > 0 && log->events[log->count - 1].frame >= frame) {
+		log->count--;
+	}
+	log->frames = frame + 1;
+	last = log->count > 0 ? &log->events[log->count - 1] : NULL;
+	if (last ? last->down == down && last->latched == latched : down == 0 && latched == 0) {
+		return OK;
+	}
+	if (log->count == log->capacity) {
+		capacity = log->capacity ? log->capacity * 2 : 256;
+		grown = realloc(log->events, capacity * sizeof(struct input_event));
+		if (!grown) {
+			log_error("Unable to record input of frame %llu", (unsigned long long) frame);
+			return MEMORY_ERROR;
+		}
+		log->events = grown;
+		log->capacity = capacity;
+	}
+	log->events[log->count].frame = frame;
+	log->events[log->count].down = down;
+	log->events[log->count].latched = latched;
+	log->count++;
+	return OK;
+}
+
+void input_log_keys(input_log_t* log, uint64_t frame, size_t* cursor, uint16_t* down, uint16_t* latched) {
+	size_t i;
+
+	// the cursor counts the events up to the frame looked up last, going back starts over
+	i = *cursor;
+	if (i > log->count || (i > 0 && log->events[i - 1].frame > frame)) {
+		i = 0;
+	}
+	while (i < log->count && log->events[i].frame <= frame) {
+		i++;
+	}
+	*cursor = i;
+	*down = i > 0 ? log->events[i - 1].down : 0;
+	*latched = i > 0 ? log->events[i - 1].latched : 0;
+}
+
+uint64_t input_log_frames(input_log_t* log) {
+	return log->frames;
+}
+
+static uint8_t* put16(uint8_t* p, uint16_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	return p + 2;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t value) {
+	return put16(put16(p, value), value >> 16);
+}
+
+static uint8_t* put64(uint8_t* p, uint64_t value) {
+	return put32(put32(p, value), value >> 32);
+}
+
+static uint8_t* put_varint(uint8_t* p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+/* Readers fail once they would pass end and keep failing */
+struct reader {
+	const uint8_t* p;
+	const uint8_t* end;
+	bool ok;
+};
+
+static uint64_t get(struct reader* r, int bytes) {
+	uint64_t value;
+	int i;
+
+	if (r->end - r->p < bytes) {
+		r->ok = false;
+		return 0;
+	}
+	value = 0;
+	for (i = 0; i < bytes; i++) {
+		value |= (uint64_t) *r->p++ << (8 * i);
+	}
+	return value;
+}
+
+static uint64_t get_varint(struct reader* r) {
+	uint64_t value;
+	uint8_t byte;
+	int shift;
+
+	value = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		byte = get(r, 1);
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return value;
+		}
+	}
+	r->ok = false;
+	return 0;
+}
+
+enum CpuResult input_log_save(input_log_t* log, const char* path) {
+	uint8_t* buf;
+	uint8_t* p;
+	uint64_t previous;
+	size_t i;
+	FILE* f;
+	bool ok;
+
+	buf = malloc(INPUT_LOG_HEADER_SIZE + log->count * MAX_EVENT_SIZE);
+	if (!buf) {
+		return MEMORY_ERROR;
+	}
+	p = put32(buf, INPUT_LOG_MAGIC);
+	p = put16(p, INPUT_LOG_VERSION);
+	p = put16(p, 0);
+	p = put64(p, log->seed);
+	p = put32(p, log->cycles_per_frame);
+	p = put64(p, log->frames);
+	p = put32(p, log->count);
+	previous = 0;
+	for (i = 0; i < log->count; i++) {
+		p = put_varint(p, log->events[i].frame - previous);
+		p = put16(p, log->events[i].down);
+		p = put16(p, log->events[i].latched);
+		previous = log->events[i].frame;
+	}
+	f = fopen(path, "wb");
+	if (!f) {
+		log_error("Unable to open file %s", path);
+		free(buf);
+		return IO_ERROR;
+	}
+	ok = fwrite(buf, p - buf, 1, f) == 1;
+	ok = fclose(f) == 0 && ok;
+	free(buf);
+	if (!ok) {
+		log_error("Unable to write input log to %s", path);
+		return IO_ERROR;
+	}
+	return OK;
+}
+
+input_log_t* input_log_load(const char* path) {
+	struct reader r;
+	input_log_t* log;
+	uint8_t* buf;
+	uint64_t frames;
+	uint64_t frame;
+	uint64_t delta;
+	uint16_t down;
+	uint16_t latched;
+	uint32_t count;
+	uint32_t i;
+	long len;
+	FILE* f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		log_error("Unable to open file %s", path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = len > 0 ? malloc(len) : NULL;
+	if (!buf || fread(buf, len, 1, f) != 1) {
+		log_error("Unable to read %s", path);
+		fclose(f);
+		free(buf);
+		return NULL;
+	}
+	fclose(f);
+	log = input_log_create();
+	if (!log) {
+		free(buf);
+		return NULL;
+	}
+	r.p = buf;
+	r.end = buf + len;
+	r.ok = get(&r, 4) == INPUT_LOG_MAGIC && get(&r, 2) == INPUT_LOG_VERSION;
+	get(&r, 2);
+	log->seed = get(&r, 8);
+	log->cycles_per_frame = get(&r, 4);
+	frames = get(&r, 8);
+	count = get(&r, 4);
+	frame = 0;
+	for (i = 0; i < count && r.ok; i++) {
+		delta = get_varint(&r);
+		down = get(&r, 2);
+		latched = get(&r, 2);
+		frame += delta;
+		// events are in order and within the frames recorded
+		if ((i > 0 && delta == 0) || delta >= frames || frame >= frames ||
+				input_log_record(log, frame, down, latched) != OK) {
+			r.ok = false;
+		}
+	}
+	log->frames = frames;
+	free(buf);
+	if (!r.ok) {
+		log_error("%s is not an input log", path);
+		input_log_destroy(log);
+		return NULL;
+	}
+	return log;
+}
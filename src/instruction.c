@@ -0,0 +1,274 @@
+#include "instruction.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef CPU_DISPATCH_CHAIN
+/* The original mask chain, kept for comparing dispatch strategies. Matches are tried top to bottom. */
+static const struct {
+	uint16_t mask;
+	uint16_t value;
+	uint8_t op;
+} op_chain[] = {
+	{ 0xF000, 0x1000, OP_JP },
+	{ 0xF000, 0x2000, OP_CALL },
+	{ 0xF000, 0x3000, OP_SE },
+	{ 0xF000, 0x4000, OP_SNE },
+	{ 0xF00F, 0x5000, OP_SEREG },
+	{ 0xF000, 0x6000, OP_LDIM },
+	{ 0xF000, 0x7000, OP_ADDIM },
+	{ 0xF00F, 0x8000, OP_LDV },
+	{ 0xF00F, 0x8001, OP_OR },
+	{ 0xF00F, 0x8002, OP_AND },
+	{ 0xF00F, 0x8003, OP_XOR },
+	{ 0xF00F, 0x8004, OP_ADD },
+	{ 0xF00F, 0x8005, OP_SUB },
+	{ 0xF00F, 0x8006, OP_SHR },
+	{ 0xF00F, 0x8007, OP_SUBN },
+	{ 0xF00F, 0x800E, OP_SHL },
+	{ 0xF00F, 0x9000, OP_SNEREG },
+	{ 0xF000, 0xA000, OP_LDI },
+	{ 0xF000, 0xB000, OP_JPREG },
+	{ 0xF000, 0xC000, OP_RND },
+	{ 0xF000, 0xD000, OP_DRAW },
+	{ 0xF0FF, 0xE09E, OP_SKEY },
+	{ 0xF0FF, 0xE0A1, OP_SNKEY },
+	{ 0xF0FF, 0xF007, OP_RDELAY },
+	{ 0xF0FF, 0xF00A, OP_WAITKEY },
+	{ 0xF0FF, 0xF015, OP_WDELAY },
+	{ 0xF0FF, 0xF018, OP_WSOUND },
+	{ 0xF0FF, 0xF01E, OP_ADDI },
+	{ 0xF0FF, 0xF029, OP_LDSPRITE },
+	{ 0xF0FF, 0xF033, OP_STBCD },
+	{ 0xF0FF, 0xF055, OP_STREG },
+	{ 0xF0FF, 0xF065, OP_LDREG },
+	{ 0xFFFF, 0x00E0, OP_CLS },
+	{ 0xFFFF, 0x00EE, OP_RET },
+	{ 0xFFFF, 0x0000, OP_NOP }
+};
+
+static uint8_t decode_op(uint16_t opcode) {
+	size_t i;
+
+	for (i = 0; i < sizeof(op_chain) / sizeof(op_chain[0]); i++) {
+		if ((opcode & op_chain[i].mask) == op_chain[i].value) {
+			return op_chain[i].op;
+		}
+	}
+	return OP_UNKNOWN;
+}
+#else
+/* Instructions fully identified by the high nibble. Groups are resolved through the second-level tables below. */
+static const uint8_t ops_by_nibble[16] = {
+	[0x1] = OP_JP,
+	[0x2] = OP_CALL,
+	[0x3] = OP_SE,
+	[0x4] = OP_SNE,
+	[0x6] = OP_LDIM,
+	[0x7] = OP_ADDIM,
+	[0xA] = OP_LDI,
+	[0xB] = OP_JPREG,
+	[0xC] = OP_RND,
+	[0xD] = OP_DRAW
+};
+
+/* 00kk, only valid when x is zero */
+static const uint8_t ops_0[256] = {
+	[0x00] = OP_NOP,
+	[0xE0] = OP_CLS,
+	[0xEE] = OP_RET
+};
+
+/* 8xyN */
+static const uint8_t ops_8[16] = {
+	[0x0] = OP_LDV,
+	[0x1] = OP_OR,
+	[0x2] = OP_AND,
+	[0x3] = OP_XOR,
+	[0x4] = OP_ADD,
+	[0x5] = OP_SUB,
+	[0x6] = OP_SHR,
+	[0x7] = OP_SUBN,
+	[0xE] = OP_SHL
+};
+
+/* ExNN */
+static const uint8_t ops_e[256] = {
+	[0x9E] = OP_SKEY,
+	[0xA1] = OP_SNKEY
+};
+
+/* FxNN */
+static const uint8_t ops_f[256] = {
+	[0x07] = OP_RDELAY,
+	[0x0A] = OP_WAITKEY,
+	[0x15] = OP_WDELAY,
+	[0x18] = OP_WSOUND,
+	[0x1E] = OP_ADDI,
+	[0x29] = OP_LDSPRITE,
+	[0x33] = OP_STBCD,
+	[0x55] = OP_STREG,
+	[0x65] = OP_LDREG
+};
+
+static uint8_t decode_op(uint16_t opcode) {
+	switch (opcode >> 12) {
+		case 0x0:
+			return (opcode & 0x0F00) ? OP_UNKNOWN : ops_0[opcode & 0x00FF];
+		case 0x5:
+			return (opcode & 0x000F) ? OP_UNKNOWN : OP_SEREG;
+		case 0x8:
+			return ops_8[opcode & 0x000F];
+		case 0x9:
+			return (opcode & 0x000F) ? OP_UNKNOWN : OP_SNEREG;
+		case 0xE:
+			return ops_e[opcode & 0x00FF];
+		case 0xF:
+			return ops_f[opcode & 0x00FF];
+		default:
+			return ops_by_nibble[opcode >> 12];
+	}
+}
+#endif
+
+void instruction_decode(uint16_t opcode, struct instruction* ins) {
+	ins->opcode = opcode;
+	ins->nnn = opcode & 0x0FFF;
+	ins->kk = opcode & 0x00FF;
+	ins->x = (opcode & 0x0F00) >> 8;
+	ins->y = (opcode & 0x00F0) >> 4;
+	ins->n = opcode & 0x000F;
+	ins->op = decode_op(opcode);
+}
+
+static const char* const op_names[OP_COUNT] = {
+	[OP_UNKNOWN] = "UNKNOWN",
+	[OP_NOP] = "NOP",
+	[OP_CLS] = "CLS",
+	[OP_RET] = "RET",
+	[OP_JP] = "JP",
+	[OP_CALL] = "CALL",
+	[OP_SE] = "SE",
+	[OP_SNE] = "SNE",
+	[OP_SEREG] = "SEREG",
+	[OP_LDIM] = "LDIM",
+	[OP_ADDIM] = "ADDIM",
+	[OP_LDV] = "LDV",
+	[OP_OR] = "OR",
+	[OP_AND] = "AND",
+	[OP_XOR] = "XOR",
+	[OP_ADD] = "ADD",
+	[OP_SUB] = "SUB",
+	[OP_SHR] = "SHR",
+	[OP_SUBN] = "SUBN",
+	[OP_SHL] = "SHL",
+	[OP_SNEREG] = "SNEREG",
+	[OP_LDI] = "LDI",
+	[OP_JPREG] = "JPREG",
+	[OP_RND] = "RND",
+	[OP_DRAW] = "DRAW",
+	[OP_SKEY] = "SKEY",
+	[OP_SNKEY] = "SNKEY",
+	[OP_RDELAY] = "RDELAY",
+	[OP_WAITKEY] = "WAIT",
+	[OP_WDELAY] = "DELAY",
+	[OP_WSOUND] = "SOUND",
+	[OP_ADDI] = "ADDI",
+	[OP_LDSPRITE] = "LDSPRITE",
+	[OP_STBCD] = "STBCD",
+	[OP_STREG] = "STREG",
+	[OP_LDREG] = "LDREG",
+	[OP_UNDECODED] = "UNDECODED",
+	[OP_FUSED_SE_JP] = "SE+JP",
+	[OP_FUSED_SNE_JP] = "SNE+JP",
+	[OP_FUSED_LDIM_DRAW] = "LDIM+DRAW",
+	[OP_FUSED_LDI_ADDI_LDREG] = "LDI+ADDI+LDREG",
+	[OP_FUSED_DELAY_POLL] = "RDELAY+SE+JP"
+};
+
+const char* instruction_name(uint8_t op) {
+	if (op >= OP_COUNT) {
+		return "?";
+	}
+	return op_names[op];
+}
+
+int instruction_format(uint16_t opcode, char* buf, size_t size) {
+	struct instruction ins;
+
+	instruction_decode(opcode, &ins);
+	switch (ins.op) {
+		case OP_NOP:
+			return snprintf(buf, size, "SYS 0x%03X", ins.nnn);
+		case OP_CLS:
+			return snprintf(buf, size, "CLS");
+		case OP_RET:
+			return snprintf(buf, size, "RET");
+		case OP_JP:
+			return snprintf(buf, size, "JP 0x%03X", ins.nnn);
+		case OP_CALL:
+			return snprintf(buf, size, "CALL 0x%03X", ins.nnn);
+		case OP_SE:
+			return snprintf(buf, size, "SE V%X, 0x%02X", ins.x, ins.kk);
+		case OP_SNE:
+			return snprintf(buf, size, "SNE V%X, 0x%02X", ins.x, ins.kk);
+		case OP_SEREG:
+			return snprintf(buf, size, "SE V%X, V%X", ins.x, ins.y);
+		case OP_LDIM:
+			return snprintf(buf, size, "LD V%X, 0x%02X", ins.x, ins.kk);
+		case OP_ADDIM:
+			return snprintf(buf, size, "ADD V%X, 0x%02X", ins.x, ins.kk);
+		case OP_LDV:
+			return snprintf(buf, size, "LD V%X, V%X", ins.x, ins.y);
+		case OP_OR:
+			return snprintf(buf, size, "OR V%X, V%X", ins.x, ins.y);
+		case OP_AND:
+			return snprintf(buf, size, "AND V%X, V%X", ins.x, ins.y);
+		case OP_XOR:
+			return snprintf(buf, size, "XOR V%X, V%X", ins.x, ins.y);
+		case OP_ADD:
+			return snprintf(buf, size, "ADD V%X, V%X", ins.x, ins.y);
+		case OP_SUB:
+			return snprintf(buf, size, "SUB V%X, V%X", ins.x, ins.y);
+		case OP_SHR:
+			return snprintf(buf, size, "SHR V%X", ins.x);
+		case OP_SUBN:
+			return snprintf(buf, size, "SUBN V%X, V%X", ins.x, ins.y);
+		case OP_SHL:
+			return snprintf(buf, size, "SHL V%X", ins.x);
+		case OP_SNEREG:
+			return snprintf(buf, size, "SNE V%X, V%X", ins.x, ins.y);
+		case OP_LDI:
+			return snprintf(buf, size, "LD I, 0x%03X", ins.nnn);
+		case OP_JPREG:
+			return snprintf(buf, size, "JP V0, 0x%03X", ins.nnn);
+		case OP_RND:
+			return snprintf(buf, size, "RND V%X, 0x%02X", ins.x, ins.kk);
+		case OP_DRAW:
+			return snprintf(buf, size, "DRW V%X, V%X, %d", ins.x, ins.y, ins.n);
+		case OP_SKEY:
+			return snprintf(buf, size, "SKP V%X", ins.x);
+		case OP_SNKEY:
+			return snprintf(buf, size, "SKNP V%X", ins.x);
+		case OP_RDELAY:
+			return snprintf(buf, size, "LD V%X, DT", ins.x);
+		case OP_WAITKEY:
+			return snprintf(buf, size, "LD V%X, K", ins.x);
+		case OP_WDELAY:
+			return snprintf(buf, size, "LD DT, V%X", ins.x);
+		case OP_WSOUND:
+			return snprintf(buf, size, "LD ST, V%X", ins.x);
+		case OP_ADDI:
+			return snprintf(buf, size, "ADD I, V%X", ins.x);
+		case OP_LDSPRITE:
+			return snprintf(buf, size, "LD F, V%X", ins.x);
+		case OP_STBCD:
+			return snprintf(buf, size, "LD B, V%X", ins.x);
+		case OP_STREG:
+			return snprintf(buf, size, "LD [I], V%X", ins.x);
+		case OP_LDREG:
+			return snprintf(buf, size, "LD V%X, [I]", ins.x);
+		default:
+			return snprintf(buf, size, "DW 0x%04X", opcode);
+	}
+}
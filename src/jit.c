@@ -0,0 +1,390 @@
+#include "jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <log.h>
+#include <async_log.h>
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_MAX_BLOCKS 4096
+// room kept free for the block being emitted, comfortably above the largest block the cpu asks for, a block that
+// does not fit is dropped
+#define JIT_BLOCK_RESERVE 8192
+// one slot per even guest address
+#define JIT_SLOTS 2048
+// push rbx; mov rbx, rdi, what a linked exit jumps over
+#define JIT_PROLOGUE_SIZE 4
+// offsets of the block length in sub dword [rbx + budget], imm32 and add qword [rbx + cycles], imm32
+#define JIT_BUDGET_LENGTH 10
+#define JIT_CYCLES_LENGTH 21
+// cmp word [rbx + pc], imm16; jne next; cmp dword [rbx + budget], imm32; jl next; jmp rel32
+#define JIT_EXIT_SIZE 28
+
+/* The code buffer is executable and never writable, except for the pages of the block being emitted, which */
+/* are writable and not executable until jit_block_end, and those of an exit while it is linked or unlinked. */
+struct jit {
+	uint8_t* code;
+	size_t code_used;
+	size_t block_offset;
+	size_t code_limit; // end of the writable pages while a block is emitted
+	size_t page_size;
+	bool overflow;
+	jit_block_t* blocks;
+	size_t blocks_used;
+	jit_block_t* by_address[JIT_SLOTS];
+	uint8_t covered[JIT_SLOTS];
+	uint64_t generation;
+	int32_t pc_offset;
+	int32_t budget_offset;
+	int32_t cycles_offset;
+};
+
+bool jit_supported(void) {
+#if defined(__x86_64__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+jit_t* jit_create(int32_t pc_offset, int32_t budget_offset, int32_t cycles_offset) {
+	jit_t* jit;
+
+	if (!jit_supported()) {
+		log_error("JIT is not supported on this architecture");
+		return NULL;
+	}
+	jit = calloc(1, sizeof(struct jit));
+	if (!jit) {
+		return NULL;
+	}
+	jit->page_size = sysconf(_SC_PAGESIZE);
+	jit->pc_offset = pc_offset;
+	jit->budget_offset = budget_offset;
+	jit->cycles_offset = cycles_offset;
+	jit->blocks = calloc(JIT_MAX_BLOCKS, sizeof(jit_block_t));
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (!jit->blocks || jit->code == MAP_FAILED) {
+		log_error("Unable to allocate JIT code buffer");
+		free(jit->blocks);
+		free(jit);
+		return NULL;
+	}
+	return jit;
+}
+
+void jit_destroy(jit_t* jit) {
+	munmap(jit->code, JIT_CODE_SIZE);
+	free(jit->blocks);
+	free(jit);
+}
+
+void jit_flush(jit_t* jit) {
+	jit->code_used = 0;
+	jit->blocks_used = 0;
+	memset(jit->by_address, 0, sizeof(jit->by_address));
+	memset(jit->covered, 0, sizeof(jit->covered));
+	jit->generation++;
+	async_log_debug("JIT cache flushed");
+}
+
+uint64_t jit_generation(jit_t* jit) {
+	return jit->generation;
+}
+
+jit_block_t* jit_lookup(jit_t* jit, uint16_t addr) {
+	if (addr & 0xF001) {
+		return NULL;
+	}
+	return jit->by_address[addr >> 1];
+}
+
+static void unlink_exit(jit_t* jit, jit_block_t* block, int exit);
+
+void jit_invalidate(jit_t* jit, uint16_t addr, uint16_t len) {
+	size_t i;
+	size_t first;
+	size_t last;
+	bool hit;
+	jit_block_t* b;
+	int j;
+
+	if (len == 0) {
+		return;
+	}
+	first = addr >> 1;
+	last = ((size_t) addr + len - 1) >> 1;
+	hit = false;
+	for (i = first; i <= last && i < JIT_SLOTS; i++) {
+		hit |= jit->covered[i];
+	}
+	if (!hit) {
+		return;
+	}
+	for (i = 0; i < jit->blocks_used; i++) {
+		b = &jit->blocks[i];
+		if (b->valid && b->start <= last * 2 + 1 && b->end > first * 2) {
+			b->valid = false;
+			if (jit->by_address[b->start >> 1] == b) {
+				jit->by_address[b->start >> 1] = NULL;
+			}
+		}
+	}
+	for (i = 0; i < jit->blocks_used; i++) {
+		b = &jit->blocks[i];
+		for (j = 0; j < 2; j++) {
+			if (b->links[j] && !b->links[j]->valid) {
+				unlink_exit(jit, b, j);
+			}
+		}
+	}
+}
+
+/* Flips the pages holding code [start, end) between writable and executable */
+static bool protect(jit_t* jit, size_t start, size_t end, bool writable) {
+	int prot;
+
+	start &= ~(jit->page_size - 1);
+	prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+	if (mprotect(jit->code + start, end - start, prot) != 0) {
+		log_error("Unable to change the protection of JIT code");
+		return false;
+	}
+	return true;
+}
+
+/* Flips the pages from the block being emitted up to code_limit */
+static bool set_writable(jit_t* jit, bool writable) {
+	return protect(jit, jit->block_offset, jit->code_limit, writable);
+}
+
+static void put_le(uint8_t* p, uint64_t value, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		p[i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+/* Encodes an exit that jumps rel bytes past its end when the program counter is pc and the budget covers */
+/* length. An unlinked exit jumps to the next instruction. */
+static void encode_exit(jit_t* jit, uint8_t* p, uint16_t pc, uint16_t length, int32_t rel) {
+	// cmp word [rbx + pc], imm16; jne next
+	p[0] = 0x66;
+	p[1] = 0x81;
+	p[2] = 0xBB;
+	put_le(p + 3, (uint32_t) jit->pc_offset, 4);
+	put_le(p + 7, pc, 2);
+	p[9] = 0x75;
+	p[10] = JIT_EXIT_SIZE - 11;
+	// cmp dword [rbx + budget], imm32; jl next
+	p[11] = 0x81;
+	p[12] = 0xBB;
+	put_le(p + 13, (uint32_t) jit->budget_offset, 4);
+	put_le(p + 17, length, 4);
+	p[21] = 0x7C;
+	p[22] = JIT_EXIT_SIZE - 23;
+	// jmp rel32
+	p[23] = 0xE9;
+	put_le(p + 24, (uint32_t) rel, 4);
+}
+
+/* Rewrites an exit of a finished block, its pages are writable only while it does */
+static bool patch_exit(jit_t* jit, jit_block_t* block, int exit, jit_block_t* to) {
+	uint8_t bytes[JIT_EXIT_SIZE];
+	size_t offset;
+	int32_t rel;
+
+	offset = block->exits + exit * JIT_EXIT_SIZE;
+	rel = to ? (int32_t) (to->code + JIT_PROLOGUE_SIZE) - (int32_t) (offset + JIT_EXIT_SIZE) : 0;
+	encode_exit(jit, bytes, to ? to->start : 1, to ? to->length : 0, rel);
+	if (!protect(jit, offset, offset + JIT_EXIT_SIZE, true)) {
+		return false;
+	}
+	memcpy(jit->code + offset, bytes, JIT_EXIT_SIZE);
+	return protect(jit, offset, offset + JIT_EXIT_SIZE, false);
+}
+
+static void unlink_exit(jit_t* jit, jit_block_t* block, int exit) {
+	block->links[exit] = NULL;
+	patch_exit(jit, block, exit, NULL);
+}
+
+void jit_link(jit_t* jit, jit_block_t* from, jit_block_t* to) {
+	int exit;
+
+	if (!from->fn || !to->fn || from->links[0] == to || from->links[1] == to) {
+		return;
+	}
+	// a return or a computed jump can have any number of successors, repatching its exits for each would cost
+	// far more than it saves, so they keep the first two
+	exit = from->links[0] ? 1 : 0;
+	if (!from->links[exit]) {
+		from->links[exit] = patch_exit(jit, from, exit, to) ? to : NULL;
+	}
+}
+
+static void emit(jit_t* jit, const uint8_t* bytes, size_t n) {
+	if (jit->overflow || jit->code_used + n > jit->code_limit) {
+		jit->overflow = true;
+		return;
+	}
+	memcpy(jit->code + jit->code_used, bytes, n);
+	jit->code_used += n;
+}
+
+static void emit1(jit_t* jit, uint8_t b) {
+	emit(jit, &b, 1);
+}
+
+static void emit_le(jit_t* jit, uint64_t value, size_t n) {
+	uint8_t bytes[8];
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		bytes[i] = (value >> (8 * i)) & 0xFF;
+	}
+	emit(jit, bytes, n);
+}
+
+/* <op> [rbx + disp32] with the given opcode bytes and ModRM reg field */
+static void emit_rbx_mem(jit_t* jit, uint8_t op, uint8_t reg, int32_t offset) {
+	emit1(jit, op);
+	emit1(jit, 0x80 | (reg << 3) | 0x03);
+	emit_le(jit, (uint32_t) offset, 4);
+}
+
+jit_block_t* jit_block_begin(jit_t* jit, uint16_t start) {
+	jit_block_t* block;
+
+	if (jit->blocks_used == JIT_MAX_BLOCKS || jit->code_used + JIT_BLOCK_RESERVE > JIT_CODE_SIZE) {
+		return NULL;
+	}
+	block = &jit->blocks[jit->blocks_used];
+	memset(block, 0, sizeof(jit_block_t));
+	block->start = start;
+	jit->block_offset = jit->code_used;
+	jit->code_limit = jit->code_used + JIT_BLOCK_RESERVE;
+	// nothing is emitted if the pages cannot be written, the block is dropped at its end
+	jit->overflow = !set_writable(jit, true);
+	// push rbx; mov rbx, rdi
+	emit1(jit, 0x53);
+	emit1(jit, 0x48);
+	emit1(jit, 0x89);
+	emit1(jit, 0xFB);
+	// linked exits enter here. sub dword [rbx + budget], length; add qword [rbx + cycles], length, with the
+	// length filled in by jit_block_end
+	emit_rbx_mem(jit, 0x81, 5, jit->budget_offset);
+	emit_le(jit, 0, 4);
+	emit1(jit, 0x48);
+	emit_rbx_mem(jit, 0x81, 0, jit->cycles_offset);
+	emit_le(jit, 0, 4);
+	return block;
+}
+
+jit_block_t* jit_block_end(jit_t* jit, jit_block_t* block, uint16_t end, uint16_t length) {
+	uint8_t exit[JIT_EXIT_SIZE];
+	uint8_t* entry;
+	size_t i;
+
+	if (!jit->overflow) {
+		put_le(jit->code + jit->block_offset + JIT_BUDGET_LENGTH, length, 4);
+		put_le(jit->code + jit->block_offset + JIT_CYCLES_LENGTH, length, 4);
+	}
+	block->code = jit->block_offset;
+	block->exits = jit->code_used;
+	encode_exit(jit, exit, 1, 0, 0);
+	emit(jit, exit, JIT_EXIT_SIZE);
+	emit(jit, exit, JIT_EXIT_SIZE);
+	// mov rax, block; pop rbx; ret
+	emit1(jit, 0x48);
+	emit1(jit, 0xB8);
+	emit_le(jit, (uintptr_t) block, 8);
+	emit1(jit, 0x5B);
+	emit1(jit, 0xC3);
+	if (!set_writable(jit, false)) {
+		jit->overflow = true;
+	}
+	if (jit->overflow) {
+		jit->code_used = jit->block_offset;
+		return NULL;
+	}
+	if (length == 0) {
+		jit->code_used = jit->block_offset;
+		block->fn = NULL;
+		end = block->start + 2;
+	} else {
+		entry = jit->code + jit->block_offset;
+		memcpy(&block->fn, &entry, sizeof(block->fn));
+	}
+	block->end = end;
+	block->length = length;
+	block->valid = true;
+	for (i = block->start >> 1; i < JIT_SLOTS && i * 2 < end; i++) {
+		jit->covered[i] = 1;
+	}
+	jit->by_address[block->start >> 1] = block;
+	jit->blocks_used++;
+	return block;
+}
+
+void jit_emit_store8(jit_t* jit, int32_t offset, uint8_t value) {
+	// mov byte [rbx + offset], imm8
+	emit_rbx_mem(jit, 0xC6, 0, offset);
+	emit1(jit, value);
+}
+
+void jit_emit_add8(jit_t* jit, int32_t offset, uint8_t value) {
+	// add byte [rbx + offset], imm8
+	emit_rbx_mem(jit, 0x80, 0, offset);
+	emit1(jit, value);
+}
+
+void jit_emit_store16(jit_t* jit, int32_t offset, uint16_t value) {
+	// mov word [rbx + offset], imm16
+	emit1(jit, 0x66);
+	emit_rbx_mem(jit, 0xC7, 0, offset);
+	emit_le(jit, value, 2);
+}
+
+/* al <== [rbx + src]; <op> [rbx + dst], al */
+static void emit_alu8(jit_t* jit, uint8_t op, int32_t dst, int32_t src) {
+	emit_rbx_mem(jit, 0x8A, 0, src);
+	emit_rbx_mem(jit, op, 0, dst);
+}
+
+void jit_emit_move8(jit_t* jit, int32_t dst, int32_t src) {
+	emit_alu8(jit, 0x88, dst, src);
+}
+
+void jit_emit_or8(jit_t* jit, int32_t dst, int32_t src) {
+	emit_alu8(jit, 0x08, dst, src);
+}
+
+void jit_emit_and8(jit_t* jit, int32_t dst, int32_t src) {
+	emit_alu8(jit, 0x20, dst, src);
+}
+
+void jit_emit_xor8(jit_t* jit, int32_t dst, int32_t src) {
+	emit_alu8(jit, 0x30, dst, src);
+}
+
+void jit_emit_call(jit_t* jit, uintptr_t fn, uintptr_t arg) {
+	// mov rdi, rbx
+	emit1(jit, 0x48);
+	emit1(jit, 0x89);
+	emit1(jit, 0xDF);
+	// mov rsi, imm64
+	emit1(jit, 0x48);
+	emit1(jit, 0xBE);
+	emit_le(jit, arg, 8);
+	// mov rax, imm64; call rax
+	emit1(jit, 0x48);
+	emit1(jit, 0xB8);
+	emit_le(jit, fn, 8);
+	emit1(jit, 0xFF);
+	emit1(jit, 0xD0);
+}
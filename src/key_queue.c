@@ -0,0 +1,57 @@
+#include "key_queue.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// power of two, far more than a frame's worth of key presses
+#define KEY_QUEUE_SIZE 256
+#define PRESSED 0x80
+
+struct key_queue {
+	uint8_t events[KEY_QUEUE_SIZE]; // key in the low nibble, PRESSED for down
+	_Atomic(uint32_t) head; // next slot to read, written by the consumer
+	_Atomic(uint32_t) tail; // next slot to write, written by the producer
+};
+
+key_queue_t* key_queue_create(void) {
+	key_queue_t* q;
+
+	q = malloc(sizeof(struct key_queue));
+	if (!q) {
+		return NULL;
+	}
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return q;
+}
+
+void key_queue_destroy(key_queue_t* q) {
+	free(q);
+}
+
+bool key_queue_push(key_queue_t* q, uint8_t key, bool pressed) {
+	uint32_t tail;
+
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == KEY_QUEUE_SIZE) {
+		return false;
+	}
+	q->events[tail % KEY_QUEUE_SIZE] = (key & 0xF) | (pressed ? PRESSED : 0);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool key_queue_pop(key_queue_t* q, uint8_t* key, bool* pressed) {
+	uint32_t head;
+	uint8_t event;
+
+	head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) {
+		return false;
+	}
+	event = q->events[head % KEY_QUEUE_SIZE];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	*key = event & 0xF;
+	*pressed = event & PRESSED;
+	return true;
+}
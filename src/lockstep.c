@@ -0,0 +1,776 @@
+#include "lockstep.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+
+#include <instruction.h>
+#include <image.h>
+#include <rng.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LOCKSTEP_SIMD
+#include <immintrin.h>
+#endif
+
+#define MEMORY_SIZE 4096
+#define ROM_START 0x200
+#define SCREEN_ROWS 32
+#define STACK_DEPTH 16
+#define SLOTS (MEMORY_SIZE / 2)
+/* Lane arrays are padded to whole AVX2 registers of bytes */
+#define LANE_ALIGN 32
+/* Distinct addresses run as groups in one step, lanes scattered any further run one at a time */
+#define MAX_GROUPS 16
+
+static const int default_cycles_per_frame = 9;
+
+/* Per lane arrays are indexed [field * stride + lane] */
+struct lockstep {
+	int lanes;
+	int stride; // lanes rounded up to LANE_ALIGN
+	uint8_t* v;
+	uint16_t* i;
+	uint16_t* pc;
+	uint8_t* delay_timer;
+	uint8_t* sound_timer;
+	uint8_t* sp;
+	uint16_t* stack;
+	uint16_t* keys;
+	uint64_t* rng;
+	uint64_t* rows;
+	uint8_t* memory;         // a full copy per lane, [lane * MEMORY_SIZE + addr]
+	uint8_t* mask;           // lanes of the group being run, 0xFF or 0
+	uint8_t* done;           // lanes that already ran in this step
+	uint8_t* idle;           // done as every step starts, padding lanes are always done
+	uint8_t* cond;           // per lane outcome of a skip
+	uint8_t ref[MEMORY_SIZE]; // memory every lane started with
+	struct instruction code[SLOTS]; // ref decoded
+	int32_t slot_diffs[SLOTS]; // lanes whose memory differs from ref in the slot, only clean slots use code
+	int cycles_per_frame;
+	uint64_t tick_at; // cycles at the next timer tick
+	bool simd;
+	struct lockstep_stats stats;
+};
+
+static void* lane_array(lockstep_t* l, size_t size) {
+	void* p;
+
+	p = aligned_alloc(LANE_ALIGN, size * l->stride);
+	if (p) {
+		memset(p, 0, size * l->stride);
+	}
+	return p;
+}
+
+lockstep_t* lockstep_create(int lanes, const uint8_t* rom, size_t len) {
+	uint8_t fontset[80] = {
+		0xF0, 0x90, 0x90, 0x90, 0xF0, 0x20, 0x60, 0x20, 0x20, 0x70, 0xF0, 0x10, 0xF0, 0x80, 0xF0, 0xF0,
+		0x10, 0xF0, 0x10, 0xF0, 0x90, 0x90, 0xF0, 0x10, 0x10, 0xF0, 0x80, 0xF0, 0x10, 0xF0, 0xF0, 0x80,
+		0xF0, 0x90, 0xF0, 0xF0, 0x10, 0x20, 0x40, 0x40, 0xF0, 0x90, 0xF0, 0x90, 0xF0, 0xF0, 0x90, 0xF0,
+		0x10, 0xF0, 0xF0, 0x90, 0xF0, 0x90, 0x90, 0xE0, 0x90, 0xE0, 0x90, 0xE0, 0xF0, 0x80, 0x80, 0x80,
+		0xF0, 0xE0, 0x90, 0x90, 0x90, 0xE0, 0xF0, 0x80, 0xF0, 0x80, 0xF0, 0xF0, 0x80, 0xF0, 0x80, 0x80
+	};
+	lockstep_t* l;
+	int lane;
+	int j;
+
+	if (lanes <= 0 || len > MEMORY_SIZE - ROM_START) {
+		log_error("Unable to run %d lanes of a %zu byte ROM", lanes, len);
+		return NULL;
+	}
+	l = calloc(1, sizeof(struct lockstep));
+	if (!l) {
+		return NULL;
+	}
+	l->lanes = lanes;
+	l->stride = (lanes + LANE_ALIGN - 1) / LANE_ALIGN * LANE_ALIGN;
+	l->v = lane_array(l, 16);
+	l->i = lane_array(l, sizeof(uint16_t));
+	l->pc = lane_array(l, sizeof(uint16_t));
+	l->delay_timer = lane_array(l, 1);
+	l->sound_timer = lane_array(l, 1);
+	l->sp = lane_array(l, 1);
+	l->stack = lane_array(l, STACK_DEPTH * sizeof(uint16_t));
+	l->keys = lane_array(l, sizeof(uint16_t));
+	l->rng = lane_array(l, sizeof(uint64_t));
+	l->rows = lane_array(l, SCREEN_ROWS * sizeof(uint64_t));
+	l->memory = lane_array(l, MEMORY_SIZE);
+	l->mask = lane_array(l, 1);
+	l->done = lane_array(l, 1);
+	l->idle = lane_array(l, 1);
+	l->cond = lane_array(l, 1);
+	if (!l->v || !l->i || !l->pc || !l->delay_timer || !l->sound_timer || !l->sp || !l->stack || !l->keys || !l->rng ||
+			!l->rows || !l->memory || !l->mask || !l->done || !l->idle || !l->cond) {
+		lockstep_destroy(l);
+		return NULL;
+	}
+	memcpy(l->ref + 0x50, fontset, sizeof(fontset));
+	memcpy(l->ref + ROM_START, rom, len);
+	for (j = 0; j < SLOTS; j++) {
+		instruction_decode(l->ref[2 * j] << 8 | l->ref[2 * j + 1], &l->code[j]);
+	}
+	for (lane = 0; lane < l->stride; lane++) {
+		memcpy(l->memory + (size_t) lane * MEMORY_SIZE, l->ref, MEMORY_SIZE);
+		l->pc[lane] = ROM_START;
+		l->rng[lane] = rng_seed(CPU_DEFAULT_SEED);
+		l->idle[lane] = lane < lanes ? 0 : 0xFF;
+	}
+	l->cycles_per_frame = default_cycles_per_frame;
+	l->tick_at = default_cycles_per_frame;
+#if defined(LOCKSTEP_SIMD)
+	l->simd = __builtin_cpu_supports("avx2");
+#endif
+	return l;
+}
+
+void lockstep_destroy(lockstep_t* l) {
+	free(l->v);
+	free(l->i);
+	free(l->pc);
+	free(l->delay_timer);
+	free(l->sound_timer);
+	free(l->sp);
+	free(l->stack);
+	free(l->keys);
+	free(l->rng);
+	free(l->rows);
+	free(l->memory);
+	free(l->mask);
+	free(l->done);
+	free(l->idle);
+	free(l->cond);
+	free(l);
+}
+
+int lockstep_lanes(lockstep_t* l) {
+	return l->lanes;
+}
+
+enum CpuResult lockstep_set_cycles_per_frame(lockstep_t* l, int cycles) {
+	if (cycles < 1) {
+		log_error("%d cycles per frame is out of range", cycles);
+		return INVALID_STATE;
+	}
+	l->cycles_per_frame = cycles;
+	l->tick_at = l->stats.cycles + cycles;
+	return OK;
+}
+
+void lockstep_set_keys(lockstep_t* l, int lane, uint16_t keys) {
+	l->keys[lane] = keys;
+}
+
+void lockstep_set_seed(lockstep_t* l, int lane, uint64_t seed) {
+	l->rng[lane] = rng_seed(seed);
+}
+
+/* Register x of lane */
+#define V(l, x, lane) ((l)->v[(x) * (l)->stride + (lane)])
+
+static uint8_t* lane_memory(lockstep_t* l, int lane) {
+	return l->memory + (size_t) lane * MEMORY_SIZE;
+}
+
+/* Writes a byte of lane memory, keeping count of which slots no longer match the shared decode */
+static void store(lockstep_t* l, int lane, uint16_t addr, uint8_t value) {
+	uint8_t* mem;
+	uint16_t even;
+	bool before;
+	bool after;
+
+	mem = lane_memory(l, lane);
+	addr &= MEMORY_SIZE - 1;
+	even = addr & ~1;
+	before = mem[even] != l->ref[even] || mem[even + 1] != l->ref[even + 1];
+	mem[addr] = value;
+	after = mem[even] != l->ref[even] || mem[even + 1] != l->ref[even + 1];
+	l->slot_diffs[even >> 1] += (int) after - (int) before;
+}
+
+static uint64_t rotate_right(uint64_t bits, int n) {
+	return n == 0 ? bits : bits >> n | bits << (IMAGE_COLS - n);
+}
+
+/* Same as image_xor_sprite on the lane's rows */
+static bool draw(lockstep_t* l, int lane, int c, int r, int height) {
+	const uint8_t* mem;
+	uint64_t* row;
+	uint64_t bits;
+	bool erased;
+	int y;
+
+	mem = lane_memory(l, lane);
+	erased = false;
+	c %= IMAGE_COLS;
+	r %= SCREEN_ROWS;
+	for (y = 0; y < height; y++) {
+		row = &l->rows[(r + y) % SCREEN_ROWS * l->stride + lane];
+		bits = rotate_right((uint64_t) mem[(l->i[lane] + y) & (MEMORY_SIZE - 1)] << (IMAGE_COLS - 8), c);
+		erased |= (*row & bits) != 0;
+		*row ^= bits;
+	}
+	return erased;
+}
+
+/* Runs ins on a single lane, with the interpreter's semantics down to the order VF and Vx are written in */
+static void run_lane(lockstep_t* l, int lane, const struct instruction* ins) {
+	uint16_t* pc;
+	uint8_t* vx;
+	uint8_t* vy;
+	uint8_t* vf;
+	uint16_t keys;
+	uint16_t res;
+	uint8_t value;
+	int r;
+
+	pc = &l->pc[lane];
+	vx = &V(l, ins->x, lane);
+	vy = &V(l, ins->y, lane);
+	vf = &V(l, 0xF, lane);
+	switch (ins->op) {
+		case OP_CLS:
+			for (r = 0; r < SCREEN_ROWS; r++) {
+				l->rows[r * l->stride + lane] = 0;
+			}
+			*pc += 2;
+			break;
+		case OP_RET:
+			l->sp[lane] = (l->sp[lane] - 1) & (STACK_DEPTH - 1);
+			*pc = l->stack[l->sp[lane] * l->stride + lane] + 2;
+			break;
+		case OP_JP:
+			*pc = ins->nnn;
+			break;
+		case OP_CALL:
+			l->stack[l->sp[lane] * l->stride + lane] = *pc;
+			l->sp[lane] = (l->sp[lane] + 1) & (STACK_DEPTH - 1);
+			*pc = ins->nnn;
+			break;
+		case OP_SE:
+			*pc += *vx == ins->kk ? 4 : 2;
+			break;
+		case OP_SNE:
+			*pc += *vx != ins->kk ? 4 : 2;
+			break;
+		case OP_SEREG:
+			*pc += *vx == *vy ? 4 : 2;
+			break;
+		case OP_LDIM:
+			*vx = ins->kk;
+			*pc += 2;
+			break;
+		case OP_ADDIM:
+			*vx += ins->kk;
+			*pc += 2;
+			break;
+		case OP_LDV:
+			*vx = *vy;
+			*pc += 2;
+			break;
+		case OP_OR:
+			*vx |= *vy;
+			*pc += 2;
+			break;
+		case OP_AND:
+			*vx &= *vy;
+			*pc += 2;
+			break;
+		case OP_XOR:
+			*vx ^= *vy;
+			*pc += 2;
+			break;
+		case OP_ADD:
+			res = *vx + *vy;
+			*vf = res > 0xFF;
+			*vx = res;
+			*pc += 2;
+			break;
+		case OP_SUB:
+			*vf = *vx > *vy;
+			*vx -= *vy;
+			*pc += 2;
+			break;
+		case OP_SHR:
+			*vf = *vx & 1;
+			*vx >>= 1;
+			*pc += 2;
+			break;
+		case OP_SUBN:
+			*vf = *vy > *vx;
+			*vx = *vy - *vx;
+			*pc += 2;
+			break;
+		case OP_SHL:
+			*vf = *vx > 0x80;
+			*vx <<= 1;
+			*pc += 2;
+			break;
+		case OP_SNEREG:
+			*pc += *vx != *vy ? 4 : 2;
+			break;
+		case OP_LDI:
+			l->i[lane] = ins->nnn;
+			*pc += 2;
+			break;
+		case OP_JPREG:
+			*pc = V(l, 0, lane) + ins->nnn;
+			break;
+		case OP_RND:
+			*vx = rng_byte(&l->rng[lane]) & ins->kk;
+			*pc += 2;
+			break;
+		case OP_DRAW:
+			value = draw(l, lane, *vx, *vy, ins->n);
+			*vf = value;
+			*pc += 2;
+			break;
+		case OP_SKEY:
+		case OP_SNKEY:
+			keys = l->keys[lane];
+			*pc += ((keys >> (*vx & 0xF)) & 1) == (ins->op == OP_SKEY) ? 4 : 2;
+			break;
+		case OP_RDELAY:
+			*vx = l->delay_timer[lane];
+			*pc += 2;
+			break;
+		case OP_WAITKEY:
+			// not implemented by the interpreter either, which moves on
+			*pc += 2;
+			break;
+		case OP_WDELAY:
+			l->delay_timer[lane] = *vx;
+			*pc += 2;
+			break;
+		case OP_WSOUND:
+			l->sound_timer[lane] = *vx;
+			*pc += 2;
+			break;
+		case OP_ADDI:
+			l->i[lane] += *vx;
+			*pc += 2;
+			break;
+		case OP_LDSPRITE:
+			l->i[lane] = 0x50 + 5 * *vx;
+			*pc += 2;
+			break;
+		case OP_STBCD:
+			value = *vx;
+			store(l, lane, l->i[lane], value / 100);
+			store(l, lane, l->i[lane] + 1, (value / 10) % 10);
+			store(l, lane, l->i[lane] + 2, value % 10);
+			*pc += 2;
+			break;
+		case OP_STREG:
+			for (r = 0; r <= ins->x; r++) {
+				store(l, lane, l->i[lane] + r, V(l, r, lane));
+			}
+			*pc += 2;
+			break;
+		case OP_LDREG:
+			for (r = 0; r <= ins->x; r++) {
+				V(l, r, lane) = lane_memory(l, lane)[(l->i[lane] + r) & (MEMORY_SIZE - 1)];
+			}
+			*pc += 2;
+			break;
+		case OP_NOP:
+			// spins in place like in the interpreter
+			break;
+		case OP_UNKNOWN:
+		case OP_UNDECODED:
+		case OP_FUSED_SE_JP:
+		case OP_FUSED_SNE_JP:
+		case OP_FUSED_LDIM_DRAW:
+		case OP_FUSED_LDI_ADDI_LDREG:
+		case OP_FUSED_DELAY_POLL:
+		case OP_COUNT:
+		default:
+			l->stats.unknown++;
+			break;
+	}
+}
+
+/* Runs the instruction at the lane's own program counter, decoded from its own memory */
+static void run_lane_own(lockstep_t* l, int lane) {
+	struct instruction ins;
+	const uint8_t* mem;
+	uint16_t pc;
+
+	mem = lane_memory(l, lane);
+	pc = l->pc[lane];
+	instruction_decode(mem[pc & (MEMORY_SIZE - 1)] << 8 | mem[(pc + 1) & (MEMORY_SIZE - 1)], &ins);
+	run_lane(l, lane, &ins);
+}
+
+/* Marks the lanes not done yet that are at pc in mask and done, returns how many there are */
+static int select_group(lockstep_t* l, uint16_t pc) {
+	int count;
+	int j;
+
+	count = 0;
+	for (j = 0; j < l->stride; j++) {
+		l->mask[j] = !l->done[j] && l->pc[j] == pc ? 0xFF : 0;
+		l->done[j] |= l->mask[j];
+		count += l->mask[j] & 1;
+	}
+	return count;
+}
+
+#if defined(LOCKSTEP_SIMD)
+__attribute__((target("avx2")))
+static int select_group_avx2(lockstep_t* l, uint16_t pc) {
+	__m256i target;
+	__m256i eq;
+	__m256i m;
+	int count;
+	int j;
+
+	target = _mm256_set1_epi16(pc);
+	count = 0;
+	for (j = 0; j < l->stride; j += 32) {
+		// packing interleaves the 128 bit halves, the permute puts the lanes back in order
+		eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(_mm256_load_si256((const __m256i*) (l->pc + j)), target),
+				_mm256_cmpeq_epi16(_mm256_load_si256((const __m256i*) (l->pc + j + 16)), target));
+		eq = _mm256_permute4x64_epi64(eq, 0xD8);
+		m = _mm256_andnot_si256(_mm256_load_si256((const __m256i*) (l->done + j)), eq);
+		_mm256_store_si256((__m256i*) (l->mask + j), m);
+		_mm256_store_si256((__m256i*) (l->done + j), _mm256_or_si256(_mm256_load_si256((const __m256i*) (l->done + j)), m));
+		count += __builtin_popcount((unsigned) _mm256_movemask_epi8(m));
+	}
+	return count;
+}
+
+/* Instructions the vector kernels cover, everything else runs lane by lane */
+static bool vector_op(uint8_t op) {
+	switch (op) {
+		case OP_JP:
+		case OP_SE:
+		case OP_SNE:
+		case OP_SEREG:
+		case OP_SNEREG:
+		case OP_LDIM:
+		case OP_ADDIM:
+		case OP_LDV:
+		case OP_OR:
+		case OP_AND:
+		case OP_XOR:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_SHR:
+		case OP_SUBN:
+		case OP_SHL:
+		case OP_LDI:
+		case OP_ADDI:
+		case OP_LDSPRITE:
+		case OP_RDELAY:
+		case OP_WDELAY:
+		case OP_WSOUND:
+			return true;
+		default:
+			return false;
+	}
+}
+
+#define LOAD(p) _mm256_load_si256((const __m256i*) (p))
+#define STORE(p, x) _mm256_store_si256((__m256i*) (p), (x))
+/* Writes x to the lanes in the group only */
+#define STORE_MASKED(p, x, m) STORE((p), _mm256_blendv_epi8(LOAD(p), (x), (m)))
+
+/* Byte kernels, 32 lanes at a time. Every load happens after the stores before it as in run_lane, */
+/* so x or y being F behaves the same. */
+__attribute__((target("avx2")))
+static void run_bytes_avx2(lockstep_t* l, const struct instruction* ins) {
+	uint8_t* vx;
+	uint8_t* vy;
+	uint8_t* vf;
+	__m256i m;
+	__m256i a;
+	__m256i b;
+	__m256i r;
+	__m256i one;
+	int j;
+
+	one = _mm256_set1_epi8(1);
+	for (j = 0; j < l->stride; j += 32) {
+		m = LOAD(l->mask + j);
+		if (_mm256_testz_si256(m, m)) {
+			continue;
+		}
+		vx = l->v + ins->x * l->stride + j;
+		vy = l->v + ins->y * l->stride + j;
+		vf = l->v + 0xF * l->stride + j;
+		switch (ins->op) {
+			case OP_SE:
+				STORE(l->cond + j, _mm256_cmpeq_epi8(LOAD(vx), _mm256_set1_epi8(ins->kk)));
+				break;
+			case OP_SNE:
+				r = _mm256_cmpeq_epi8(LOAD(vx), _mm256_set1_epi8(ins->kk));
+				STORE(l->cond + j, _mm256_xor_si256(r, _mm256_set1_epi8(-1)));
+				break;
+			case OP_SEREG:
+				STORE(l->cond + j, _mm256_cmpeq_epi8(LOAD(vx), LOAD(vy)));
+				break;
+			case OP_SNEREG:
+				r = _mm256_cmpeq_epi8(LOAD(vx), LOAD(vy));
+				STORE(l->cond + j, _mm256_xor_si256(r, _mm256_set1_epi8(-1)));
+				break;
+			case OP_LDIM:
+				STORE_MASKED(vx, _mm256_set1_epi8(ins->kk), m);
+				break;
+			case OP_ADDIM:
+				STORE_MASKED(vx, _mm256_add_epi8(LOAD(vx), _mm256_set1_epi8(ins->kk)), m);
+				break;
+			case OP_LDV:
+				STORE_MASKED(vx, LOAD(vy), m);
+				break;
+			case OP_OR:
+				STORE_MASKED(vx, _mm256_or_si256(LOAD(vx), LOAD(vy)), m);
+				break;
+			case OP_AND:
+				STORE_MASKED(vx, _mm256_and_si256(LOAD(vx), LOAD(vy)), m);
+				break;
+			case OP_XOR:
+				STORE_MASKED(vx, _mm256_xor_si256(LOAD(vx), LOAD(vy)), m);
+				break;
+			case OP_ADD:
+				// the sum wrapped below a when there was a carry
+				a = LOAD(vx);
+				r = _mm256_add_epi8(a, LOAD(vy));
+				b = _mm256_cmpeq_epi8(_mm256_max_epu8(a, r), r);
+				STORE_MASKED(vf, _mm256_andnot_si256(b, one), m);
+				STORE_MASKED(vx, r, m);
+				break;
+			case OP_SUB:
+				a = LOAD(vx);
+				b = LOAD(vy);
+				r = _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), b);
+				STORE_MASKED(vf, _mm256_andnot_si256(r, one), m);
+				STORE_MASKED(vx, _mm256_sub_epi8(LOAD(vx), LOAD(vy)), m);
+				break;
+			case OP_SHR:
+				STORE_MASKED(vf, _mm256_and_si256(LOAD(vx), one), m);
+				r = _mm256_and_si256(_mm256_srli_epi16(LOAD(vx), 1), _mm256_set1_epi8(0x7F));
+				STORE_MASKED(vx, r, m);
+				break;
+			case OP_SUBN:
+				a = LOAD(vx);
+				b = LOAD(vy);
+				r = _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a);
+				STORE_MASKED(vf, _mm256_andnot_si256(r, one), m);
+				STORE_MASKED(vx, _mm256_sub_epi8(LOAD(vy), LOAD(vx)), m);
+				break;
+			case OP_SHL:
+				a = LOAD(vx);
+				r = _mm256_cmpeq_epi8(_mm256_max_epu8(a, _mm256_set1_epi8((char) 0x81)), a);
+				STORE_MASKED(vf, _mm256_and_si256(r, one), m);
+				STORE_MASKED(vx, _mm256_add_epi8(LOAD(vx), LOAD(vx)), m);
+				break;
+			case OP_RDELAY:
+				STORE_MASKED(vx, LOAD(l->delay_timer + j), m);
+				break;
+			case OP_WDELAY:
+				STORE_MASKED(l->delay_timer + j, LOAD(vx), m);
+				break;
+			case OP_WSOUND:
+				STORE_MASKED(l->sound_timer + j, LOAD(vx), m);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/* Index register and program counter kernels, 16 lanes at a time with the byte masks widened */
+__attribute__((target("avx2")))
+static void run_words_avx2(lockstep_t* l, const struct instruction* ins, uint16_t pc) {
+	const uint8_t* vx;
+	__m256i m;
+	__m256i c;
+	__m256i r;
+	__m128i half;
+	int j;
+
+	for (j = 0; j < l->stride; j += 16) {
+		half = _mm_load_si128((const __m128i*) (l->mask + j));
+		if (_mm_testz_si128(half, half)) {
+			continue;
+		}
+		m = _mm256_cvtepi8_epi16(half);
+		vx = l->v + ins->x * l->stride + j;
+		switch (ins->op) {
+			case OP_LDI:
+				STORE_MASKED(l->i + j, _mm256_set1_epi16(ins->nnn), m);
+				break;
+			case OP_ADDI:
+				r = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) vx));
+				STORE_MASKED(l->i + j, _mm256_add_epi16(LOAD(l->i + j), r), m);
+				break;
+			case OP_LDSPRITE:
+				r = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) vx));
+				r = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(5)), _mm256_set1_epi16(0x50));
+				STORE_MASKED(l->i + j, r, m);
+				break;
+			default:
+				break;
+		}
+		switch (ins->op) {
+			case OP_JP:
+				STORE_MASKED(l->pc + j, _mm256_set1_epi16(ins->nnn), m);
+				break;
+			case OP_SE:
+			case OP_SNE:
+			case OP_SEREG:
+			case OP_SNEREG:
+				// skipping lanes move on by 4
+				c = _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*) (l->cond + j)));
+				r = _mm256_add_epi16(_mm256_set1_epi16(pc + 2), _mm256_and_si256(c, _mm256_set1_epi16(2)));
+				STORE_MASKED(l->pc + j, r, m);
+				break;
+			default:
+				STORE_MASKED(l->pc + j, _mm256_set1_epi16(pc + 2), m);
+				break;
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void tick_timers_avx2(lockstep_t* l) {
+	__m256i one;
+	int j;
+
+	one = _mm256_set1_epi8(1);
+	for (j = 0; j < l->stride; j += 32) {
+		STORE(l->delay_timer + j, _mm256_subs_epu8(LOAD(l->delay_timer + j), one));
+		STORE(l->sound_timer + j, _mm256_subs_epu8(LOAD(l->sound_timer + j), one));
+	}
+}
+#endif
+
+static void tick_timers(lockstep_t* l) {
+	int j;
+
+#if defined(LOCKSTEP_SIMD)
+	if (l->simd) {
+		tick_timers_avx2(l);
+		return;
+	}
+#endif
+	for (j = 0; j < l->stride; j++) {
+		l->delay_timer[j] -= l->delay_timer[j] > 0;
+		l->sound_timer[j] -= l->sound_timer[j] > 0;
+	}
+}
+
+/* Runs the group in mask at pc, which every lane in it has the same instruction at */
+static void run_group(lockstep_t* l, uint16_t pc, int count) {
+	const struct instruction* ins;
+	int j;
+
+	l->stats.groups++;
+	// a slot some lane has written to has to be decoded lane by lane
+	if ((pc & 0xF001) || l->slot_diffs[pc >> 1] != 0) {
+		for (j = 0; j < l->stride; j++) {
+			if (l->mask[j]) {
+				run_lane_own(l, j);
+			}
+		}
+		l->stats.scalar_lanes += count;
+		return;
+	}
+	ins = &l->code[pc >> 1];
+#if defined(LOCKSTEP_SIMD)
+	if (l->simd && vector_op(ins->op)) {
+		run_bytes_avx2(l, ins);
+		run_words_avx2(l, ins, pc);
+		l->stats.vector_lanes += count;
+		return;
+	}
+#endif
+	for (j = 0; j < l->stride; j++) {
+		if (l->mask[j]) {
+			run_lane(l, j, ins);
+		}
+	}
+	l->stats.scalar_lanes += count;
+}
+
+/* Every lane runs one instruction. Lanes are gathered by program counter, most of the time they all share */
+/* one and a single group covers them. */
+static void step(lockstep_t* l) {
+	int remaining;
+	int groups;
+	int lane;
+	int count;
+
+	memcpy(l->done, l->idle, l->stride);
+	remaining = l->lanes;
+	groups = 0;
+	for (lane = 0; remaining > 0; lane++) {
+		if (l->done[lane]) {
+			continue;
+		}
+		if (groups == MAX_GROUPS) {
+			l->done[lane] = 0xFF;
+			run_lane_own(l, lane);
+			l->stats.scalar_lanes++;
+			remaining--;
+			continue;
+		}
+#if defined(LOCKSTEP_SIMD)
+		count = l->simd ? select_group_avx2(l, l->pc[lane]) : select_group(l, l->pc[lane]);
+#else
+		count = select_group(l, l->pc[lane]);
+#endif
+		run_group(l, l->pc[lane], count);
+		remaining -= count;
+		groups++;
+	}
+	l->stats.cycles++;
+	if (l->stats.cycles == l->tick_at) {
+		l->tick_at += l->cycles_per_frame;
+		tick_timers(l);
+	}
+}
+
+void lockstep_run_cycles(lockstep_t* l, int cycles) {
+	int c;
+
+	for (c = 0; c < cycles; c++) {
+		step(l);
+	}
+}
+
+void lockstep_run_frames(lockstep_t* l, int frames) {
+	int f;
+
+	for (f = 0; f < frames; f++) {
+		lockstep_run_cycles(l, l->cycles_per_frame);
+	}
+}
+
+void lockstep_get_lane(lockstep_t* l, int lane, struct lockstep_lane* state) {
+	int j;
+
+	for (j = 0; j < 16; j++) {
+		state->v[j] = V(l, j, lane);
+		state->stack[j] = l->stack[j * l->stride + lane];
+	}
+	state->i = l->i[lane];
+	state->pc = l->pc[lane];
+	state->delay_timer = l->delay_timer[lane];
+	state->sound_timer = l->sound_timer[lane];
+	state->sp = l->sp[lane];
+}
+
+uint64_t lockstep_row(lockstep_t* l, int lane, int r) {
+	return l->rows[r * l->stride + lane];
+}
+
+void lockstep_get_stats(lockstep_t* l, struct lockstep_stats* stats) {
+	*stats = l->stats;
+}
+
+bool lockstep_vectorized(lockstep_t* l) {
+	return l->simd;
+}
@@ -0,0 +1,155 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+/* Positions remembered by the compressor, by hash of the 4 bytes there */
+#define HASH_BITS 12
+/* A length nibble of 15 continues in extra bytes */
+#define LENGTH_MASK 15
+
+static uint32_t read32(const uint8_t* p) {
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t hash(uint32_t value) {
+	return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Writes the part of a length that does not fit its nibble */
+static uint8_t* put_length(uint8_t* out, size_t len) {
+	while (len >= 255) {
+		*out++ = 255;
+		len -= 255;
+	}
+	*out++ = len;
+	return out;
+}
+
+static uint8_t* put_literals(uint8_t* out, const uint8_t* literals, size_t len, size_t match) {
+	*out++ = (len < LENGTH_MASK ? len : LENGTH_MASK) << 4 | (match < LENGTH_MASK ? match : LENGTH_MASK);
+	if (len >= LENGTH_MASK) {
+		out = put_length(out, len - LENGTH_MASK);
+	}
+	memcpy(out, literals, len);
+	return out + len;
+}
+
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst) {
+	uint32_t table[1 << HASH_BITS];
+	const uint8_t* end;
+	const uint8_t* ip;
+	const uint8_t* anchor;
+	const uint8_t* ref;
+	const uint8_t* match;
+	uint8_t* out;
+	uint32_t h;
+	size_t offset;
+	size_t match_len;
+
+	memset(table, 0, sizeof(table));
+	end = src + len;
+	ip = src;
+	anchor = src;
+	out = dst;
+	while (end - ip >= MIN_MATCH) {
+		h = hash(read32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+		offset = ip - ref;
+		if (offset == 0 || offset > MAX_OFFSET || read32(ref) != read32(ip)) {
+			ip++;
+			continue;
+		}
+		match = ip + MIN_MATCH;
+		while (match < end && *match == match[-offset]) {
+			match++;
+		}
+		match_len = match - ip - MIN_MATCH;
+		out = put_literals(out, anchor, ip - anchor, match_len);
+		*out++ = offset;
+		*out++ = offset >> 8;
+		if (match_len >= LENGTH_MASK) {
+			out = put_length(out, match_len - LENGTH_MASK);
+		}
+		ip = match;
+		anchor = ip;
+	}
+	// the last sequence is literals only, the decompressor knows it by the input ending after them
+	out = put_literals(out, anchor, end - anchor, 0);
+	return out - dst;
+}
+
+/* Reads the rest of a length that filled its nibble, false if the input ends first */
+static bool get_length(const uint8_t** in, const uint8_t* end, size_t* len) {
+	uint8_t byte;
+
+	do {
+		if (*in == end) {
+			return false;
+		}
+		byte = *(*in)++;
+		*len += byte;
+	} while (byte == 255);
+	return true;
+}
+
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t len) {
+	const uint8_t* in;
+	const uint8_t* in_end;
+	uint8_t* out;
+	uint8_t* out_end;
+	uint8_t token;
+	size_t literals;
+	size_t match_len;
+	size_t offset;
+
+	in = src;
+	in_end = src + size;
+	out = dst;
+	out_end = dst + len;
+	while (in < in_end) {
+		token = *in++;
+		literals = token >> 4;
+		if (literals == LENGTH_MASK && !get_length(&in, in_end, &literals)) {
+			return false;
+		}
+		if (literals > (size_t) (in_end - in) || literals > (size_t) (out_end - out)) {
+			return false;
+		}
+		memcpy(out, in, literals);
+		in += literals;
+		out += literals;
+		if (in == in_end) {
+			break;
+		}
+		if (in_end - in < 2) {
+			return false;
+		}
+		offset = in[0] | in[1] << 8;
+		in += 2;
+		match_len = token & LENGTH_MASK;
+		if (match_len == LENGTH_MASK && !get_length(&in, in_end, &match_len)) {
+			return false;
+		}
+		match_len += MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (out - dst) || match_len > (size_t) (out_end - out)) {
+			return false;
+		}
+		if (offset >= match_len) {
+			memcpy(out, out - offset, match_len);
+			out += match_len;
+			continue;
+		}
+		// byte by byte, the match overlaps the bytes it produces
+		while (match_len--) {
+			*out = out[-offset];
+			out++;
+		}
+	}
+	return out == out_end;
+}
@@ -1,157 +1,404 @@
 #include <stdlib.h>
-#include <pthread.h>
-#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 
 #include <log.h>
 
 #include <cpu.h>
+#include <history.h>
+#include <histogram.h>
+#include <input_log.h>
+#include <metrics.h>
+#include <trace.h>
 #include <sdl_wrapper.h>
 #include <utils.h>
 
 
-void frame_callback(int height, uint8_t* rgb24, sdl_view_t* view, image_t* image, pthread_mutex_t* mu) {
-	pthread_mutex_lock(mu);
-	image_copy_to_rgb24(image, rgb24, 200, 55, 233);
-	sdl_wrapper_set_frame_rgb24(view, rgb24, height);
-	pthread_mutex_unlock(mu);
+// frame signals normally wake the UI well before these
+static const int visible_timeout_ms = 100;
+static const int hidden_timeout_ms = 500;
+// an hour of frames, that many deltas of typical games fit into the memory
+static const int rewind_frames = 60 * 60 * 60;
+static const size_t rewind_bytes = 16 << 20;
+// how often --metrics rewrites its file
+static const int64_t metrics_period_ns = 1000000000;
+
+struct options {
+	int cycles_per_frame; // 0 keeps the CPU default
+	bool turbo;
+	uint64_t seed;
+	bool seeded;          // otherwise every run is seeded from the clock
+	const char* record;   // input log written at exit
+	const char* replay;   // input log played instead of the keyboard
+	const char* metrics;  // file the metrics are written to
+	const char* metrics_socket;
+	const char* trace;    // execution trace of the whole run
+	bool aot;             // load <rom>.so if there is one
+};
+
+static struct image_palette palette;
+// frame uploads, only touched by the render thread
+static uint64_t frames_full;
+static uint64_t frames_partial;
+
+/* Uploads whatever changed in frame since the last upload */
+static void upload_frame(sdl_view_t* view, image_t* frame) {
+	struct image_rect rect;
+	void* pixels;
+	int pitch;
+
+	if (!image_take_dirty(frame, &rect)) {
+		return;
+	}
+	if (sdl_wrapper_lock_frame(view, rect.x, rect.y, rect.w, rect.h, &pixels, &pitch)) {
+		image_convert_rect(frame, &palette, IMAGE_FORMAT_XRGB8888, &rect, pixels, pitch);
+		sdl_wrapper_unlock_frame(view);
+		if (rect.w == sdl_wrapper_get_view_width(view) && rect.h == sdl_wrapper_get_view_height(view)) {
+			frames_full++;
+		} else {
+			frames_partial++;
+		}
+	}
 }
 
-void key_callback(sdl_view_t* view, pthread_mutex_t* mu, uint8_t* keypad) {
-	int i;
-	int events_count;
-	SDL_Event* events;
-	SDL_Event e;
+/* Keypad key for a keyboard key, or -1 if it is not mapped */
+static int keypad_key(SDL_Keycode sym) {
+	switch (sym) {
+		case SDLK_1:
+			return 0;
+		case SDLK_2:
+			return 1;
+		case SDLK_3:
+			return 2;
+		case SDLK_4:
+			return 3;
+		case SDLK_q:
+			return 4;
+		case SDLK_w:
+			return 5;
+		case SDLK_e:
+			return 6;
+		case SDLK_r:
+			return 7;
+		case SDLK_a:
+			return 8;
+		case SDLK_s:
+			return 9;
+		case SDLK_d:
+			return 10;
+		case SDLK_f:
+			return 11;
+		case SDLK_z:
+			return 12;
+		case SDLK_x:
+			return 13;
+		case SDLK_c:
+			return 14;
+		case SDLK_v:
+			return 15;
+		default:
+			return -1;
+	}
+}
+
+static void handle_key(cpu_instance_t* inst, const struct options* opts, const SDL_KeyboardEvent* e) {
 	int key;
 
-	pthread_mutex_lock(mu);
-	events_count = sdl_wrapper_get_events_count(view);
-	events = sdl_wrapper_get_events(view);
-	for (i = 0; i < events_count; i++) {
-		e = events[i];
-		if (e.type == SDL_KEYDOWN) {
-			switch (e.key.keysym.sym) {
-				case SDLK_1:
-					key = 0;
-					break;
-				case SDLK_2:
-					key = 1;
-					break;
-				case SDLK_3:
-					key = 2;
-					break;
-				case SDLK_4:
-					key = 3;
-					break;
-				case SDLK_q:
-					key = 4;
-					break;
-				case SDLK_w:
-					key = 5;
-					break;
-				case SDLK_e:
-					key = 6;
-					break;
-				case SDLK_r:
-					key = 7;
-					break;
-				case SDLK_a:
-					key = 8;
-					break;
-				case SDLK_s:
-					key = 9;
-					break;
-				case SDLK_d:
-					key = 10;
-					break;
-				case SDLK_f:
-					key = 11;
-					break;
-				case SDLK_z:
-					key = 12;
-					break;
-				case SDLK_x:
-					key = 13;
-					break;
-				case SDLK_c:
-					key = 14;
-					break;
-				case SDLK_v:
-					key = 15;
-					break;
-				default:
-					log_info("Not keypad key pressed");
-					continue;
-			}
-			keypad[key] = 1;
-		}
+	if (e->repeat) {
+		return;
+	}
+	// holding tab fast forwards, unless the whole run is in turbo mode anyway
+	if (e->keysym.sym == SDLK_TAB) {
+		cpu_set_turbo(inst, opts->turbo || e->type == SDL_KEYDOWN);
+		return;
+	}
+	// holding backspace plays the recorded history backwards
+	if (e->keysym.sym == SDLK_BACKSPACE) {
+		cpu_set_rewinding(inst, e->type == SDL_KEYDOWN);
+		return;
+	}
+	key = keypad_key(e->keysym.sym);
+	if (key < 0) {
+		log_info("Not keypad key pressed");
+		return;
+	}
+	cpu_key_event(inst, key, e->type == SDL_KEYDOWN);
+}
+
+static void signal_frame(void* view) {
+	sdl_wrapper_signal_frame(view);
+}
+
+static int64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Shows the achieved emulated clock, the rate is only remeasured about once a second */
+static void update_title(sdl_view_t* view, cpu_instance_t* inst) {
+	char title[64];
+	uint64_t rate;
+
+	rate = cpu_get_cycle_rate(inst);
+	if (rate == 0) {
+		return;
 	}
-	pthread_mutex_unlock(mu);
+	snprintf(title, sizeof(title), "CHIP-8 - %.3f MHz%s%s", rate / 1e6, cpu_get_turbo(inst) ? " (turbo)" : "",
+			cpu_get_rewinding(inst) ? " (rewind)" : "");
+	sdl_wrapper_set_title(view, title);
 }
 
-void run(cpu_instance_t* inst, char* rom) {
+void run(cpu_instance_t* inst, char* rom, const struct options* opts) {
 	bool quit;
+	bool redraw;
+	bool has_event;
 	sdl_view_t* view = NULL;
-	uint8_t* rgb24 = NULL;
-	SDL_Event* new_events;
+	SDL_Event e;
 	int width, height;
-	int events_count;
-	int i;
 	int window_scale = 8;
-	pthread_mutex_t cpu_mu;
 	enum CpuResult cpu_res;
-	pthread_mutex_t event_mu;
+	image_t* frame;
+	history_t* history;
+	input_log_t* input_log;
+	histogram_t* present;
+	metrics_t* metrics;
+	trace_t* trace;
+	struct trace_stats trace_stats;
+	int64_t metrics_due;
+	int64_t present_start;
+	struct cpu_frame_stats stats;
+	struct history_stats history_stats;
 
-	width = 64;
-	height = 32;
-	rgb24 = calloc(width * height * 3, sizeof(uint8_t));
+	width = CPU_SCREEN_WIDTH;
+	height = CPU_SCREEN_HEIGHT;
+	image_palette_init(&palette, 0x000000, 0xC837E9);
 	view = sdl_wrapper_create_view("CHIP-8", width, height, window_scale);
-	if (pthread_mutex_init(&cpu_mu, NULL) != 0) {
-		log_error("Mutex init failed");
-		exit(1);
-	}
-	if (pthread_mutex_init(&event_mu, NULL) != 0) {
-		log_error("Mutex init failed");
+	// the renderer's copy of the screen, only the CPU thread touches the CPU's own image
+	frame = image_create(height, width);
+	if (!frame) {
+		log_error("Unable to create frame");
 		exit(1);
 	}
-	cpu_res = cpu_init(inst, rom, frame_callback, rgb24, view, &cpu_mu, key_callback);
+	cpu_set_translation(inst, opts->aot);
+	cpu_res = cpu_init(inst, rom);
 	if (cpu_res != OK) {
 		log_error("Error initializing CPU instance");
 		exit(1);
 	}
+	cpu_set_frame_notify(inst, signal_frame, view);
+	history = history_create(rewind_bytes, rewind_frames);
+	if (!history) {
+		log_error("Unable to create rewind history");
+		exit(1);
+	}
+	cpu_set_history(inst, history);
+	if (opts->cycles_per_frame > 0 && cpu_set_cycles_per_frame(inst, opts->cycles_per_frame) != OK) {
+		exit(1);
+	}
+	cpu_set_seed(inst, opts->seeded ? opts->seed : (uint64_t) time(NULL));
+	// recording takes the seed and instructions per frame just set, replaying brings its own
+	input_log = NULL;
+	if (opts->record) {
+		input_log = input_log_create();
+		if (!input_log || cpu_set_input_log(inst, input_log, CPU_INPUT_RECORD) != OK) {
+			log_error("Unable to record input");
+			exit(1);
+		}
+	} else if (opts->replay) {
+		input_log = input_log_load(opts->replay);
+		if (!input_log || cpu_set_input_log(inst, input_log, CPU_INPUT_REPLAY) != OK) {
+			exit(1);
+		}
+	}
+	present = histogram_create();
+	if (!present) {
+		log_error("Unable to create present histogram");
+		exit(1);
+	}
+	metrics = NULL;
+	if (opts->metrics || opts->metrics_socket) {
+		metrics = metrics_create();
+		if (!metrics || metrics_add_cpu(metrics, inst, NULL) != OK || metrics_add_histogram(metrics,
+				"chip8_present_seconds", "Time spent presenting a frame", NULL, present) != OK) {
+			log_error("Unable to export metrics");
+			exit(1);
+		}
+		if (opts->metrics_socket && metrics_serve(metrics, opts->metrics_socket) != OK) {
+			exit(1);
+		}
+	}
+	trace = NULL;
+	if (opts->trace) {
+		trace = trace_create(opts->trace, true);
+		if (!trace) {
+			exit(1);
+		}
+		cpu_set_trace(inst, trace);
+	}
+	metrics_due = now_ns() + metrics_period_ns;
+	cpu_set_turbo(inst, opts->turbo);
 	cpu_res = cpu_start(inst);
 	if (cpu_res != OK) {
 		exit(1);
 	}
 	quit = false;
+	redraw = true;
 	while (!quit) {
-		int tmp = 0;
-		sdl_wrapper_update(view, &tmp);
-		events_count = sdl_wrapper_get_events_count(view);
-		new_events = sdl_wrapper_get_events(view);
-		for (i = 0; i < events_count; i++) {
-			if (new_events[i].type == SDL_QUIT) {
-				quit = true;
-				continue;
+		// sleeps until input, a window change or a frame signal from the CPU thread
+		has_event = sdl_wrapper_wait_event(view, &e, sdl_wrapper_is_visible(view) ? visible_timeout_ms : hidden_timeout_ms);
+		while (has_event) {
+			switch (e.type) {
+				case SDL_QUIT:
+					quit = true;
+					break;
+				case SDL_KEYDOWN:
+				case SDL_KEYUP:
+					handle_key(inst, opts, &e.key);
+					break;
+				case SDL_WINDOWEVENT:
+					redraw = true;
+					break;
+				default:
+					break;
 			}
+			has_event = sdl_wrapper_poll_event(view, &e);
+		}
+		if (opts->metrics && now_ns() >= metrics_due) {
+			metrics_write_file(metrics, opts->metrics);
+			metrics_due = now_ns() + metrics_period_ns;
 		}
-		{
-			pthread_mutex_lock(&event_mu);
-			sdl_wrapper_set_events(view, new_events, events_count);
-			pthread_mutex_unlock(&event_mu);
+		if (!sdl_wrapper_is_visible(view)) {
+			continue;
+		}
+		update_title(view, inst);
+		if (cpu_take_frame(inst, frame)) {
+			upload_frame(view, frame);
+			redraw = true;
+		}
+		if (redraw) {
+			present_start = now_ns();
+			sdl_wrapper_update(view);
+			histogram_record(present, now_ns() - present_start);
+			redraw = false;
 		}
-		usleep(10);
 	}
 	cpu_stop(inst);
+	if (trace) {
+		cpu_set_trace(inst, NULL);
+		if (trace_close(trace, &trace_stats) == OK) {
+			log_info("Traced %llu instructions to %s, %llu dropped", (unsigned long long) trace_stats.steps, opts->trace,
+					(unsigned long long) trace_stats.dropped_steps);
+		}
+	}
+	if (metrics) {
+		if (opts->metrics) {
+			metrics_write_file(metrics, opts->metrics);
+		}
+		metrics_destroy(metrics);
+	}
+	histogram_destroy(present);
+	cpu_get_frame_stats(inst, &stats);
+	log_info("Frames: %llu published, %llu presented, %llu unchanged", (unsigned long long) stats.published,
+			(unsigned long long) stats.presented, (unsigned long long) stats.unchanged);
+	log_info("Frame uploads: %llu full, %llu partial", (unsigned long long) frames_full,
+			(unsigned long long) frames_partial);
+	history_get_stats(history, &history_stats);
+	log_info("Rewind history: %llu frames in %llu of %llu bytes, %llu bytes per delta",
+			(unsigned long long) history_stats.frames, (unsigned long long) history_stats.used_bytes,
+			(unsigned long long) history_stats.memory_bytes, (unsigned long long) history_stats.average_delta_bytes);
+	cpu_set_history(inst, NULL);
+	history_destroy(history);
+	if (input_log) {
+		cpu_set_input_log(inst, NULL, CPU_INPUT_LIVE);
+		if (opts->record && input_log_save(input_log, opts->record) == OK) {
+			log_info("Recorded %llu frames of input to %s", (unsigned long long) input_log_frames(input_log), opts->record);
+		}
+		input_log_destroy(input_log);
+	}
+	image_destroy(frame);
 	sdl_wrapper_destroy_view(view);
-	free(rgb24);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options] <path to executable>\n", name);
+	fprintf(stderr, "  --ipf N   run N instructions per 60 Hz frame, 9 by default\n");
+	fprintf(stderr, "  --turbo   run as fast as possible, holding tab does the same while it is held\n");
+	fprintf(stderr, "  --seed N  seed RND with N instead of the clock\n");
+	fprintf(stderr, "  --record F  write the keys of every frame to F at exit\n");
+	fprintf(stderr, "  --replay F  play the keys recorded in F, with the seed and --ipf they were recorded with\n");
+	fprintf(stderr, "  --metrics F  write frame timing histograms to F in the Prometheus text format every second\n");
+	fprintf(stderr, "  --metrics-socket P  serve them to whoever connects to the Unix socket P\n");
+	fprintf(stderr, "  --aot     load <rom>.so made by rom2c if there is one, it runs as trusted code\n");
+	fprintf(stderr, "  --trace F  record every instruction into F, list it with chip8trace\n");
+	fprintf(stderr, "holding backspace rewinds, up to an hour back\n");
+}
+
+/* Returns the index of the ROM argument, or 0 if the arguments are invalid */
+static int parse_args(int argc, char** argv, struct options* opts) {
+	int i;
+	long cycles;
+	char* end;
+
+	opts->cycles_per_frame = 0;
+	opts->turbo = false;
+	opts->seed = 0;
+	opts->seeded = false;
+	opts->record = NULL;
+	opts->replay = NULL;
+	opts->metrics = NULL;
+	opts->metrics_socket = NULL;
+	opts->trace = NULL;
+	opts->aot = false;
+	// options come first, the ROM is the last argument
+	for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+		if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+			cycles = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || cycles < 1 || cycles > INT_MAX) {
+				fprintf(stderr, "Invalid instructions per frame %s\n", argv[i]);
+				return 0;
+			}
+			opts->cycles_per_frame = cycles;
+		} else if (strcmp(argv[i], "--turbo") == 0) {
+			opts->turbo = true;
+		} else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			opts->seed = strtoull(argv[++i], &end, 0);
+			if (*end != '\0' || argv[i][0] == '-') {
+				fprintf(stderr, "Invalid seed %s\n", argv[i]);
+				return 0;
+			}
+			opts->seeded = true;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			opts->record = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			opts->replay = argv[++i];
+		} else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+			opts->metrics = argv[++i];
+		} else if (strcmp(argv[i], "--metrics-socket") == 0 && i + 1 < argc) {
+			opts->metrics_socket = argv[++i];
+		} else if (strcmp(argv[i], "--aot") == 0) {
+			opts->aot = true;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			opts->trace = argv[++i];
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 0;
+		}
+	}
+	return argc - i == 1 ? i : 0;
 }
 
 int main(int argc, char** argv) {
 	cpu_instance_t* cpu_instance;
 	enum CpuResult res;
+	struct options opts;
+	int rom;
 
-	if (argc < 2) {
-		fprintf(stderr, "usage: %s <path to executable>\n", argv[0]);
+	rom = parse_args(argc, argv, &opts);
+	if (rom == 0) {
+		usage(argv[0]);
 		return 1;
 	}
 
@@ -166,7 +413,8 @@ int main(int argc, char** argv) {
 		exit(1);
 	}
 
-	run(cpu_instance, argv[1]);
+	run(cpu_instance, argv[rom], &opts);
+	cpu_destroy_instance(cpu_instance);
 
 	return EXIT_SUCCESS;
 }
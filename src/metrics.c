@@ -0,0 +1,397 @@
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <log.h>
+
+#define NAME_SIZE 64
+#define HELP_SIZE 128
+#define LABELS_SIZE 128
+#define LISTEN_BACKLOG 8
+/* How long the server waits for a connection before it checks whether to stop */
+#define POLL_INTERVAL_MS 100
+
+struct series {
+	char name[NAME_SIZE];
+	char help[HELP_SIZE];
+	char labels[LABELS_SIZE];
+	histogram_t* histogram;
+	uint64_t max;          // largest value in the snapshot written last, so the gauge agrees with the histogram
+};
+
+struct metrics {
+	struct series* series;
+	size_t count;
+	size_t capacity;
+	histogram_t* snapshot; // what is written is copied here first, so buckets, sum and count agree
+	pthread_mutex_t snapshot_lock;
+	int fd;
+	char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+	pthread_t thread;
+	_Atomic(bool) serving;
+};
+
+/* Bucket bounds in nanoseconds, from a microsecond to ten seconds in 1-2-5 steps */
+static const uint64_t bounds_ns[] = {
+	1000, 2000, 5000,
+	10000, 20000, 50000,
+	100000, 200000, 500000,
+	1000000, 2000000, 5000000,
+	10000000, 20000000, 50000000,
+	100000000, 200000000, 500000000,
+	1000000000, 2000000000, 5000000000, 10000000000
+};
+
+static const double seconds_per_ns = 1e-9;
+
+metrics_t* metrics_create(void) {
+	metrics_t* metrics;
+
+	metrics = calloc(1, sizeof(struct metrics));
+	if (!metrics) {
+		log_error("Unable to allocate metrics");
+		return NULL;
+	}
+	metrics->snapshot = histogram_create();
+	if (!metrics->snapshot) {
+		log_error("Unable to allocate metrics");
+		free(metrics);
+		return NULL;
+	}
+	pthread_mutex_init(&metrics->snapshot_lock, NULL);
+	metrics->fd = -1;
+	return metrics;
+}
+
+void metrics_destroy(metrics_t* metrics) {
+	if (atomic_load(&metrics->serving)) {
+		atomic_store(&metrics->serving, false);
+		pthread_join(metrics->thread, NULL);
+		close(metrics->fd);
+		unlink(metrics->path);
+	}
+	pthread_mutex_destroy(&metrics->snapshot_lock);
+	histogram_destroy(metrics->snapshot);
+	free(metrics->series);
+	free(metrics);
+}
+
+enum CpuResult metrics_add_histogram(metrics_t* metrics, const char* name, const char* help, const char* labels,
+		histogram_t* histogram) {
+	struct series* series;
+	size_t capacity;
+
+	if (atomic_load(&metrics->serving)) {
+		log_error("Metrics are added while they are served");
+		return UNSUPPORTED;
+	}
+	labels = labels ? labels : "";
+	if (strlen(name) >= NAME_SIZE || strlen(help) >= HELP_SIZE || strlen(labels) >= LABELS_SIZE) {
+		log_error("Metric %s is too long", name);
+		return UNSUPPORTED;
+	}
+	if (metrics->count == metrics->capacity) {
+		capacity = metrics->capacity ? metrics->capacity * 2 : 8;
+		series = realloc(metrics->series, capacity * sizeof(struct series));
+		if (!series) {
+			log_error("Unable to allocate metrics");
+			return MEMORY_ERROR;
+		}
+		metrics->series = series;
+		metrics->capacity = capacity;
+	}
+	series = &metrics->series[metrics->count++];
+	strcpy(series->name, name);
+	strcpy(series->help, help);
+	strcpy(series->labels, labels);
+	series->histogram = histogram;
+	series->max = 0;
+	return OK;
+}
+
+enum CpuResult metrics_add_cpu(metrics_t* metrics, cpu_instance_t* instance, const char* labels) {
+	static const struct {
+		enum CpuTiming timing;
+		const char* name;
+		const char* help;
+	} timings[] = {
+		{ CPU_TIMING_BATCH, "chip8_frame_batch_seconds", "Time spent running the instructions of a frame" },
+		{ CPU_TIMING_CALLBACK, "chip8_frame_callback_seconds", "Time spent handing a changed frame to the renderer" },
+		{ CPU_TIMING_OVERSLEEP, "chip8_frame_oversleep_seconds", "Time woken up past a frame deadline" },
+		{ CPU_TIMING_INTERVAL, "chip8_frame_interval_seconds", "Time from the start of a frame to the next" },
+	};
+	enum CpuResult res;
+	size_t i;
+
+	for (i = 0; i < sizeof(timings) / sizeof(timings[0]); i++) {
+		res = metrics_add_histogram(metrics, timings[i].name, timings[i].help, labels,
+				cpu_get_timing(instance, timings[i].timing));
+		if (res != OK) {
+			return res;
+		}
+	}
+	return OK;
+}
+
+/* Writes the label set of a sample, with le added if it is not NULL */
+static void write_labels(FILE* f, const char* labels, const char* le) {
+	if (!*labels && !le) {
+		return;
+	}
+	fputc('{', f);
+	fputs(labels, f);
+	if (le) {
+		fprintf(f, "%sle=\"%s\"", *labels ? "," : "", le);
+	}
+	fputc('}', f);
+}
+
+static void write_series(metrics_t* metrics, FILE* f, struct series* series) {
+	char le[32];
+	size_t i;
+	uint64_t count;
+
+	histogram_copy(metrics->snapshot, series->histogram);
+	for (i = 0; i < sizeof(bounds_ns) / sizeof(bounds_ns[0]); i++) {
+		snprintf(le, sizeof(le), "%g", bounds_ns[i] * seconds_per_ns);
+		fprintf(f, "%s_bucket", series->name);
+		write_labels(f, series->labels, le);
+		fprintf(f, " %llu\n", (unsigned long long) histogram_count_at_most(metrics->snapshot, bounds_ns[i]));
+	}
+	count = histogram_count(metrics->snapshot);
+	fprintf(f, "%s_bucket", series->name);
+	write_labels(f, series->labels, "+Inf");
+	fprintf(f, " %llu\n", (unsigned long long) count);
+	fprintf(f, "%s_sum", series->name);
+	write_labels(f, series->labels, NULL);
+	fprintf(f, " %.9f\n", histogram_sum(metrics->snapshot) * seconds_per_ns);
+	series->max = histogram_max(metrics->snapshot);
+	fprintf(f, "%s_count", series->name);
+	write_labels(f, series->labels, NULL);
+	fprintf(f, " %llu\n", (unsigned long long) count);
+}
+
+static bool written_before(metrics_t* metrics, size_t i) {
+	size_t j;
+
+	for (j = 0; j < i; j++) {
+		if (!strcmp(metrics->series[j].name, metrics->series[i].name)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+enum CpuResult metrics_write(metrics_t* metrics, FILE* f) {
+	size_t i;
+	size_t j;
+	struct series* series;
+
+	pthread_mutex_lock(&metrics->snapshot_lock);
+	// every family is written in one piece, the histogram first and then a gauge of its largest value
+	for (i = 0; i < metrics->count; i++) {
+		series = &metrics->series[i];
+		if (written_before(metrics, i)) {
+			continue;
+		}
+		fprintf(f, "# HELP %s %s\n", series->name, series->help);
+		fprintf(f, "# TYPE %s histogram\n", series->name);
+		for (j = i; j < metrics->count; j++) {
+			if (!strcmp(metrics->series[j].name, series->name)) {
+				write_series(metrics, f, &metrics->series[j]);
+			}
+		}
+		fprintf(f, "# HELP %s_max Largest of %s\n", series->name, series->name);
+		fprintf(f, "# TYPE %s_max gauge\n", series->name);
+		for (j = i; j < metrics->count; j++) {
+			if (!strcmp(metrics->series[j].name, series->name)) {
+				fprintf(f, "%s_max", series->name);
+				write_labels(f, metrics->series[j].labels, NULL);
+				fprintf(f, " %.9f\n", metrics->series[j].max * seconds_per_ns);
+			}
+		}
+	}
+	pthread_mutex_unlock(&metrics->snapshot_lock);
+	if (ferror(f)) {
+		log_error("Unable to write metrics");
+		return IO_ERROR;
+	}
+	return OK;
+}
+
+enum CpuResult metrics_write_file(metrics_t* metrics, const char* path) {
+	char tmp[4096];
+	enum CpuResult res;
+	FILE* f;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		log_error("Metrics path %s is too long", path);
+		return IO_ERROR;
+	}
+	f = fopen(tmp, "w");
+	if (!f) {
+		log_error("Unable to open %s", tmp);
+		return IO_ERROR;
+	}
+	res = metrics_write(metrics, f);
+	if (fclose(f) != 0 && res == OK) {
+		log_error("Unable to write %s", tmp);
+		res = IO_ERROR;
+	}
+	if (res != OK) {
+		remove(tmp);
+		return res;
+	}
+	if (rename(tmp, path) != 0) {
+		log_error("Unable to replace %s", path);
+		remove(tmp);
+		return IO_ERROR;
+	}
+	return OK;
+}
+
+static void send_all(int fd, const char* data, size_t size) {
+	ssize_t sent;
+	int flags;
+
+	flags = 0;
+#ifdef MSG_NOSIGNAL
+	// a client that hangs up early must not take the emulator down with SIGPIPE
+	flags = MSG_NOSIGNAL;
+#endif
+	while (size > 0) {
+		sent = send(fd, data, size, flags);
+		if (sent <= 0) {
+			return;
+		}
+		data += sent;
+		size -= sent;
+	}
+}
+
+static void serve_client(metrics_t* metrics, int client) {
+	char* text;
+	size_t size;
+	FILE* f;
+
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	text = NULL;
+	size = 0;
+	f = open_memstream(&text, &size);
+	if (!f) {
+		log_error("Unable to allocate metrics");
+		return;
+	}
+	metrics_write(metrics, f);
+	fclose(f);
+	send_all(client, text, size);
+	free(text);
+}
+
+static void* serve(void* arg) {
+	metrics_t* metrics;
+	struct pollfd listener;
+	int client;
+
+	metrics = arg;
+	listener.fd = metrics->fd;
+	listener.events = POLLIN;
+	while (atomic_load(&metrics->serving)) {
+		if (poll(&listener, 1, POLL_INTERVAL_MS) <= 0) {
+			continue;
+		}
+		client = accept(metrics->fd, NULL, NULL);
+		if (client < 0) {
+			continue;
+		}
+		serve_client(metrics, client);
+		close(client);
+	}
+	return NULL;
+}
+
+/* Whether nothing listens on the socket at addr any more, so that it is safe to remove */
+static bool socket_is_stale(const struct sockaddr* addr, socklen_t len) {
+	int fd;
+	bool stale;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return false;
+	}
+	stale = connect(fd, addr, len) != 0 && errno == ECONNREFUSED;
+	close(fd);
+	return stale;
+}
+
+enum CpuResult metrics_serve(metrics_t* metrics, const char* path) {
+	// bind takes the generic address, the union keeps that cast within the aliasing rules
+	union {
+		struct sockaddr any;
+		struct sockaddr_un un;
+	} addr;
+	struct stat st;
+	bool exists;
+
+	if (atomic_load(&metrics->serving)) {
+		log_error("Metrics are already served on %s", metrics->path);
+		return UNSUPPORTED;
+	}
+	if (strlen(path) >= sizeof(addr.un.sun_path)) {
+		log_error("Socket path %s is too long", path);
+		return IO_ERROR;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.un.sun_family = AF_UNIX;
+	strcpy(addr.un.sun_path, path);
+	// only a socket left behind by a run that did not stop cleanly is replaced, never a file given by mistake
+	// or the socket of another instance that is still serving
+	exists = lstat(path, &st) == 0;
+	if (exists && !S_ISSOCK(st.st_mode)) {
+		log_error("%s exists and is not a socket", path);
+		return IO_ERROR;
+	}
+	if (exists && !socket_is_stale(&addr.any, sizeof(addr.un))) {
+		log_error("%s is in use", path);
+		return IO_ERROR;
+	}
+	strcpy(metrics->path, path);
+	metrics->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (metrics->fd < 0) {
+		log_error("Unable to create a socket");
+		return IO_ERROR;
+	}
+	// a stale socket would make bind fail
+	if (exists) {
+		unlink(path);
+	}
+	if (bind(metrics->fd, &addr.any, sizeof(addr.un)) != 0 || listen(metrics->fd, LISTEN_BACKLOG) != 0) {
+		log_error("Unable to listen on %s", path);
+		close(metrics->fd);
+		metrics->fd = -1;
+		return IO_ERROR;
+	}
+	atomic_store(&metrics->serving, true);
+	if (pthread_create(&metrics->thread, NULL, serve, metrics) != 0) {
+		log_error("Unable to start the metrics thread");
+		atomic_store(&metrics->serving, false);
+		close(metrics->fd);
+		metrics->fd = -1;
+		unlink(path);
+		return THREAD_ERROR;
+	}
+	return OK;
+}
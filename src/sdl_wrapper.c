@@ -1,6 +1,8 @@
 #include "sdl_wrapper.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
 
 #include <SDL2/SDL.h>
 #include <log.h>
@@ -9,15 +11,15 @@ struct sdl_view {
 	SDL_Window* window;
 	SDL_Renderer* renderer;
 	SDL_Texture* window_texture;
-	SDL_Event* events;
-	size_t events_count;
-	char* title;
+	char title[256];
 	pthread_mutex_t mu;
 	int width;
 	int height;
+	Uint32 frame_event; // user event type posted by sdl_wrapper_signal_frame
+	_Atomic(bool) frame_pending; // a frame event is queued and not handled yet
+	_Atomic(bool) visible;
 };
 
-#define EVENTS_COUNT 10000
 sdl_view_t* sdl_wrapper_create_view(char* title, int width, int height, int window_scale) {
 	sdl_view_t* view;
 
@@ -27,7 +29,7 @@ sdl_view_t* sdl_wrapper_create_view(char* title, int width, int height, int wind
 		exit(1);
 	}
 
-	view->title = title;
+	snprintf(view->title, sizeof(view->title), "%s", title);
 	view->window = SDL_CreateWindow(
 		title,
 		SDL_WINDOWPOS_UNDEFINED,
@@ -47,17 +49,23 @@ sdl_view_t* sdl_wrapper_create_view(char* title, int width, int height, int wind
 	}
 	SDL_SetRenderDrawColor(view->renderer, 0xFF, 0xFF, 0xFF, 0xFF);
 
-	view->window_texture = SDL_CreateTexture(view->renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, width, height);
+	view->window_texture = SDL_CreateTexture(view->renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, width, height);
 	if (!view->window_texture) {
 		log_error("%s", SDL_GetError());
 		exit(1);
 	}
 
-	view->events = malloc(sizeof(SDL_Event) * EVENTS_COUNT);
+	view->frame_event = SDL_RegisterEvents(1);
+	if (view->frame_event == (Uint32) -1) {
+		log_error("Unable to register frame event");
+		exit(1);
+	}
+	atomic_init(&view->frame_pending, false);
+	atomic_init(&view->visible, !(SDL_GetWindowFlags(view->window) & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED)));
+
 	pthread_mutex_init(&view->mu, NULL);
 	view->width = width;
 	view->height = height;
-	view->events_count = 0;
 
 	return view;
 }
@@ -69,82 +77,107 @@ void sdl_wrapper_destroy_view(sdl_view_t* view) {
 	SDL_Quit();
 }
 
-SDL_Event* sdl_wrapper_update(sdl_view_t* view, int* events_count) {
+void sdl_wrapper_update(sdl_view_t* view) {
 	pthread_mutex_lock(&view->mu);
-	size_t i;
-	SDL_Event e;
-
 	if (!view->window_texture) {
 		log_error("Need to set the frame before calling update.");
 		exit(1);
 	}
-	i = 0;
-	while (SDL_PollEvent(&e)) {
-		view->events[i++] = e;
-	}
-
-	if (i != 0) {
-		view->events_count = i - 1;
-	}
-
 	SDL_RenderCopy(view->renderer, view->window_texture, NULL, NULL);
 	SDL_RenderPresent(view->renderer);
-
-	char title[255];
-	sprintf(title, "%s", view->title);
-	SDL_SetWindowTitle(view->window, title);
-
-	*events_count = view->events_count;
 	pthread_mutex_unlock(&view->mu);
-	return view->events;
 }
 
-void sdl_wrapper_set_frame_rgb24(sdl_view_t* view, uint8_t* rgb24, int height) {
-	pthread_mutex_lock(&view->mu);
-	void* pixel_data;
-	int pitch;
+void sdl_wrapper_set_title(sdl_view_t* view, const char* title) {
+	if (strncmp(view->title, title, sizeof(view->title) - 1) == 0) {
+		return;
+	}
+	snprintf(view->title, sizeof(view->title), "%s", title);
+	SDL_SetWindowTitle(view->window, view->title);
+}
 
-	SDL_LockTexture(view->window_texture, NULL, &pixel_data, &pitch);
-	memcpy(pixel_data, rgb24, pitch * height);
-	SDL_UnlockTexture(view->window_texture);
-	pthread_mutex_unlock(&view->mu);
+/* Keeps track of what the wrapper itself needs to know about an event */
+static void note_event(sdl_view_t* view, const SDL_Event* event) {
+	if (event->type == view->frame_event) {
+		atomic_store(&view->frame_pending, false);
+		return;
+	}
+	if (event->type != SDL_WINDOWEVENT) {
+		return;
+	}
+	switch (event->window.event) {
+		case SDL_WINDOWEVENT_HIDDEN:
+		case SDL_WINDOWEVENT_MINIMIZED:
+			atomic_store(&view->visible, false);
+			break;
+		case SDL_WINDOWEVENT_SHOWN:
+		case SDL_WINDOWEVENT_RESTORED:
+		case SDL_WINDOWEVENT_MAXIMIZED:
+		case SDL_WINDOWEVENT_EXPOSED:
+			atomic_store(&view->visible, true);
+			break;
+		default:
+			break;
+	}
 }
 
-int sdl_wrapper_get_view_height(sdl_view_t* view) {
-	return view->height;
+bool sdl_wrapper_poll_event(sdl_view_t* view, SDL_Event* event) {
+	if (!SDL_PollEvent(event)) {
+		return false;
+	}
+	note_event(view, event);
+	return true;
 }
 
-// TODO: probably need mutex on read value or make atomic
-SDL_Event* sdl_wrapper_get_events(sdl_view_t* view) {
-	return view->events;
+bool sdl_wrapper_wait_event(sdl_view_t* view, SDL_Event* event, int timeout_ms) {
+	if (!SDL_WaitEventTimeout(event, timeout_ms)) {
+		return false;
+	}
+	note_event(view, event);
+	return true;
 }
 
-size_t sdl_wrapper_get_events_count(sdl_view_t* view) {
-	int events_count;
+void sdl_wrapper_signal_frame(sdl_view_t* view) {
+	SDL_Event event;
 
-	events_count = view->events_count;
-	view->events_count = 0;
-	return events_count;
+	// one queued signal is enough to wake the UI thread, and nobody needs waking while the window is hidden
+	if (!atomic_load(&view->visible) || atomic_exchange(&view->frame_pending, true)) {
+		return;
+	}
+	memset(&event, 0, sizeof(event));
+	event.type = view->frame_event;
+	if (SDL_PushEvent(&event) < 0) {
+		atomic_store(&view->frame_pending, false);
+	}
 }
 
-void sdl_wrapper_set_events(sdl_view_t* view, SDL_Event* events, int events_count) {
-	int i, j;
-	int end;
-
-	if (events_count != 0) {
-		if (events_count + view->events_count < EVENTS_COUNT) {
-			i = view->events_count;
-			end = events_count + view->events_count;
-		} else {
-			i = 0;
-			end = events_count;
-		}
-
-		for (j = 0; i < end; i++, j++) {
-			view->events[i] = events[j];
-		}
-		view->events_count = end;
+bool sdl_wrapper_is_visible(sdl_view_t* view) {
+	return atomic_load(&view->visible);
+}
+
+bool sdl_wrapper_lock_frame(sdl_view_t* view, int x, int y, int w, int h, void** pixels, int* pitch) {
+	SDL_Rect rect;
+
+	rect.x = x;
+	rect.y = y;
+	rect.w = w;
+	rect.h = h;
+	pthread_mutex_lock(&view->mu);
+	if (SDL_LockTexture(view->window_texture, &rect, pixels, pitch) < 0) {
+		log_error("%s", SDL_GetError());
+		pthread_mutex_unlock(&view->mu);
+		return false;
 	}
+	return true;
+}
+
+void sdl_wrapper_unlock_frame(sdl_view_t* view) {
+	SDL_UnlockTexture(view->window_texture);
+	pthread_mutex_unlock(&view->mu);
+}
+
+int sdl_wrapper_get_view_height(sdl_view_t* view) {
+	return view->height;
 }
 
 int sdl_wrapper_get_view_width(sdl_view_t* view) {
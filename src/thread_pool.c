@@ -0,0 +1,297 @@
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <log.h>
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+struct task {
+	thread_pool_fn_t fn;
+	void* arg;
+};
+
+/* Ring of tasks, the owner pushes and pops at the bottom and thieves take from the top. Tasks are coarse, */
+/* a lock per deque costs nothing next to them and only ever sees contention from the odd thief. */
+struct deque {
+	pthread_mutex_t mu;
+	struct task* tasks;
+	size_t capacity; // power of two
+	size_t top;
+	size_t bottom;
+};
+
+struct worker {
+	thread_pool_t* pool;
+	int index;
+	pthread_t thread;
+	struct deque queue;
+	uint64_t executed; // written by the worker only
+	uint64_t stolen;
+};
+
+struct thread_pool {
+	struct worker* workers;
+	int count;
+	_Atomic(size_t) queued;   // tasks sitting in deques
+	_Atomic(size_t) pending;  // tasks submitted and not finished yet
+	_Atomic(int) sleepers;
+	_Atomic(unsigned) next;   // deque the next outside submission goes to
+	bool stop;                // guarded by mu
+	pthread_mutex_t mu;
+	pthread_cond_t work;      // a task was queued or the pool is stopping
+	pthread_cond_t done;      // pending dropped to zero
+};
+
+// the worker running on this thread, so tasks can queue follow up work locally
+static _Thread_local struct worker* current;
+
+static bool deque_init(struct deque* q) {
+	q->tasks = malloc(DEQUE_INITIAL_CAPACITY * sizeof(struct task));
+	if (!q->tasks) {
+		return false;
+	}
+	q->capacity = DEQUE_INITIAL_CAPACITY;
+	q->top = 0;
+	q->bottom = 0;
+	pthread_mutex_init(&q->mu, NULL);
+	return true;
+}
+
+static void deque_destroy(struct deque* q) {
+	pthread_mutex_destroy(&q->mu);
+	free(q->tasks);
+}
+
+static bool deque_push(struct deque* q, struct task task) {
+	struct task* grown;
+	size_t i;
+
+	pthread_mutex_lock(&q->mu);
+	if (q->bottom - q->top == q->capacity) {
+		grown = malloc(2 * q->capacity * sizeof(struct task));
+		if (!grown) {
+			pthread_mutex_unlock(&q->mu);
+			return false;
+		}
+		for (i = q->top; i != q->bottom; i++) {
+			grown[i & (2 * q->capacity - 1)] = q->tasks[i & (q->capacity - 1)];
+		}
+		free(q->tasks);
+		q->tasks = grown;
+		q->capacity *= 2;
+	}
+	q->tasks[q->bottom++ & (q->capacity - 1)] = task;
+	pthread_mutex_unlock(&q->mu);
+	return true;
+}
+
+/* Newest task, for the owner */
+static bool deque_pop(struct deque* q, struct task* task) {
+	bool found;
+
+	pthread_mutex_lock(&q->mu);
+	found = q->bottom != q->top;
+	if (found) {
+		*task = q->tasks[--q->bottom & (q->capacity - 1)];
+	}
+	pthread_mutex_unlock(&q->mu);
+	return found;
+}
+
+/* Oldest task, for thieves */
+static bool deque_steal(struct deque* q, struct task* task) {
+	bool found;
+
+	pthread_mutex_lock(&q->mu);
+	found = q->bottom != q->top;
+	if (found) {
+		*task = q->tasks[q->top++ & (q->capacity - 1)];
+	}
+	pthread_mutex_unlock(&q->mu);
+	return found;
+}
+
+/* Takes a task from the worker's own deque, or steals one going round the others */
+static bool take(struct worker* w, struct task* task) {
+	thread_pool_t* pool;
+	int i;
+
+	pool = w->pool;
+	if (deque_pop(&w->queue, task)) {
+		return true;
+	}
+	for (i = 1; i < pool->count; i++) {
+		if (deque_steal(&pool->workers[(w->index + i) % pool->count].queue, task)) {
+			w->stolen++;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void finish(thread_pool_t* pool) {
+	if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+		pthread_mutex_lock(&pool->mu);
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->mu);
+	}
+}
+
+static void* worker_routine(void* data) {
+	struct worker* w;
+	thread_pool_t* pool;
+	struct task task;
+
+	w = data;
+	pool = w->pool;
+	current = w;
+	for (;;) {
+		if (take(w, &task)) {
+			atomic_fetch_sub(&pool->queued, 1);
+			task.fn(task.arg);
+			w->executed++;
+			finish(pool);
+			continue;
+		}
+		pthread_mutex_lock(&pool->mu);
+		// announcing the sleep before checking queued pairs with submit counting queued before checking
+		// sleepers, one of the two always sees the other so no wakeup gets lost. A task counted but not
+		// pushed yet only keeps the worker looping for a moment.
+		atomic_fetch_add(&pool->sleepers, 1);
+		while (atomic_load(&pool->queued) == 0 && !pool->stop) {
+			pthread_cond_wait(&pool->work, &pool->mu);
+		}
+		atomic_fetch_sub(&pool->sleepers, 1);
+		if (pool->stop && atomic_load(&pool->queued) == 0) {
+			pthread_mutex_unlock(&pool->mu);
+			break;
+		}
+		pthread_mutex_unlock(&pool->mu);
+	}
+	return NULL;
+}
+
+/* Stops the first started workers and frees the pool, the deques of all count workers must be set up */
+static void stop_pool(thread_pool_t* pool, int started) {
+	int i;
+
+	pthread_mutex_lock(&pool->mu);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mu);
+	for (i = 0; i < started; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+	for (i = 0; i < pool->count; i++) {
+		deque_destroy(&pool->workers[i].queue);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mu);
+	free(pool->workers);
+	free(pool);
+}
+
+thread_pool_t* thread_pool_create(int threads) {
+	thread_pool_t* pool;
+	int i;
+
+	if (threads <= 0) {
+		threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0) {
+			threads = 1;
+		}
+	}
+	pool = calloc(1, sizeof(struct thread_pool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->workers = calloc(threads, sizeof(struct worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+	atomic_init(&pool->queued, 0);
+	atomic_init(&pool->pending, 0);
+	atomic_init(&pool->sleepers, 0);
+	atomic_init(&pool->next, 0);
+	pool->stop = false;
+	pthread_mutex_init(&pool->mu, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (pool->count = 0; pool->count < threads; pool->count++) {
+		pool->workers[pool->count].pool = pool;
+		pool->workers[pool->count].index = pool->count;
+		if (!deque_init(&pool->workers[pool->count].queue)) {
+			log_error("Unable to allocate task queue");
+			stop_pool(pool, 0);
+			return NULL;
+		}
+	}
+	// deques are all set up before any worker starts stealing from them
+	for (i = 0; i < pool->count; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, worker_routine, &pool->workers[i]) != 0) {
+			log_error("Worker thread start error");
+			stop_pool(pool, i);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+void thread_pool_destroy(thread_pool_t* pool) {
+	thread_pool_wait(pool);
+	stop_pool(pool, pool->count);
+}
+
+int thread_pool_threads(thread_pool_t* pool) {
+	return pool->count;
+}
+
+bool thread_pool_submit(thread_pool_t* pool, thread_pool_fn_t fn, void* arg) {
+	struct worker* w;
+	struct task task;
+
+	w = current && current->pool == pool ? current : &pool->workers[atomic_fetch_add(&pool->next, 1) % pool->count];
+	task.fn = fn;
+	task.arg = arg;
+	// counted before it can possibly be taken, run and finished
+	atomic_fetch_add(&pool->pending, 1);
+	atomic_fetch_add(&pool->queued, 1);
+	if (!deque_push(&w->queue, task)) {
+		log_error("Unable to queue task");
+		atomic_fetch_sub(&pool->queued, 1);
+		finish(pool);
+		return false;
+	}
+	if (atomic_load(&pool->sleepers) > 0) {
+		pthread_mutex_lock(&pool->mu);
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->mu);
+	}
+	return true;
+}
+
+void thread_pool_wait(thread_pool_t* pool) {
+	pthread_mutex_lock(&pool->mu);
+	while (atomic_load(&pool->pending) > 0) {
+		pthread_cond_wait(&pool->done, &pool->mu);
+	}
+	pthread_mutex_unlock(&pool->mu);
+}
+
+void thread_pool_get_stats(thread_pool_t* pool, struct thread_pool_stats* stats) {
+	int i;
+
+	stats->executed = 0;
+	stats->stolen = 0;
+	for (i = 0; i < pool->count; i++) {
+		stats->executed += pool->workers[i].executed;
+		stats->stolen += pool->workers[i].stolen;
+	}
+}
@@ -0,0 +1,743 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <log.h>
+
+#include "lz.h"
+
+#define HEADER_SIZE 16
+#define BLOCK_MAGIC 0x42543843 // "C8TB"
+#define BLOCK_HEADER_SIZE 28
+#define BLOCK_LZ 1
+#define INDEX_MAGIC 0x49543843 // "C8TI"
+#define INDEX_ENTRY_SIZE 20
+#define TRAILER_MAGIC 0x45543843 // "C8TE"
+#define TRAILER_SIZE 36
+/* Encoded steps per block, a reader decodes at most one block to get to any step */
+#define BLOCK_SIZE (256 << 10)
+/* Blocks in memory, one being encoded and the rest queued for the writer. More than two ride out the writer */
+/* stalling in the file system without dropping any. */
+#define BUFFERS 8
+/* Largest encoded step: flags, cycle, pc, opcode, I, register mask and values, memory write */
+#define MAX_STEP_SIZE (1 + 10 + 2 + 2 + 2 + 2 + 16 + 3 + 16)
+
+/* Step flags, the first step of a block always has STEP_CYCLE and STEP_PC */
+#define STEP_CYCLE 0x01 // cycle follows as a varint, otherwise it is one past the last step's
+#define STEP_PC 0x02    // pc follows, otherwise it is two past the last step's
+#define STEP_INDEX 0x04
+#define STEP_REGS 0x08  // a 16 bit mask of the registers that follow
+#define STEP_WRITE 0x10 // address, length and the bytes written
+#define STEP_TICK 0x20
+
+struct block_entry {
+	uint64_t offset;
+	uint64_t first_cycle;
+	uint32_t steps;
+};
+
+struct block {
+	uint8_t* data;
+	size_t size;
+	uint64_t first_cycle;
+	uint32_t steps;
+};
+
+struct trace {
+	FILE* f;
+	bool compress;
+	// block being encoded, CPU thread only
+	uint8_t* data;
+	size_t used;
+	uint32_t steps_in_block;
+	uint64_t first_cycle;
+	uint64_t next_cycle;
+	uint16_t next_pc;
+	uint64_t steps;
+	uint64_t dropped_steps;
+	uint64_t raw_bytes;
+	// blocks[filled % BUFFERS] is being encoded, the writer owns the ones from written up to it
+	struct block blocks[BUFFERS];
+	_Atomic(uint32_t) filled;  // only written by the CPU thread
+	_Atomic(uint32_t) written; // only written by the writer
+	pthread_mutex_t lock;      // held to hand over blocks and to wait for them
+	pthread_cond_t cond;
+	bool closing;
+	pthread_t writer;
+	// writer thread only until it is joined
+	uint8_t* compressed;
+	struct block_entry* index;
+	size_t index_count;
+	size_t index_capacity;
+	uint64_t offset;
+	bool failed;
+};
+
+static uint8_t* put16(uint8_t* p, uint16_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	return p + 2;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t value) {
+	return put16(put16(p, value), value >> 16);
+}
+
+static uint8_t* put64(uint8_t* p, uint64_t value) {
+	return put32(put32(p, value), value >> 32);
+}
+
+static uint8_t* put_varint(uint8_t* p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+/* Readers fail once they would pass end and keep failing */
+struct reader {
+	const uint8_t* p;
+	const uint8_t* end;
+	bool ok;
+};
+
+static uint64_t get(struct reader* r, int bytes) {
+	uint64_t value;
+	int i;
+
+	if (r->end - r->p < bytes) {
+		r->ok = false;
+		return 0;
+	}
+	value = 0;
+	for (i = 0; i < bytes; i++) {
+		value |= (uint64_t) *r->p++ << (8 * i);
+	}
+	return value;
+}
+
+static uint64_t get_varint(struct reader* r) {
+	uint64_t value;
+	uint8_t byte;
+	int shift;
+
+	value = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		byte = get(r, 1);
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return value;
+		}
+	}
+	r->ok = false;
+	return 0;
+}
+
+static bool write_all(trace_t* trace, const uint8_t* data, size_t size) {
+	if (!trace->failed && fwrite(data, size, 1, trace->f) != 1) {
+		log_error("Unable to write trace");
+		trace->failed = true;
+	}
+	trace->offset += size;
+	return !trace->failed;
+}
+
+/* Writer thread: compresses a block if that makes it smaller, writes it and adds it to the index */
+static void write_block(trace_t* trace, const struct block* block) {
+	uint8_t header[BLOCK_HEADER_SIZE];
+	struct block_entry* grown;
+	const uint8_t* data;
+	size_t size;
+	size_t capacity;
+	uint32_t flags;
+	uint8_t* p;
+
+	data = block->data;
+	size = block->size;
+	flags = 0;
+	if (trace->compress) {
+		size = lz_compress(block->data, block->size, trace->compressed);
+		if (size < block->size) {
+			data = trace->compressed;
+			flags = BLOCK_LZ;
+		} else {
+			size = block->size;
+		}
+	}
+	if (trace->index_count == trace->index_capacity) {
+		capacity = trace->index_capacity ? trace->index_capacity * 2 : 256;
+		grown = realloc(trace->index, capacity * sizeof(struct block_entry));
+		if (!grown) {
+			log_error("Unable to grow the trace index");
+			trace->failed = true;
+			return;
+		}
+		trace->index = grown;
+		trace->index_capacity = capacity;
+	}
+	trace->index[trace->index_count].offset = trace->offset;
+	trace->index[trace->index_count].first_cycle = block->first_cycle;
+	trace->index[trace->index_count].steps = block->steps;
+	p = put32(header, BLOCK_MAGIC);
+	p = put32(p, flags);
+	p = put32(p, block->size);
+	p = put32(p, size);
+	p = put32(p, block->steps);
+	put64(p, block->first_cycle);
+	if (write_all(trace, header, sizeof(header)) && write_all(trace, data, size)) {
+		trace->index_count++;
+	}
+}
+
+static void* writer_loop(void* arg) {
+	trace_t* trace;
+	uint32_t written;
+
+	trace = arg;
+	pthread_mutex_lock(&trace->lock);
+	for (;;) {
+		written = atomic_load(&trace->written);
+		if (written == atomic_load(&trace->filled)) {
+			if (trace->closing) {
+				break;
+			}
+			pthread_cond_wait(&trace->cond, &trace->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&trace->lock);
+		write_block(trace, &trace->blocks[written % BUFFERS]);
+		pthread_mutex_lock(&trace->lock);
+		atomic_store(&trace->written, written + 1);
+		pthread_cond_broadcast(&trace->cond);
+	}
+	pthread_mutex_unlock(&trace->lock);
+	return NULL;
+}
+
+trace_t* trace_create(const char* path, bool compress) {
+	uint8_t header[HEADER_SIZE];
+	trace_t* trace;
+	uint8_t* p;
+	int i;
+
+	trace = calloc(1, sizeof(struct trace));
+	if (!trace) {
+		log_error("Unable to allocate trace");
+		return NULL;
+	}
+	trace->compress = compress;
+	for (i = 0; i < BUFFERS; i++) {
+		trace->blocks[i].data = malloc(BLOCK_SIZE);
+		if (!trace->blocks[i].data) {
+			log_error("Unable to allocate trace");
+			goto fail;
+		}
+	}
+	trace->data = trace->blocks[0].data;
+	trace->compressed = compress ? malloc(LZ_BOUND(BLOCK_SIZE)) : NULL;
+	if (compress && !trace->compressed) {
+		log_error("Unable to allocate trace");
+		goto fail;
+	}
+	trace->f = fopen(path, "wb");
+	if (!trace->f) {
+		log_error("Unable to open file %s", path);
+		goto fail;
+	}
+	p = put32(header, TRACE_MAGIC);
+	p = put16(p, TRACE_VERSION);
+	p = put16(p, compress ? BLOCK_LZ : 0);
+	put64(p, 0);
+	if (!write_all(trace, header, sizeof(header))) {
+		fclose(trace->f);
+		goto fail;
+	}
+	pthread_mutex_init(&trace->lock, NULL);
+	pthread_cond_init(&trace->cond, NULL);
+	atomic_init(&trace->filled, 0);
+	atomic_init(&trace->written, 0);
+	if (pthread_create(&trace->writer, NULL, writer_loop, trace) != 0) {
+		log_error("Unable to start the trace writer");
+		pthread_cond_destroy(&trace->cond);
+		pthread_mutex_destroy(&trace->lock);
+		fclose(trace->f);
+		goto fail;
+	}
+	return trace;
+
+fail:
+	for (i = 0; i < BUFFERS; i++) {
+		free(trace->blocks[i].data);
+	}
+	free(trace->compressed);
+	free(trace);
+	return NULL;
+}
+
+/* Hands the block over to the writer and starts the next one in the next buffer. If the writer has not */
+/* written that one yet the block is dropped, unless wait is set. */
+static void end_block(trace_t* trace, bool wait) {
+	struct block* block;
+	uint32_t filled;
+
+	if (trace->steps_in_block == 0) {
+		return;
+	}
+	filled = atomic_load_explicit(&trace->filled, memory_order_relaxed);
+	if (wait) {
+		pthread_mutex_lock(&trace->lock);
+		while (filled - atomic_load(&trace->written) > BUFFERS - 2) {
+			pthread_cond_wait(&trace->cond, &trace->lock);
+		}
+		pthread_mutex_unlock(&trace->lock);
+	}
+	if (filled - atomic_load(&trace->written) > BUFFERS - 2) {
+		trace->dropped_steps += trace->steps_in_block;
+	} else {
+		block = &trace->blocks[filled % BUFFERS];
+		block->size = trace->used;
+		block->first_cycle = trace->first_cycle;
+		block->steps = trace->steps_in_block;
+		pthread_mutex_lock(&trace->lock);
+		atomic_store(&trace->filled, filled + 1);
+		pthread_cond_broadcast(&trace->cond);
+		pthread_mutex_unlock(&trace->lock);
+		trace->data = trace->blocks[(filled + 1) % BUFFERS].data;
+	}
+	trace->used = 0;
+	trace->steps_in_block = 0;
+}
+
+void trace_record(trace_t* trace, const struct trace_step* step) {
+	uint8_t* start;
+	uint8_t* p;
+	uint8_t flags;
+	int v;
+
+	if (trace->used > BLOCK_SIZE - MAX_STEP_SIZE) {
+		end_block(trace, false);
+	}
+	if (trace->steps_in_block == 0) {
+		trace->first_cycle = step->cycle;
+	}
+	flags = 0;
+	if (trace->steps_in_block == 0 || step->cycle != trace->next_cycle) {
+		flags |= STEP_CYCLE;
+	}
+	if (trace->steps_in_block == 0 || step->pc != trace->next_pc) {
+		flags |= STEP_PC;
+	}
+	flags |= step->index_changed ? STEP_INDEX : 0;
+	flags |= step->changed ? STEP_REGS : 0;
+	flags |= step->write_len ? STEP_WRITE : 0;
+	flags |= step->tick ? STEP_TICK : 0;
+	start = trace->data + trace->used;
+	p = start;
+	*p++ = flags;
+	if (flags & STEP_CYCLE) {
+		p = put_varint(p, step->cycle);
+	}
+	if (flags & STEP_PC) {
+		p = put16(p, step->pc);
+	}
+	p = put16(p, step->opcode);
+	if (flags & STEP_INDEX) {
+		p = put16(p, step->index);
+	}
+	if (flags & STEP_REGS) {
+		p = put16(p, step->changed);
+		for (v = 0; v < 16; v++) {
+			if (step->changed >> v & 1) {
+				*p++ = step->v[v];
+			}
+		}
+	}
+	if (flags & STEP_WRITE) {
+		p = put16(p, step->write_addr);
+		*p++ = step->write_len;
+		memcpy(p, step->write, step->write_len);
+		p += step->write_len;
+	}
+	trace->used += p - start;
+	trace->raw_bytes += p - start;
+	trace->steps_in_block++;
+	trace->steps++;
+	trace->next_cycle = step->cycle + 1;
+	trace->next_pc = step->pc + 2;
+}
+
+enum CpuResult trace_close(trace_t* trace, struct trace_stats* stats) {
+	uint8_t entry[INDEX_ENTRY_SIZE];
+	uint8_t trailer[TRAILER_SIZE];
+	uint64_t index_offset;
+	enum CpuResult res;
+	size_t i;
+	uint8_t* p;
+
+	end_block(trace, true);
+	pthread_mutex_lock(&trace->lock);
+	trace->closing = true;
+	pthread_cond_broadcast(&trace->cond);
+	pthread_mutex_unlock(&trace->lock);
+	pthread_join(trace->writer, NULL);
+	index_offset = trace->offset;
+	p = put32(entry, INDEX_MAGIC);
+	put32(p, trace->index_count);
+	write_all(trace, entry, 8);
+	for (i = 0; i < trace->index_count; i++) {
+		p = put64(entry, trace->index[i].offset);
+		p = put64(p, trace->index[i].first_cycle);
+		put32(p, trace->index[i].steps);
+		write_all(trace, entry, sizeof(entry));
+	}
+	p = put64(trailer, index_offset);
+	p = put64(p, trace->steps);
+	p = put64(p, trace->dropped_steps);
+	p = put64(p, trace->raw_bytes);
+	put32(p, TRAILER_MAGIC);
+	write_all(trace, trailer, sizeof(trailer));
+	res = trace->failed ? IO_ERROR : OK;
+	if (fclose(trace->f) != 0 && res == OK) {
+		log_error("Unable to write trace");
+		res = IO_ERROR;
+	}
+	if (stats) {
+		stats->steps = trace->steps;
+		stats->dropped_steps = trace->dropped_steps;
+		stats->raw_bytes = trace->raw_bytes;
+		stats->file_bytes = trace->offset;
+	}
+	pthread_cond_destroy(&trace->cond);
+	pthread_mutex_destroy(&trace->lock);
+	for (i = 0; i < BUFFERS; i++) {
+		free(trace->blocks[i].data);
+	}
+	free(trace->compressed);
+	free(trace->index);
+	free(trace);
+	return res;
+}
+
+struct trace_reader {
+	FILE* f;
+	struct block_entry* blocks;
+	size_t count;
+	uint64_t steps;
+	uint64_t dropped_steps;
+	uint64_t raw_bytes;
+	uint64_t file_bytes;
+	size_t next_block;
+	uint8_t* data;   // the current block, decompressed
+	uint8_t* stored; // the current block as stored
+	struct reader r;
+	uint32_t left;   // steps left in the current block
+	uint64_t next_cycle;
+	uint16_t next_pc;
+	struct trace_step peeked; // the step trace_seek stopped at
+	bool has_peeked;
+};
+
+static bool read_at(FILE* f, uint64_t offset, uint8_t* buf, size_t size) {
+	return fseek(f, offset, SEEK_SET) == 0 && fread(buf, size, 1, f) == 1;
+}
+
+static bool add_block(trace_reader_t* reader, uint64_t offset, uint64_t first_cycle, uint32_t steps) {
+	struct block_entry* grown;
+
+	if ((reader->count & (reader->count - 1)) == 0) {
+		grown = realloc(reader->blocks, (reader->count ? reader->count * 2 : 1) * sizeof(struct block_entry));
+		if (!grown) {
+			return false;
+		}
+		reader->blocks = grown;
+	}
+	reader->blocks[reader->count].offset = offset;
+	reader->blocks[reader->count].first_cycle = first_cycle;
+	reader->blocks[reader->count].steps = steps;
+	reader->count++;
+	return true;
+}
+
+/* Reads the index at the end of a closed trace */
+static bool load_index(trace_reader_t* reader) {
+	uint8_t trailer[TRAILER_SIZE];
+	uint8_t entry[INDEX_ENTRY_SIZE];
+	struct reader r;
+	uint64_t index_offset;
+	uint64_t offset;
+	uint64_t first_cycle;
+	uint32_t count;
+	uint32_t steps;
+	uint32_t i;
+
+	if (reader->file_bytes < HEADER_SIZE + TRAILER_SIZE
+			|| !read_at(reader->f, reader->file_bytes - TRAILER_SIZE, trailer, sizeof(trailer))) {
+		return false;
+	}
+	r = (struct reader) { trailer, trailer + sizeof(trailer), true };
+	index_offset = get(&r, 8);
+	reader->steps = get(&r, 8);
+	reader->dropped_steps = get(&r, 8);
+	reader->raw_bytes = get(&r, 8);
+	if (get(&r, 4) != TRAILER_MAGIC || index_offset < HEADER_SIZE || index_offset > reader->file_bytes - TRAILER_SIZE
+			|| !read_at(reader->f, index_offset, entry, 8)) {
+		return false;
+	}
+	r = (struct reader) { entry, entry + 8, true };
+	if (get(&r, 4) != INDEX_MAGIC) {
+		return false;
+	}
+	count = get(&r, 4);
+	if ((reader->file_bytes - TRAILER_SIZE - index_offset - 8) / INDEX_ENTRY_SIZE != count) {
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		if (fread(entry, sizeof(entry), 1, reader->f) != 1) {
+			return false;
+		}
+		r = (struct reader) { entry, entry + sizeof(entry), true };
+		offset = get(&r, 8);
+		first_cycle = get(&r, 8);
+		steps = get(&r, 4);
+		if (!add_block(reader, offset, first_cycle, steps)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Finds the blocks of a trace that was never closed by walking their headers */
+static bool scan_blocks(trace_reader_t* reader) {
+	uint8_t header[BLOCK_HEADER_SIZE];
+	struct reader r;
+	uint64_t offset;
+	uint64_t first_cycle;
+	uint32_t raw;
+	uint32_t stored;
+	uint32_t steps;
+
+	reader->count = 0;
+	reader->steps = 0;
+	reader->dropped_steps = 0;
+	reader->raw_bytes = 0;
+	offset = HEADER_SIZE;
+	while (offset + BLOCK_HEADER_SIZE <= reader->file_bytes && read_at(reader->f, offset, header, sizeof(header))) {
+		r = (struct reader) { header, header + sizeof(header), true };
+		if (get(&r, 4) != BLOCK_MAGIC) {
+			break;
+		}
+		get(&r, 4);
+		raw = get(&r, 4);
+		stored = get(&r, 4);
+		steps = get(&r, 4);
+		first_cycle = get(&r, 8);
+		if (offset + BLOCK_HEADER_SIZE + stored > reader->file_bytes) {
+			break;
+		}
+		if (!add_block(reader, offset, first_cycle, steps)) {
+			return false;
+		}
+		reader->steps += steps;
+		reader->raw_bytes += raw;
+		offset += BLOCK_HEADER_SIZE + stored;
+	}
+	return true;
+}
+
+trace_reader_t* trace_open(const char* path) {
+	uint8_t header[HEADER_SIZE];
+	trace_reader_t* reader;
+	struct reader r;
+	long size;
+
+	reader = calloc(1, sizeof(struct trace_reader));
+	if (!reader) {
+		return NULL;
+	}
+	reader->data = malloc(BLOCK_SIZE);
+	reader->stored = malloc(LZ_BOUND(BLOCK_SIZE));
+	reader->f = fopen(path, "rb");
+	if (!reader->f) {
+		log_error("Unable to open file %s", path);
+		trace_reader_close(reader);
+		return NULL;
+	}
+	if (!reader->data || !reader->stored || fseek(reader->f, 0, SEEK_END) != 0 || (size = ftell(reader->f)) < 0) {
+		trace_reader_close(reader);
+		return NULL;
+	}
+	reader->file_bytes = size;
+	r = (struct reader) { header, header + sizeof(header), true };
+	if (!read_at(reader->f, 0, header, sizeof(header)) || get(&r, 4) != TRACE_MAGIC) {
+		log_error("%s is not a trace", path);
+		trace_reader_close(reader);
+		return NULL;
+	}
+	if (get(&r, 2) != TRACE_VERSION) {
+		log_error("Trace version of %s is not supported", path);
+		trace_reader_close(reader);
+		return NULL;
+	}
+	if (!load_index(reader)) {
+		log_warn("%s has no index, it was not closed, reading the blocks it has", path);
+		if (!scan_blocks(reader)) {
+			trace_reader_close(reader);
+			return NULL;
+		}
+	}
+	return reader;
+}
+
+void trace_reader_close(trace_reader_t* reader) {
+	if (reader->f) {
+		fclose(reader->f);
+	}
+	free(reader->blocks);
+	free(reader->data);
+	free(reader->stored);
+	free(reader);
+}
+
+size_t trace_blocks(trace_reader_t* reader) {
+	return reader->count;
+}
+
+void trace_reader_stats(trace_reader_t* reader, struct trace_stats* stats) {
+	stats->steps = reader->steps;
+	stats->dropped_steps = reader->dropped_steps;
+	stats->raw_bytes = reader->raw_bytes;
+	stats->file_bytes = reader->file_bytes;
+}
+
+static bool load_block(trace_reader_t* reader, size_t i) {
+	uint8_t header[BLOCK_HEADER_SIZE];
+	struct reader r;
+	uint32_t flags;
+	uint32_t raw;
+	uint32_t stored;
+	bool ok;
+
+	reader->left = 0;
+	if (!read_at(reader->f, reader->blocks[i].offset, header, sizeof(header))) {
+		return false;
+	}
+	r = (struct reader) { header, header + sizeof(header), true };
+	if (get(&r, 4) != BLOCK_MAGIC) {
+		return false;
+	}
+	flags = get(&r, 4);
+	raw = get(&r, 4);
+	stored = get(&r, 4);
+	if (raw > BLOCK_SIZE || stored > LZ_BOUND(BLOCK_SIZE) || (!(flags & BLOCK_LZ) && stored != raw)
+			|| fread(reader->stored, 1, stored, reader->f) != stored) {
+		return false;
+	}
+	if (flags & BLOCK_LZ) {
+		ok = lz_decompress(reader->stored, stored, reader->data, raw);
+	} else {
+		memcpy(reader->data, reader->stored, raw);
+		ok = true;
+	}
+	if (!ok) {
+		log_error("Trace block at %llu is damaged", (unsigned long long) reader->blocks[i].offset);
+		return false;
+	}
+	reader->r = (struct reader) { reader->data, reader->data + raw, true };
+	reader->left = reader->blocks[i].steps;
+	reader->next_block = i + 1;
+	return true;
+}
+
+static bool decode_step(trace_reader_t* reader, struct trace_step* step) {
+	struct reader* r;
+	uint8_t flags;
+	int v;
+
+	r = &reader->r;
+	flags = get(r, 1);
+	step->cycle = flags & STEP_CYCLE ? get_varint(r) : reader->next_cycle;
+	step->pc = flags & STEP_PC ? get(r, 2) : reader->next_pc;
+	step->opcode = get(r, 2);
+	step->index_changed = flags & STEP_INDEX;
+	step->index = step->index_changed ? get(r, 2) : 0;
+	step->changed = flags & STEP_REGS ? get(r, 2) : 0;
+	for (v = 0; v < 16; v++) {
+		step->v[v] = step->changed >> v & 1 ? get(r, 1) : 0;
+	}
+	step->write_len = 0;
+	if (flags & STEP_WRITE) {
+		step->write_addr = get(r, 2);
+		step->write_len = get(r, 1);
+		if (step->write_len > sizeof(step->write)) {
+			r->ok = false;
+			return false;
+		}
+		for (v = 0; v < step->write_len; v++) {
+			step->write[v] = get(r, 1);
+		}
+	}
+	step->tick = flags & STEP_TICK;
+	reader->next_cycle = step->cycle + 1;
+	reader->next_pc = step->pc + 2;
+	reader->left--;
+	return r->ok;
+}
+
+bool trace_next(trace_reader_t* reader, struct trace_step* step) {
+	if (reader->has_peeked) {
+		*step = reader->peeked;
+		reader->has_peeked = false;
+		return true;
+	}
+	while (reader->left == 0) {
+		if (reader->next_block >= reader->count || !load_block(reader, reader->next_block)) {
+			return false;
+		}
+	}
+	return decode_step(reader, step);
+}
+
+/* Decodes from block first up to block end for the first step at or after cycle, leaving it peeked */
+static bool seek_from(trace_reader_t* reader, size_t first, size_t end, uint64_t cycle) {
+	reader->has_peeked = false;
+	reader->left = 0;
+	reader->next_block = first;
+	while (reader->left > 0 || reader->next_block < end) {
+		if (!trace_next(reader, &reader->peeked)) {
+			return false;
+		}
+		if (reader->peeked.cycle >= cycle) {
+			reader->has_peeked = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool trace_seek(trace_reader_t* reader, uint64_t cycle) {
+	size_t end;
+	size_t i;
+
+	// rewound runs go back in cycles, so the index is not sorted and a block starting at or before cycle need
+	// not get to it. Blocks are tried from the last, each decoded only up to the one tried before it, and the
+	// first one is tried in any case for a cycle before the start of the trace.
+	end = reader->count;
+	for (i = reader->count; i-- > 0;) {
+		if (reader->blocks[i].first_cycle <= cycle || i == 0) {
+			if (seek_from(reader, i, end, cycle)) {
+				return true;
+			}
+			end = i;
+		}
+	}
+	reader->has_peeked = false;
+	reader->left = 0;
+	reader->next_block = reader->count;
+	return false;
+}
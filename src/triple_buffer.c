@@ -0,0 +1,81 @@
+#include "triple_buffer.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// set in middle when it holds a frame the reader has not taken yet
+#define FRESH 4
+#define INDEX 3
+
+struct triple_buffer {
+	uint8_t* data;
+	size_t size;
+	int back;  // owned by the writer
+	int front; // owned by the reader
+	_Atomic(int) middle;
+	_Atomic(uint64_t) published;
+	_Atomic(uint64_t) acquired;
+};
+
+triple_buffer_t* triple_buffer_create(size_t size) {
+	triple_buffer_t* tb;
+
+	tb = malloc(sizeof(struct triple_buffer));
+	if (!tb) {
+		return NULL;
+	}
+	tb->data = calloc(3, size);
+	if (!tb->data) {
+		free(tb);
+		return NULL;
+	}
+	tb->size = size;
+	tb->back = 0;
+	tb->front = 1;
+	atomic_init(&tb->middle, 2);
+	atomic_init(&tb->published, 0);
+	atomic_init(&tb->acquired, 0);
+	return tb;
+}
+
+void triple_buffer_destroy(triple_buffer_t* tb) {
+	free(tb->data);
+	free(tb);
+}
+
+void* triple_buffer_back(triple_buffer_t* tb) {
+	return tb->data + tb->back * tb->size;
+}
+
+void triple_buffer_publish(triple_buffer_t* tb) {
+	int prev;
+
+	// release makes the frame visible to the reader, acquire the buffer it handed back
+	prev = atomic_exchange_explicit(&tb->middle, tb->back | FRESH, memory_order_acq_rel);
+	tb->back = prev & INDEX;
+	atomic_fetch_add_explicit(&tb->published, 1, memory_order_relaxed);
+}
+
+bool triple_buffer_acquire(triple_buffer_t* tb) {
+	int prev;
+
+	if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & FRESH)) {
+		return false;
+	}
+	prev = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+	tb->front = prev & INDEX;
+	atomic_fetch_add_explicit(&tb->acquired, 1, memory_order_relaxed);
+	return true;
+}
+
+const void* triple_buffer_front(triple_buffer_t* tb) {
+	return tb->data + tb->front * tb->size;
+}
+
+uint64_t triple_buffer_published(triple_buffer_t* tb) {
+	return atomic_load_explicit(&tb->published, memory_order_relaxed);
+}
+
+uint64_t triple_buffer_acquired(triple_buffer_t* tb) {
+	return atomic_load_explicit(&tb->acquired, memory_order_relaxed);
+}
@@ -0,0 +1,494 @@
+/* chip8bench - micro and macro benchmarks of the core, printed as JSON on stdout. */
+/* */
+/* Every benchmark is run once to warm up and then --reps times, each run gives one sample and the report */
+/* holds their mean, standard deviation, minimum, median and maximum. Benchmarks always appear in the same */
+/* order with the same names, so two reports can be compared line by line. Only libchip8 is needed. */
+/* */
+/* execute.<class>.<backend>  ns per instruction of a loop made of one class of instructions */
+/* image.*                    ns per call of the image functions the CPU and the renderer use */
+/* throughput.<backend>       emulated instructions per second of a synthetic game loop, frames included */
+/* frame.run                  ns per frame of that loop at the default instructions per frame */
+/* frame_latency.*            us from the CPU thread publishing a frame to a render thread holding it, */
+/*                            with the CPU paced at 60 Hz as in the emulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <log.h>
+
+#include <cpu.h>
+#include <image.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define MAX_ROM_SIZE (4096 - 0x200)
+/* Instructions of a benchmark loop before it jumps back, the jump is the only instruction of another class */
+#define LOOP_LENGTH 64
+#define MAX_OPCODES 16
+
+#ifdef NDEBUG
+static const char* build_type = "release";
+#else
+static const char* build_type = "dev";
+#endif
+#if defined(CPU_DISPATCH_GOTO)
+static const char* dispatch = "goto";
+#elif defined(CPU_DISPATCH_CHAIN)
+static const char* dispatch = "chain";
+#else
+static const char* dispatch = "table";
+#endif
+
+static const int execute_cycles = 1 << 20;
+static const int throughput_frames = 1000;
+static const int throughput_cycles_per_frame = 1000;
+static const int step_frames = 600;
+static const int latency_frames = 30;
+static const int sprite_draws = 1 << 16;
+static const int image_converts = 1 << 12;
+
+struct options {
+	long reps;
+	const char* filter; // only benchmarks whose name contains it
+};
+
+/* A loop of body, repeated to LOOP_LENGTH instructions, after setup has run once. Lists end at 0. */
+struct synthetic_rom {
+	const char* name;
+	uint16_t setup[MAX_OPCODES];
+	uint16_t body[MAX_OPCODES];
+};
+
+/* Fused sequences (see cpu_get_fusion_stats) and delay timer polls are kept out of the loops so that every */
+/* class is measured on its own handlers */
+static const struct synthetic_rom classes[] = {
+	{"load", {0}, {0x6A12, 0x7A01, 0x6B34, 0x7B02}},
+	{"alu", {0x6A05, 0x6B03}, {0x8AB4, 0x8AB5, 0x8AB1, 0x8AB2, 0x8AB3, 0x8AB6, 0x8ABE, 0x8AB7}},
+	{"skip", {0x6A05, 0x6B03}, {0x3A06, 0x4A05, 0x5AB0, 0x9AA0}},
+	{"flow", {0x1204, 0x00EE}, {0x2202}},
+	{"memory", {0x6005}, {0xA400, 0xF033, 0xF255, 0xF01E, 0xF265}},
+	{"draw", {0x6000, 0x6100, 0xF029}, {0xD015}},
+	{"random", {0}, {0xC0FF, 0xC1FF}},
+	{"timer", {0x6005}, {0xF015, 0xF007, 0xF018}},
+	{"keypad", {0x6005}, {0xE09E, 0xE19E}},
+};
+
+/* Something like a game: arithmetic, a call, table lookups, a sprite and RND every iteration */
+static const struct synthetic_rom game = {
+	"game",
+	{0x1204, 0x00EE, 0x6A05, 0x6B03, 0x6000, 0x6100},
+	{0x8AB4, 0x3A06, 0x2202, 0xA400, 0xF033, 0xF265, 0xF029, 0xD015, 0xC2FF, 0x7A01, 0x8AB2, 0xF015},
+};
+
+struct sample_set {
+	double* values;
+	int count;
+};
+
+static bool first_result = true;
+
+static int64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options]\n", name);
+	fprintf(stderr, "  --reps N    samples per benchmark, 10 by default\n");
+	fprintf(stderr, "  --filter S  only run benchmarks whose name contains S\n");
+}
+
+static bool parse_args(int argc, char** argv, struct options* opts) {
+	char* end;
+	int i;
+
+	opts->reps = 10;
+	opts->filter = NULL;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+			opts->reps = strtol(argv[++i], &end, 0);
+			if (*end != '\0' || opts->reps < 1 || opts->reps > 100000) {
+				fprintf(stderr, "Invalid value %s for --reps\n", argv[i]);
+				return false;
+			}
+		} else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			opts->filter = argv[++i];
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool selected(const struct options* opts, const char* name) {
+	return !opts->filter || strstr(name, opts->filter);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Prints one result line, sorts the samples */
+static void report(const char* name, const char* unit, struct sample_set* samples) {
+	double mean;
+	double variance;
+	double median;
+	int n;
+	int i;
+
+	n = samples->count;
+	mean = 0;
+	for (i = 0; i < n; i++) {
+		mean += samples->values[i];
+	}
+	mean /= n;
+	variance = 0;
+	for (i = 0; i < n; i++) {
+		variance += (samples->values[i] - mean) * (samples->values[i] - mean);
+	}
+	// sample variance, a single sample has none
+	variance = n > 1 ? variance / (n - 1) : 0;
+	qsort(samples->values, n, sizeof(double), compare_doubles);
+	median = n % 2 ? samples->values[n / 2] : (samples->values[n / 2 - 1] + samples->values[n / 2]) / 2;
+	printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"samples\": %d, \"mean\": %.3f, \"stddev\": %.3f, "
+			"\"min\": %.3f, \"median\": %.3f, \"max\": %.3f}",
+			first_result ? "" : ",", name, unit, n, mean, sqrt(variance), samples->values[0], median,
+			samples->values[n - 1]);
+	first_result = false;
+	fflush(stdout);
+}
+
+/* Runs sample once to warm up and then once per rep */
+static void measure(const struct options* opts, const char* name, const char* unit, struct sample_set* samples,
+		double (*sample)(void*), void* arg) {
+	int i;
+
+	if (!selected(opts, name)) {
+		return;
+	}
+	sample(arg);
+	for (i = 0; i < opts->reps; i++) {
+		samples->values[i] = sample(arg);
+	}
+	samples->count = opts->reps;
+	report(name, unit, samples);
+}
+
+static size_t put_opcode(uint8_t* rom, size_t len, uint16_t opcode) {
+	rom[len] = opcode >> 8;
+	rom[len + 1] = opcode & 0xFF;
+	return len + 2;
+}
+
+/* Writes the ROM image into rom, returns its length */
+static size_t build_rom(const struct synthetic_rom* synthetic, uint8_t* rom) {
+	size_t len;
+	size_t loop;
+	int i;
+	int j;
+
+	len = 0;
+	for (i = 0; i < MAX_OPCODES && synthetic->setup[i]; i++) {
+		len = put_opcode(rom, len, synthetic->setup[i]);
+	}
+	loop = 0x200 + len;
+	for (i = 0; i < LOOP_LENGTH;) {
+		for (j = 0; j < MAX_OPCODES && synthetic->body[j] && i < LOOP_LENGTH; j++, i++) {
+			len = put_opcode(rom, len, synthetic->body[j]);
+		}
+	}
+	return put_opcode(rom, len, 0x1000 | loop);
+}
+
+/* Returns NULL if the backend is not available here */
+static cpu_instance_t* create(const struct synthetic_rom* synthetic, enum CpuBackend backend) {
+	cpu_instance_t* cpu;
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t len;
+
+	if (cpu_create_instance(&cpu) != OK) {
+		return NULL;
+	}
+	len = build_rom(synthetic, rom);
+	if (cpu_init(cpu, NULL) != OK || cpu_load_rom(cpu, rom, len) != OK || cpu_set_backend(cpu, backend) != OK) {
+		cpu_destroy_instance(cpu);
+		return NULL;
+	}
+	return cpu;
+}
+
+static double execute_sample(void* arg) {
+	cpu_instance_t* cpu = arg;
+	int64_t start;
+
+	start = now_ns();
+	cpu_run_cycles(cpu, execute_cycles);
+	return (now_ns() - start) / (double) execute_cycles;
+}
+
+static double throughput_sample(void* arg) {
+	cpu_instance_t* cpu = arg;
+	uint64_t cycles;
+	int64_t start;
+	int64_t elapsed;
+
+	cycles = cpu_get_cycles(cpu);
+	start = now_ns();
+	cpu_run_frames(cpu, throughput_frames);
+	elapsed = now_ns() - start;
+	cycles = cpu_get_cycles(cpu) - cycles;
+	return elapsed > 0 ? cycles * (double) NSEC_PER_SEC / elapsed : 0;
+}
+
+static double step_sample(void* arg) {
+	cpu_instance_t* cpu = arg;
+	int64_t start;
+
+	start = now_ns();
+	cpu_run_frames(cpu, step_frames);
+	return (now_ns() - start) / (double) step_frames;
+}
+
+static double sprite_sample(void* arg) {
+	image_t* image = arg;
+	static const uint8_t sprite[15] = {0xF0, 0x90, 0x90, 0x90, 0xF0, 0x20, 0x60, 0x20, 0x20, 0x70, 0xF0, 0x10,
+		0xF0, 0x80, 0xF0};
+	int64_t start;
+	int i;
+
+	start = now_ns();
+	// every column and row, so a share of the draws wraps around the edges
+	for (i = 0; i < sprite_draws; i++) {
+		image_xor_sprite(image, (i * 7) % IMAGE_COLS, (i * 3) % CPU_SCREEN_HEIGHT, 1 + i % 15, sprite);
+	}
+	return (now_ns() - start) / (double) sprite_draws;
+}
+
+struct convert_arg {
+	image_t* image;
+	struct image_palette palette;
+	enum ImageFormat format;
+	uint8_t pixels[CPU_SCREEN_HEIGHT][IMAGE_COLS * 4];
+};
+
+static double convert_sample(void* arg) {
+	struct convert_arg* convert = arg;
+	int64_t start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < image_converts; i++) {
+		image_convert(convert->image, &convert->palette, convert->format, convert->pixels, sizeof(convert->pixels[0]));
+	}
+	return (now_ns() - start) / (double) image_converts;
+}
+
+/* What the emulator does to get a frame on screen: a sprite drawn, then only the dirty area expanded into */
+/* the locked texture, here a buffer with the pitch of one */
+static double upload_sample(void* arg) {
+	struct convert_arg* convert = arg;
+	static const uint8_t sprite[5] = {0xF0, 0x90, 0x90, 0x90, 0xF0};
+	struct image_rect rect;
+	int64_t start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < image_converts; i++) {
+		image_xor_sprite(convert->image, (i * 8) % IMAGE_COLS, (i * 5) % CPU_SCREEN_HEIGHT, 5, sprite);
+		if (image_take_dirty(convert->image, &rect)) {
+			image_convert_rect(convert->image, &convert->palette, convert->format, &rect,
+					&convert->pixels[rect.y][rect.x * 4], sizeof(convert->pixels[0]));
+		}
+	}
+	return (now_ns() - start) / (double) image_converts;
+}
+
+static void execute_benchmarks(const struct options* opts, struct sample_set* samples) {
+	static const enum CpuBackend backends[] = {CPU_BACKEND_INTERPRETER, CPU_BACKEND_JIT};
+	static const char* backend_names[] = {"interpreter", "jit"};
+	cpu_instance_t* cpu;
+	char name[64];
+	size_t c;
+	size_t b;
+
+	for (c = 0; c < sizeof(classes) / sizeof(classes[0]); c++) {
+		for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+			snprintf(name, sizeof(name), "execute.%s.%s", classes[c].name, backend_names[b]);
+			if (!selected(opts, name) || !(cpu = create(&classes[c], backends[b]))) {
+				continue;
+			}
+			measure(opts, name, "ns/instruction", samples, execute_sample, cpu);
+			cpu_destroy_instance(cpu);
+		}
+	}
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		snprintf(name, sizeof(name), "throughput.%s", backend_names[b]);
+		if (!selected(opts, name) || !(cpu = create(&game, backends[b]))) {
+			continue;
+		}
+		cpu_set_cycles_per_frame(cpu, throughput_cycles_per_frame);
+		measure(opts, name, "instructions/s", samples, throughput_sample, cpu);
+		cpu_destroy_instance(cpu);
+	}
+	if (selected(opts, "frame.run") && (cpu = create(&game, CPU_BACKEND_INTERPRETER))) {
+		measure(opts, "frame.run", "ns/frame", samples, step_sample, cpu);
+		cpu_destroy_instance(cpu);
+	}
+}
+
+static void image_benchmarks(const struct options* opts, struct sample_set* samples) {
+	struct convert_arg* convert;
+
+	convert = calloc(1, sizeof(struct convert_arg));
+	if (!convert || !(convert->image = image_create(CPU_SCREEN_HEIGHT, IMAGE_COLS))) {
+		fprintf(stderr, "Unable to create image\n");
+		exit(1);
+	}
+	image_palette_init(&convert->palette, 0x000000, 0xC837E9);
+	measure(opts, "image.xor_sprite", "ns/call", samples, sprite_sample, convert->image);
+	convert->format = IMAGE_FORMAT_RGB24;
+	measure(opts, "image.convert.rgb24", "ns/call", samples, convert_sample, convert);
+	convert->format = IMAGE_FORMAT_XRGB8888;
+	measure(opts, "image.convert.xrgb8888", "ns/call", samples, convert_sample, convert);
+	measure(opts, "image.upload.xrgb8888", "ns/frame", samples, upload_sample, convert);
+	image_destroy(convert->image);
+	free(convert);
+}
+
+/* Handed from the CPU thread's frame notify to the render thread */
+struct latency {
+	pthread_mutex_t lock;
+	pthread_cond_t published;
+	int64_t published_ns;
+	uint64_t frames;
+};
+
+static void notify(void* arg) {
+	struct latency* latency = arg;
+
+	pthread_mutex_lock(&latency->lock);
+	latency->published_ns = now_ns();
+	latency->frames++;
+	pthread_cond_signal(&latency->published);
+	pthread_mutex_unlock(&latency->lock);
+}
+
+/* Waits for latency_frames frames the way the emulator's render thread does, returns their mean and worst */
+/* latency in us, or false if the CPU thread stops publishing */
+static bool latency_sample(cpu_instance_t* cpu, image_t* frame, struct latency* latency, double* mean, double* max) {
+	struct timespec timeout;
+	uint64_t seen;
+	int64_t published;
+	double us;
+	int i;
+
+	*mean = 0;
+	*max = 0;
+	pthread_mutex_lock(&latency->lock);
+	seen = latency->frames;
+	for (i = 0; i < latency_frames; i++) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 1;
+		while (latency->frames == seen) {
+			if (pthread_cond_timedwait(&latency->published, &latency->lock, &timeout) != 0) {
+				pthread_mutex_unlock(&latency->lock);
+				return false;
+			}
+		}
+		seen = latency->frames;
+		published = latency->published_ns;
+		pthread_mutex_unlock(&latency->lock);
+		cpu_take_frame(cpu, frame);
+		us = (now_ns() - published) / 1e3;
+		*mean += us / latency_frames;
+		*max = us > *max ? us : *max;
+		pthread_mutex_lock(&latency->lock);
+	}
+	pthread_mutex_unlock(&latency->lock);
+	return true;
+}
+
+static void latency_benchmarks(const struct options* opts, struct sample_set* mean, struct sample_set* max) {
+	struct latency latency;
+	cpu_instance_t* cpu;
+	image_t* frame;
+	double ignored;
+	bool ok;
+	int i;
+
+	if (!selected(opts, "frame_latency.mean") && !selected(opts, "frame_latency.max")) {
+		return;
+	}
+	cpu = create(&game, CPU_BACKEND_INTERPRETER);
+	frame = image_create(CPU_SCREEN_HEIGHT, IMAGE_COLS);
+	if (!cpu || !frame) {
+		fprintf(stderr, "Unable to set up the frame latency benchmark\n");
+		exit(1);
+	}
+	pthread_mutex_init(&latency.lock, NULL);
+	pthread_cond_init(&latency.published, NULL);
+	latency.published_ns = 0;
+	latency.frames = 0;
+	cpu_set_frame_notify(cpu, notify, &latency);
+	if (cpu_start(cpu) != OK) {
+		fprintf(stderr, "Unable to start the CPU thread\n");
+		exit(1);
+	}
+	ok = latency_sample(cpu, frame, &latency, &ignored, &ignored);
+	for (i = 0; i < opts->reps && ok; i++) {
+		ok = latency_sample(cpu, frame, &latency, &mean->values[i], &max->values[i]);
+	}
+	cpu_stop(cpu);
+	if (!ok) {
+		fprintf(stderr, "CPU thread stopped publishing frames\n");
+		exit(1);
+	}
+	mean->count = opts->reps;
+	max->count = opts->reps;
+	if (selected(opts, "frame_latency.mean")) {
+		report("frame_latency.mean", "us", mean);
+	}
+	if (selected(opts, "frame_latency.max")) {
+		report("frame_latency.max", "us", max);
+	}
+	cpu_destroy_instance(cpu);
+	image_destroy(frame);
+	pthread_cond_destroy(&latency.published);
+	pthread_mutex_destroy(&latency.lock);
+}
+
+int main(int argc, char** argv) {
+	struct options opts;
+	struct sample_set samples;
+	struct sample_set extra;
+
+	if (!parse_args(argc, argv, &opts)) {
+		usage(argv[0]);
+		return 1;
+	}
+	log_set_level(LOG_WARN);
+	samples.values = calloc(opts.reps, sizeof(double));
+	extra.values = calloc(opts.reps, sizeof(double));
+	if (!samples.values || !extra.values) {
+		return 1;
+	}
+	printf("{\n  \"schema\": 1,\n  \"build\": \"%s\",\n  \"dispatch\": \"%s\",\n  \"reps\": %ld,\n  \"benchmarks\": [",
+			build_type, dispatch, opts.reps);
+	execute_benchmarks(&opts, &samples);
+	image_benchmarks(&opts, &samples);
+	latency_benchmarks(&opts, &samples, &extra);
+	printf("\n  ]\n}\n");
+	free(samples.values);
+	free(extra.values);
+	return 0;
+}
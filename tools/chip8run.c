@@ -0,0 +1,384 @@
+/* chip8run - runs ROMs headless for a number of frames as fast as the host allows. */
+/* */
+/* Nothing is drawn, the final screen is summed up as a hash so that runs can be compared, or printed with --dump. */
+/* Every ROM, times --copies, becomes an instance of its own and all of them share a pool of worker threads. */
+/* Only libchip8 is needed, no SDL or other graphics stack. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include <log.h>
+
+#include <cpu.h>
+#include <image.h>
+#include <batch.h>
+#include <input_log.h>
+#include <trace.h>
+
+struct options {
+	long frames;            // -1 runs the whole --replay log, or 600 frames without one
+	long cycles_per_frame; // 0 keeps the CPU default
+	long keys;             // keypad mask held down for the whole run
+	long copies;           // instances per ROM
+	long threads;          // 0 is one per core
+	long slice;            // frames an instance runs before its worker looks for other work
+	const char* load_state; // save state every instance starts from
+	const char* save_state; // where the final state of a single instance goes
+	const char* replay;     // input log every instance replays
+	const char* trace;      // where the execution trace of a single instance goes
+	input_log_t* log;
+	uint64_t seed;
+	bool seeded;
+	bool jit;
+	bool aot;
+	bool dump;
+	bool trace_raw;
+	bool profile;
+	bool verbose;
+};
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options] <rom>...\n", name);
+	fprintf(stderr, "  --frames N  frames to run, 600 or the length of the --replay log by default\n");
+	fprintf(stderr, "  --ipf N     instructions per frame, 9 by default\n");
+	fprintf(stderr, "  --keys M    hold down the keys in the 16 bit mask M for the whole run\n");
+	fprintf(stderr, "  --copies N  run N instances of every ROM\n");
+	fprintf(stderr, "  --threads N worker threads, one per core by default\n");
+	fprintf(stderr, "  --slice N   frames an instance runs at a time, 60 by default\n");
+	fprintf(stderr, "  --load-state F  start every instance from the save state in F\n");
+	fprintf(stderr, "  --save-state F  save the final state to F, only with a single instance\n");
+	fprintf(stderr, "  --seed N    RND seed of every instance\n");
+	fprintf(stderr, "  --replay F  replay the input log in F on every instance, it brings its own seed and --ipf\n");
+	fprintf(stderr, "  --trace F   record every instruction into F, only with a single instance, see chip8trace\n");
+	fprintf(stderr, "  --trace-raw do not compress the --trace\n");
+	fprintf(stderr, "  --jit       run on the JIT instead of the interpreter\n");
+	fprintf(stderr, "  --aot       load <rom>.so made by rom2c if there is one, it runs as trusted code\n");
+	fprintf(stderr, "  --dump      print the final screen\n");
+	fprintf(stderr, "  --profile   print where each instance spent its instructions, needs make PROFILE=counts\n");
+	fprintf(stderr, "  -v          log everything the emulator logs\n");
+}
+
+/* Parses argument i of an option that takes a number, returns false if it is missing or out of range */
+static bool number(int argc, char** argv, int i, long min, long max, long* value) {
+	char* end;
+
+	if (i >= argc) {
+		fprintf(stderr, "%s needs a value\n", argv[i - 1]);
+		return false;
+	}
+	*value = strtol(argv[i], &end, 0);
+	if (*end != '\0' || *value < min || *value > max) {
+		fprintf(stderr, "Invalid value %s for %s\n", argv[i], argv[i - 1]);
+		return false;
+	}
+	return true;
+}
+
+/* Parses argument i of an option that takes a 64 bit number */
+static bool number64(int argc, char** argv, int i, uint64_t* value) {
+	char* end;
+
+	if (i >= argc) {
+		fprintf(stderr, "%s needs a value\n", argv[i - 1]);
+		return false;
+	}
+	*value = strtoull(argv[i], &end, 0);
+	if (*end != '\0' || argv[i][0] == '-') {
+		fprintf(stderr, "Invalid value %s for %s\n", argv[i], argv[i - 1]);
+		return false;
+	}
+	return true;
+}
+
+/* Takes argument i of an option that names a file */
+static bool file(int argc, char** argv, int i, const char** path) {
+	if (i >= argc) {
+		fprintf(stderr, "%s needs a file\n", argv[i - 1]);
+		return false;
+	}
+	*path = argv[i];
+	return true;
+}
+
+/* Returns the index of the first ROM argument, or 0 if the arguments are invalid */
+static int parse_args(int argc, char** argv, struct options* opts) {
+	int i;
+	bool ok;
+
+	opts->frames = -1;
+	opts->cycles_per_frame = 0;
+	opts->keys = 0;
+	opts->copies = 1;
+	opts->threads = 0;
+	opts->slice = 60;
+	opts->load_state = NULL;
+	opts->save_state = NULL;
+	opts->replay = NULL;
+	opts->trace = NULL;
+	opts->trace_raw = false;
+	opts->log = NULL;
+	opts->seed = 0;
+	opts->seeded = false;
+	opts->jit = false;
+	opts->aot = false;
+	opts->dump = false;
+	opts->profile = false;
+	opts->verbose = false;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "--frames") == 0) {
+			ok = number(argc, argv, ++i, 0, INT_MAX, &opts->frames);
+		} else if (strcmp(argv[i], "--ipf") == 0) {
+			ok = number(argc, argv, ++i, 1, INT_MAX, &opts->cycles_per_frame);
+		} else if (strcmp(argv[i], "--keys") == 0) {
+			ok = number(argc, argv, ++i, 0, 0xFFFF, &opts->keys);
+		} else if (strcmp(argv[i], "--copies") == 0) {
+			ok = number(argc, argv, ++i, 1, INT_MAX, &opts->copies);
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			ok = number(argc, argv, ++i, 1, 4096, &opts->threads);
+		} else if (strcmp(argv[i], "--slice") == 0) {
+			ok = number(argc, argv, ++i, 1, INT_MAX, &opts->slice);
+		} else if (strcmp(argv[i], "--load-state") == 0) {
+			ok = file(argc, argv, ++i, &opts->load_state);
+		} else if (strcmp(argv[i], "--save-state") == 0) {
+			ok = file(argc, argv, ++i, &opts->save_state);
+		} else if (strcmp(argv[i], "--seed") == 0) {
+			ok = number64(argc, argv, ++i, &opts->seed);
+			opts->seeded = true;
+		} else if (strcmp(argv[i], "--replay") == 0) {
+			ok = file(argc, argv, ++i, &opts->replay);
+		} else if (strcmp(argv[i], "--trace") == 0) {
+			ok = file(argc, argv, ++i, &opts->trace);
+		} else if (strcmp(argv[i], "--trace-raw") == 0) {
+			opts->trace_raw = true;
+			ok = true;
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			opts->jit = true;
+			ok = true;
+		} else if (strcmp(argv[i], "--aot") == 0) {
+			opts->aot = true;
+			ok = true;
+		} else if (strcmp(argv[i], "--dump") == 0) {
+			opts->dump = true;
+			ok = true;
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			opts->profile = true;
+			ok = true;
+		} else if (strcmp(argv[i], "-v") == 0) {
+			opts->verbose = true;
+			ok = true;
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			ok = false;
+		}
+		if (!ok) {
+			return 0;
+		}
+	}
+	return i < argc ? i : 0;
+}
+
+/* FNV-1a over the packed rows */
+static uint64_t screen_hash(image_t* image) {
+	uint64_t hash;
+	uint64_t row;
+	int r;
+	int i;
+
+	hash = 1469598103934665603ULL;
+	for (r = 0; r < image_rows(image); r++) {
+		row = image_row(image, r);
+		for (i = 0; i < 8; i++) {
+			hash ^= (row >> (8 * i)) & 0xFF;
+			hash *= 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+/* Handlers by the share of ticks, or of instructions in builds that only count */
+static bool print_profile(cpu_instance_t* cpu) {
+	struct cpu_profile profile;
+	const struct cpu_profile_entry* e;
+	int i;
+
+	if (cpu_get_profile(cpu, &profile) != OK) {
+		fprintf(stderr, "--profile needs a build with make PROFILE=counts or PROFILE=ticks\n");
+		return false;
+	}
+	for (i = 0; i < profile.handler_count; i++) {
+		e = &profile.handlers[i];
+		printf("  %-16s %12llu %5.1f%%", e->name, (unsigned long long) e->count,
+				profile.count > 0 ? 100.0 * e->count / profile.count : 0.0);
+		if (profile.ticks > 0) {
+			printf(" %14llu ticks %5.1f%%", (unsigned long long) e->ticks, 100.0 * e->ticks / profile.ticks);
+		}
+		printf("\n");
+	}
+	return true;
+}
+
+static cpu_instance_t* create(const struct options* opts, char* rom) {
+	cpu_instance_t* cpu;
+	enum CpuResult res;
+
+	if (cpu_create_instance(&cpu) != OK) {
+		fprintf(stderr, "Unable to create CPU instance\n");
+		return NULL;
+	}
+	cpu_set_translation(cpu, opts->aot);
+	res = cpu_init(cpu, rom);
+	// the state brings its own clock, --ipf still overrides it
+	if (res == OK && opts->load_state) {
+		res = cpu_load_state_file(cpu, opts->load_state);
+	}
+	if (res == OK && opts->cycles_per_frame > 0) {
+		res = cpu_set_cycles_per_frame(cpu, opts->cycles_per_frame);
+	}
+	if (res == OK && opts->seeded) {
+		cpu_set_seed(cpu, opts->seed);
+	}
+	// the log brings its own seed and instructions per frame, instances share it read only
+	if (res == OK && opts->log) {
+		res = cpu_set_input_log(cpu, opts->log, CPU_INPUT_REPLAY);
+	}
+	if (res == OK && opts->jit) {
+		res = cpu_set_backend(cpu, CPU_BACKEND_JIT);
+	}
+	if (res == OK) {
+		res = cpu_set_keys(cpu, opts->keys);
+	}
+	if (res != OK) {
+		cpu_destroy_instance(cpu);
+		return NULL;
+	}
+	return cpu;
+}
+
+int main(int argc, char** argv) {
+	struct options opts;
+	struct batch_stats stats;
+	struct trace_stats trace_stats;
+	cpu_instance_t** cpus;
+	batch_t* batch;
+	trace_t* trace;
+	double seconds;
+	uint64_t frames;
+	uint64_t cycles;
+	int first;
+	int count;
+	int i;
+	int res;
+
+	first = parse_args(argc, argv, &opts);
+	if (first == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!opts.verbose) {
+		log_set_level(LOG_WARN);
+	}
+	if (argc - first > INT_MAX / opts.copies) {
+		fprintf(stderr, "Too many instances\n");
+		return 1;
+	}
+	if (opts.replay) {
+		opts.log = input_log_load(opts.replay);
+		if (!opts.log) {
+			return 1;
+		}
+		if (opts.frames < 0) {
+			opts.frames = input_log_frames(opts.log) < INT_MAX ? (long) input_log_frames(opts.log) : INT_MAX;
+		}
+	}
+	if (opts.frames < 0) {
+		opts.frames = 600;
+	}
+	count = (argc - first) * opts.copies;
+	if (opts.save_state && count != 1) {
+		fprintf(stderr, "--save-state needs a single instance\n");
+		return 1;
+	}
+	if (opts.trace && count != 1) {
+		fprintf(stderr, "--trace needs a single instance\n");
+		return 1;
+	}
+	cpus = calloc(count, sizeof(cpu_instance_t*));
+	batch = batch_create(opts.threads);
+	if (!cpus || !batch) {
+		fprintf(stderr, "Unable to set up %d instances\n", count);
+		return 1;
+	}
+	res = 0;
+	for (i = 0; i < count && res == 0; i++) {
+		cpus[i] = create(&opts, argv[first + i / opts.copies]);
+		if (!cpus[i] || batch_add(batch, cpus[i], opts.frames) != i) {
+			res = 1;
+		}
+	}
+	trace = NULL;
+	if (res == 0 && opts.trace) {
+		trace = trace_create(opts.trace, !opts.trace_raw);
+		if (!trace) {
+			res = 1;
+		}
+		cpu_set_trace(cpus[0], trace);
+	}
+	if (res == 0 && batch_run(batch, opts.slice) != OK) {
+		res = 1;
+	}
+	if (trace) {
+		cpu_set_trace(cpus[0], NULL);
+		if (trace_close(trace, &trace_stats) != OK) {
+			res = 1;
+		} else {
+			printf("trace %s: %llu steps, %llu dropped, %.2f bytes per step, %llu bytes written\n", opts.trace,
+					(unsigned long long) trace_stats.steps, (unsigned long long) trace_stats.dropped_steps,
+					trace_stats.steps > 0 ? (double) trace_stats.file_bytes / trace_stats.steps : 0.0,
+					(unsigned long long) trace_stats.file_bytes);
+		}
+	}
+
+	frames = 0;
+	cycles = 0;
+	for (i = 0; i < count && res == 0; i++) {
+		batch_get_stats(batch, i, &stats);
+		frames += stats.frames;
+		cycles += stats.cycles;
+		if (opts.dump) {
+			image_draw_to_stdout(cpu_get_image_inst(cpus[i]));
+		}
+		seconds = stats.busy_ns / 1e9;
+		printf("%s #%ld: frames %llu, cycles %llu, %.3f s, %.3f MHz, screen %016llx\n",
+				argv[first + i / opts.copies], i % opts.copies, (unsigned long long) stats.frames,
+				(unsigned long long) stats.cycles, seconds, seconds > 0 ? stats.cycles / seconds / 1e6 : 0.0,
+				(unsigned long long) screen_hash(cpu_get_image_inst(cpus[i])));
+		if (opts.profile && !print_profile(cpus[i])) {
+			res = 1;
+		}
+	}
+	if (res == 0 && opts.save_state && cpu_save_state_file(cpus[0], opts.save_state) != OK) {
+		res = 1;
+	}
+	if (res == 0) {
+		seconds = batch_elapsed_ns(batch) / 1e9;
+		printf("%d instances on %d threads: %llu frames in %.3f s, %.0f frames/s, %.3f MHz, %llu steals\n",
+				count, batch_threads(batch), (unsigned long long) frames, seconds,
+				seconds > 0 ? frames / seconds : 0.0, seconds > 0 ? cycles / seconds / 1e6 : 0.0,
+				(unsigned long long) batch_steals(batch));
+	}
+
+	batch_destroy(batch);
+	for (i = 0; i < count; i++) {
+		if (cpus[i]) {
+			cpu_destroy_instance(cpus[i]);
+		}
+	}
+	free(cpus);
+	if (opts.log) {
+		input_log_destroy(opts.log);
+	}
+	return res;
+}
@@ -0,0 +1,152 @@
+/* chip8trace - lists the instructions of an execution trace recorded with chip8run --trace or chip8emu --trace. */
+/* */
+/* Every line is one instruction: the cycle it ran at, its address, opcode and disassembly, then what it changed. */
+/* --from starts the listing at a cycle without decoding what comes before it, the trace index points at the */
+/* block holding it. Cycles missing from the trace, because the writer fell behind, are marked as a gap. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <log.h>
+
+#include <trace.h>
+#include <instruction.h>
+
+struct options {
+	uint64_t from;
+	uint64_t count; // 0 lists everything from --from on
+	bool info;
+};
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options] <trace>\n", name);
+	fprintf(stderr, "  --from N    start at the first instruction at or after cycle N\n");
+	fprintf(stderr, "  --count N   list at most N instructions\n");
+	fprintf(stderr, "  --info      print what the trace holds instead of listing it\n");
+}
+
+/* Parses argument i of an option that takes a 64 bit number */
+static bool number64(int argc, char** argv, int i, uint64_t* value) {
+	char* end;
+
+	if (i >= argc) {
+		fprintf(stderr, "%s needs a value\n", argv[i - 1]);
+		return false;
+	}
+	*value = strtoull(argv[i], &end, 0);
+	if (*end != '\0' || argv[i][0] == '-') {
+		fprintf(stderr, "Invalid value %s for %s\n", argv[i], argv[i - 1]);
+		return false;
+	}
+	return true;
+}
+
+/* Returns the index of the trace argument, or 0 if the arguments are invalid */
+static int parse_args(int argc, char** argv, struct options* opts) {
+	int i;
+	bool ok;
+
+	opts->from = 0;
+	opts->count = 0;
+	opts->info = false;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "--from") == 0) {
+			ok = number64(argc, argv, ++i, &opts->from);
+		} else if (strcmp(argv[i], "--count") == 0) {
+			ok = number64(argc, argv, ++i, &opts->count);
+		} else if (strcmp(argv[i], "--info") == 0) {
+			opts->info = true;
+			ok = true;
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			ok = false;
+		}
+		if (!ok) {
+			return 0;
+		}
+	}
+	return i == argc - 1 ? i : 0;
+}
+
+static void print_step(const struct trace_step* step) {
+	char text[32];
+	int i;
+
+	instruction_format(step->opcode, text, sizeof(text));
+	printf("%12llu  %03X  %04X  %-16s", (unsigned long long) step->cycle, step->pc, step->opcode, text);
+	for (i = 0; i < 16; i++) {
+		if (step->changed >> i & 1) {
+			printf(" V%X=%02X", i, step->v[i]);
+		}
+	}
+	if (step->index_changed) {
+		printf(" I=%03X", step->index);
+	}
+	if (step->write_len) {
+		printf(" M[%03X]=", step->write_addr);
+		for (i = 0; i < step->write_len; i++) {
+			printf("%02X", step->write[i]);
+		}
+	}
+	if (step->tick) {
+		printf(" tick");
+	}
+	printf("\n");
+}
+
+static void print_info(trace_reader_t* reader) {
+	struct trace_stats stats;
+	struct trace_step step;
+
+	trace_reader_stats(reader, &stats);
+	printf("blocks:  %zu\n", trace_blocks(reader));
+	printf("steps:   %llu\n", (unsigned long long) stats.steps);
+	printf("dropped: %llu\n", (unsigned long long) stats.dropped_steps);
+	printf("encoded: %llu bytes, %.2f per step\n", (unsigned long long) stats.raw_bytes,
+			stats.steps > 0 ? (double) stats.raw_bytes / stats.steps : 0.0);
+	printf("file:    %llu bytes, %.2f per step\n", (unsigned long long) stats.file_bytes,
+			stats.steps > 0 ? (double) stats.file_bytes / stats.steps : 0.0);
+	if (trace_seek(reader, 0) && trace_next(reader, &step)) {
+		printf("first:   cycle %llu\n", (unsigned long long) step.cycle);
+	}
+}
+
+int main(int argc, char** argv) {
+	struct options opts;
+	struct trace_step step;
+	trace_reader_t* reader;
+	uint64_t listed;
+	uint64_t expected;
+
+	if (parse_args(argc, argv, &opts) == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	log_set_level(LOG_WARN);
+	reader = trace_open(argv[argc - 1]);
+	if (!reader) {
+		return 1;
+	}
+	if (opts.info) {
+		print_info(reader);
+		trace_reader_close(reader);
+		return 0;
+	}
+	listed = 0;
+	expected = opts.from;
+	if (trace_seek(reader, opts.from)) {
+		while ((opts.count == 0 || listed < opts.count) && trace_next(reader, &step)) {
+			if (step.cycle != expected && listed > 0) {
+				printf("-- cycle %llu follows %llu --\n", (unsigned long long) step.cycle,
+						(unsigned long long) expected - 1);
+			}
+			print_step(&step);
+			expected = step.cycle + 1;
+			listed++;
+		}
+	}
+	trace_reader_close(reader);
+	return 0;
+}
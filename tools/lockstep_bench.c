@@ -0,0 +1,228 @@
+/* lockstep_bench - runs many copies of a ROM on the interpreter one after another and then as lanes of one */
+/* lockstep_t, reports the throughput of both and checks that every lane ends on the same screen as its */
+/* interpreter copy. Both runs use a single thread. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include <log.h>
+
+#include <cpu.h>
+#include <image.h>
+#include <lockstep.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define MAX_ROM_SIZE (4096 - 0x200)
+
+struct options {
+	long lanes;
+	long frames;
+	long cycles_per_frame; // 0 keeps the default
+	bool diverge;          // lane n holds key n % 16 and is seeded with n, so lanes branch apart
+};
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options] <rom>\n", name);
+	fprintf(stderr, "  --lanes N   copies of the ROM, 256 by default\n");
+	fprintf(stderr, "  --frames N  frames to run, 600 by default\n");
+	fprintf(stderr, "  --ipf N     instructions per frame, 9 by default\n");
+	fprintf(stderr, "  --diverge   hold a different key down and seed RND differently in every lane\n");
+}
+
+static bool number(int argc, char** argv, int i, long min, long max, long* value) {
+	char* end;
+
+	if (i >= argc) {
+		fprintf(stderr, "%s needs a value\n", argv[i - 1]);
+		return false;
+	}
+	*value = strtol(argv[i], &end, 0);
+	if (*end != '\0' || *value < min || *value > max) {
+		fprintf(stderr, "Invalid value %s for %s\n", argv[i], argv[i - 1]);
+		return false;
+	}
+	return true;
+}
+
+/* Returns the index of the ROM argument, or 0 if the arguments are invalid */
+static int parse_args(int argc, char** argv, struct options* opts) {
+	int i;
+	bool ok;
+
+	opts->lanes = 256;
+	opts->frames = 600;
+	opts->cycles_per_frame = 0;
+	opts->diverge = false;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "--lanes") == 0) {
+			ok = number(argc, argv, ++i, 1, 1 << 16, &opts->lanes);
+		} else if (strcmp(argv[i], "--frames") == 0) {
+			ok = number(argc, argv, ++i, 0, INT_MAX, &opts->frames);
+		} else if (strcmp(argv[i], "--ipf") == 0) {
+			ok = number(argc, argv, ++i, 1, 1 << 20, &opts->cycles_per_frame);
+		} else if (strcmp(argv[i], "--diverge") == 0) {
+			opts->diverge = true;
+			ok = true;
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			ok = false;
+		}
+		if (!ok) {
+			return 0;
+		}
+	}
+	return i == argc - 1 ? i : 0;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static size_t read_rom(const char* path, uint8_t* rom) {
+	FILE* f;
+	size_t len;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return 0;
+	}
+	len = fread(rom, 1, MAX_ROM_SIZE, f);
+	fclose(f);
+	return len;
+}
+
+static uint16_t lane_keys(const struct options* opts, int lane) {
+	return opts->diverge ? 1 << (lane % 16) : 0;
+}
+
+static cpu_instance_t* create(const struct options* opts, const uint8_t* rom, size_t len, int lane) {
+	cpu_instance_t* cpu;
+	enum CpuResult res;
+
+	if (cpu_create_instance(&cpu) != OK) {
+		return NULL;
+	}
+	res = cpu_init(cpu, NULL);
+	if (res == OK) {
+		res = cpu_load_rom(cpu, rom, len);
+	}
+	if (res == OK) {
+		res = cpu_set_backend(cpu, CPU_BACKEND_INTERPRETER);
+	}
+	if (res == OK && opts->cycles_per_frame > 0) {
+		res = cpu_set_cycles_per_frame(cpu, opts->cycles_per_frame);
+	}
+	if (res == OK) {
+		res = cpu_set_keys(cpu, lane_keys(opts, lane));
+	}
+	if (opts->diverge) {
+		cpu_set_seed(cpu, lane);
+	}
+	if (res != OK) {
+		cpu_destroy_instance(cpu);
+		return NULL;
+	}
+	return cpu;
+}
+
+static void report(const char* name, uint64_t elapsed_ns, uint64_t cycles) {
+	double seconds;
+
+	seconds = elapsed_ns / 1e9;
+	printf("%-11s %.3f s, %.3f MHz\n", name, seconds, seconds > 0 ? cycles / seconds / 1e6 : 0.0);
+}
+
+int main(int argc, char** argv) {
+	struct options opts;
+	struct lockstep_stats stats;
+	uint8_t rom[MAX_ROM_SIZE];
+	cpu_instance_t** cpus;
+	lockstep_t* lockstep;
+	image_t* image;
+	uint64_t start;
+	uint64_t cycles;
+	size_t len;
+	int mismatched;
+	int lanes;
+	int first;
+	int i;
+	int r;
+
+	first = parse_args(argc, argv, &opts);
+	if (first == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	log_set_level(LOG_WARN);
+	len = read_rom(argv[first], rom);
+	if (len == 0) {
+		return 1;
+	}
+	lanes = (int) opts.lanes;
+	cpus = calloc(lanes, sizeof(cpu_instance_t*));
+	lockstep = lockstep_create(lanes, rom, len);
+	if (!cpus || !lockstep) {
+		fprintf(stderr, "Unable to set up %d lanes\n", lanes);
+		return 1;
+	}
+	if (opts.cycles_per_frame > 0) {
+		lockstep_set_cycles_per_frame(lockstep, opts.cycles_per_frame);
+	}
+	for (i = 0; i < lanes; i++) {
+		cpus[i] = create(&opts, rom, len, i);
+		if (!cpus[i]) {
+			fprintf(stderr, "Unable to create CPU instance\n");
+			return 1;
+		}
+		lockstep_set_keys(lockstep, i, lane_keys(&opts, i));
+		if (opts.diverge) {
+			lockstep_set_seed(lockstep, i, i);
+		}
+	}
+
+	cycles = 0;
+	start = now_ns();
+	for (i = 0; i < lanes; i++) {
+		cpu_run_frames(cpus[i], opts.frames);
+		cycles += cpu_get_cycles(cpus[i]);
+	}
+	report("interpreter", now_ns() - start, cycles);
+	start = now_ns();
+	lockstep_run_frames(lockstep, opts.frames);
+	report("lockstep", now_ns() - start, cycles);
+
+	lockstep_get_stats(lockstep, &stats);
+	printf("%d lanes, %s, %llu groups, %.1f%% of lane instructions vectorized, %llu unknown\n", lanes,
+			lockstep_vectorized(lockstep) ? "avx2" : "scalar", (unsigned long long) stats.groups,
+			stats.vector_lanes + stats.scalar_lanes > 0 ? 100.0 * stats.vector_lanes / (stats.vector_lanes + stats.scalar_lanes) : 0.0,
+			(unsigned long long) stats.unknown);
+
+	mismatched = 0;
+	for (i = 0; i < lanes; i++) {
+		image = cpu_get_image_inst(cpus[i]);
+		for (r = 0; r < image_rows(image); r++) {
+			if (image_row(image, r) != lockstep_row(lockstep, i, r)) {
+				mismatched++;
+				break;
+			}
+		}
+	}
+	if (mismatched != 0) {
+		printf("%d lanes ended on a different screen than the interpreter\n", mismatched);
+	}
+
+	lockstep_destroy(lockstep);
+	for (i = 0; i < lanes; i++) {
+		cpu_destroy_instance(cpus[i]);
+	}
+	free(cpus);
+	return mismatched != 0;
+}
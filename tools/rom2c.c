@@ -0,0 +1,464 @@
+/* rom2c - translates a CHIP-8 ROM ahead of time into C that the emulator loads with dlopen. */
+/* */
+/* Code is found by walking the ROM from 0x200 along every statically known edge. Each run of reachable */
+/* instructions without a gap becomes one function that can be entered at any of its instructions. Register, */
+/* index, timer and stack instructions are written out as C on the guest state, skips and jumps as branches */
+/* and gotos within the function. Drawing, RND, the keypad and the stores to memory call the interpreter */
+/* handlers, and a store returns to the CPU so that code it overwrites is dropped before it runs. Bnnn */
+/* targets and anything else the walk can't see are left to the interpreter, as are unknown opcodes and */
+/* blocks the ROM overwrites at run time. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <instruction.h>
+#include <aot.h>
+
+#define MEMORY_SIZE 4096
+#define ROM_START 0x200
+
+static uint8_t memory[MEMORY_SIZE];
+static struct instruction code[MEMORY_SIZE / 2];
+static bool reachable[MEMORY_SIZE / 2];
+static uint16_t rom_end;
+
+/* Instructions run through the interpreter handler rather than written out */
+static bool calls_handler(uint8_t op) {
+	switch (op) {
+		case OP_CLS:
+		case OP_RND:
+		case OP_DRAW:
+		case OP_SKEY:
+		case OP_SNKEY:
+		case OP_WAITKEY:
+		case OP_STBCD:
+		case OP_STREG:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Instructions written out with V registers in them */
+static bool uses_registers(uint8_t op) {
+	switch (op) {
+		case OP_LDI:
+		case OP_JP:
+		case OP_CALL:
+		case OP_RET:
+		case OP_NOP:
+			return false;
+		default:
+			return !calls_handler(op);
+	}
+}
+
+/* Whether the JP at pc closes a loop polling the delay timer. It goes through the handler and back to the */
+/* CPU, which counts the jump, fuses the loop and skips ahead to the next tick instead of spinning in it. */
+static bool closes_idle_loop(uint16_t pc) {
+	const struct instruction* ins;
+	uint16_t target;
+
+	ins = &code[pc >> 1];
+	target = ins->nnn;
+	return ins->op == OP_JP && target + 4 == pc && code[target >> 1].op == OP_RDELAY &&
+			code[(target + 2) >> 1].op == OP_SE && code[(target + 2) >> 1].x == code[target >> 1].x;
+}
+
+static void walk(void) {
+	static uint16_t pending[MEMORY_SIZE];
+	size_t count;
+	uint16_t pc;
+	struct instruction* ins;
+
+	count = 0;
+	pending[count++] = ROM_START;
+	while (count > 0) {
+		pc = pending[--count];
+		if ((pc & 1) || pc < ROM_START || pc + 1 >= rom_end || reachable[pc >> 1]) {
+			continue;
+		}
+		ins = &code[pc >> 1];
+		instruction_decode(memory[pc] << 8 | memory[pc + 1], ins);
+		// unknown opcodes stop the interpreter, which logs them, so they are left to it
+		if (ins->op == OP_UNKNOWN) {
+			continue;
+		}
+		reachable[pc >> 1] = true;
+		switch (ins->op) {
+			case OP_JP:
+				pending[count++] = ins->nnn;
+				break;
+			case OP_CALL:
+				pending[count++] = ins->nnn;
+				pending[count++] = pc + 2;
+				break;
+			case OP_RET:
+			case OP_JPREG:
+			case OP_NOP:
+				break;
+			case OP_SE:
+			case OP_SNE:
+			case OP_SEREG:
+			case OP_SNEREG:
+			case OP_SKEY:
+			case OP_SNKEY:
+				pending[count++] = pc + 2;
+				pending[count++] = pc + 4;
+				break;
+			default:
+				pending[count++] = pc + 2;
+				break;
+		}
+	}
+}
+
+/* Instructions that call a handler need a struct instruction to pass it */
+static void emit_instructions(FILE* out) {
+	uint16_t pc;
+	const struct instruction* ins;
+
+	for (pc = ROM_START; pc < rom_end; pc += 2) {
+		ins = &code[pc >> 1];
+		if (!reachable[pc >> 1] || !(calls_handler(ins->op) || closes_idle_loop(pc))) {
+			continue;
+		}
+		fprintf(out, "static const struct instruction i_%03X = { 0x%04X, 0x%03X, 0x%02X, 0x%X, 0x%X, 0x%X, %u };\n",
+				pc, ins->opcode, ins->nnn, ins->kk, ins->x, ins->y, ins->n, ins->op);
+	}
+	fprintf(out, "\n");
+}
+
+/* Returns the address after the block starting at start. A block runs on to the next gap in the reachable */
+/* code, so that skips over jumps and jumps back to the start of a loop stay within it. */
+static uint16_t block_end(uint16_t start) {
+	uint16_t pc;
+
+	pc = start;
+	while (pc < rom_end && reachable[pc >> 1]) {
+		pc += 2;
+	}
+	return pc;
+}
+
+/* Where control goes after the instruction at pc other than to the next one, -1 if not statically known */
+static int branch_target(uint16_t pc) {
+	const struct instruction* ins;
+
+	ins = &code[pc >> 1];
+	switch (ins->op) {
+		case OP_JP:
+			return closes_idle_loop(pc) ? -1 : ins->nnn;
+		case OP_CALL:
+			return ins->nnn;
+		case OP_SNEREG:
+			return ins->x == ins->y ? -1 : pc + 4;
+		case OP_SE:
+		case OP_SNE:
+		case OP_SEREG:
+		case OP_SKEY:
+		case OP_SNKEY:
+			return pc + 4;
+		default:
+			return -1;
+	}
+}
+
+/* A block being written, the body goes to a buffer first so that only the locals it uses are declared */
+struct block {
+	FILE* out;
+	uint16_t start;
+	uint16_t end;
+	bool uses_registers;
+	bool uses_budget;
+	bool uses_temp;
+};
+
+static bool in_block(const struct block* b, int addr) {
+	return addr >= b->start && addr < b->end && !(addr & 1);
+}
+
+/* Counts the instruction at pc and carries on at target, within the block while the budget lasts */
+static void emit_continue(struct block* b, const char* indent, uint16_t pc, uint16_t target) {
+	if (!in_block(b, target)) {
+		fprintf(b->out, "%s*s->program_counter = 0x%03X;\n%sreturn n + 1;\n", indent, target, indent);
+		return;
+	}
+	b->uses_budget = true;
+	fprintf(b->out, "%sif (++n == budget) {\n%s\t*s->program_counter = 0x%03X;\n%s\treturn n;\n%s}\n",
+			indent, indent, target, indent, indent);
+	if (target == pc + 2) {
+		fprintf(b->out, "%s/* fallthrough */\n", indent);
+	} else {
+		fprintf(b->out, "%sgoto l_%03X;\n", indent, target);
+	}
+}
+
+/* Writes a skip taken when cond holds */
+static void emit_skip(struct block* b, uint16_t pc, const char* cond) {
+	fprintf(b->out, "\t\t\tif (%s) {\n", cond);
+	emit_continue(b, "\t\t\t\t", pc, pc + 4);
+	fprintf(b->out, "\t\t\t}\n");
+	emit_continue(b, "\t\t\t", pc, pc + 2);
+}
+
+static void emit_handler(struct block* b, uint16_t pc, const struct instruction* ins) {
+	fprintf(b->out, "\t\t\t*s->program_counter = 0x%03X;\n", pc);
+	fprintf(b->out, "\t\t\ts->handlers[%u](s->inst, &i_%03X);\n", ins->op, pc);
+}
+
+static void emit_instruction(struct block* b, uint16_t pc) {
+	const struct instruction* ins;
+	char cond[64];
+	FILE* out;
+	int r;
+
+	ins = &code[pc >> 1];
+	out = b->out;
+	b->uses_registers |= uses_registers(ins->op);
+	switch (ins->op) {
+		case OP_LDIM:
+			fprintf(out, "\t\t\tv[0x%X] = 0x%02X;\n", ins->x, ins->kk);
+			break;
+		case OP_ADDIM:
+			fprintf(out, "\t\t\tv[0x%X] += 0x%02X;\n", ins->x, ins->kk);
+			break;
+		case OP_LDV:
+			fprintf(out, "\t\t\tv[0x%X] = v[0x%X];\n", ins->x, ins->y);
+			break;
+		case OP_OR:
+			fprintf(out, "\t\t\tv[0x%X] |= v[0x%X];\n", ins->x, ins->y);
+			break;
+		case OP_AND:
+			fprintf(out, "\t\t\tv[0x%X] &= v[0x%X];\n", ins->x, ins->y);
+			break;
+		case OP_XOR:
+			fprintf(out, "\t\t\tv[0x%X] ^= v[0x%X];\n", ins->x, ins->y);
+			break;
+		// VF is written in the same order as the interpreter does, it matters when x or y is F
+		case OP_ADD:
+			b->uses_temp = true;
+			fprintf(out, "\t\t\tt = v[0x%X] + v[0x%X];\n\t\t\tv[0xF] = t > 0xFF;\n\t\t\tv[0x%X] = t;\n",
+					ins->x, ins->y, ins->x);
+			break;
+		case OP_SUB:
+			fprintf(out, "\t\t\tv[0xF] = v[0x%X] > v[0x%X];\n\t\t\tv[0x%X] -= v[0x%X];\n",
+					ins->x, ins->y, ins->x, ins->y);
+			break;
+		case OP_SHR:
+			fprintf(out, "\t\t\tv[0xF] = v[0x%X] & 1;\n\t\t\tv[0x%X] >>= 1;\n", ins->x, ins->x);
+			break;
+		case OP_SUBN:
+			fprintf(out, "\t\t\tv[0xF] = v[0x%X] > v[0x%X];\n\t\t\tv[0x%X] = v[0x%X] - v[0x%X];\n",
+					ins->y, ins->x, ins->x, ins->y, ins->x);
+			break;
+		case OP_SHL:
+			fprintf(out, "\t\t\tv[0xF] = v[0x%X] > 0x80;\n\t\t\tv[0x%X] <<= 1;\n", ins->x, ins->x);
+			break;
+		case OP_LDI:
+			fprintf(out, "\t\t\t*s->index_register = 0x%03X;\n", ins->nnn);
+			break;
+		case OP_ADDI:
+			fprintf(out, "\t\t\t*s->index_register += v[0x%X];\n", ins->x);
+			break;
+		case OP_LDSPRITE:
+			fprintf(out, "\t\t\t*s->index_register = 0x50 + 5 * v[0x%X];\n", ins->x);
+			break;
+		case OP_RDELAY:
+			fprintf(out, "\t\t\tv[0x%X] = *s->delay_timer;\n", ins->x);
+			break;
+		case OP_WDELAY:
+			fprintf(out, "\t\t\t*s->delay_timer = v[0x%X];\n", ins->x);
+			break;
+		case OP_WSOUND:
+			fprintf(out, "\t\t\t*s->sound_timer = v[0x%X];\n", ins->x);
+			break;
+		case OP_LDREG:
+			for (r = 0; r <= ins->x; r++) {
+				fprintf(out, "\t\t\tv[0x%X] = s->memory[(*s->index_register + %d) & 0xFFF];\n", r, r);
+			}
+			break;
+		case OP_SE:
+			snprintf(cond, sizeof(cond), "v[0x%X] == 0x%02X", ins->x, ins->kk);
+			emit_skip(b, pc, cond);
+			return;
+		case OP_SNE:
+			snprintf(cond, sizeof(cond), "v[0x%X] != 0x%02X", ins->x, ins->kk);
+			emit_skip(b, pc, cond);
+			return;
+		// a register compared with itself always skips or never does
+		case OP_SEREG:
+			snprintf(cond, sizeof(cond), "v[0x%X] == v[0x%X]", ins->x, ins->y);
+			ins->x == ins->y ? emit_continue(b, "\t\t\t", pc, pc + 4) : emit_skip(b, pc, cond);
+			return;
+		case OP_SNEREG:
+			snprintf(cond, sizeof(cond), "v[0x%X] != v[0x%X]", ins->x, ins->y);
+			ins->x == ins->y ? emit_continue(b, "\t\t\t", pc, pc + 2) : emit_skip(b, pc, cond);
+			return;
+		case OP_SKEY:
+		case OP_SNKEY:
+			emit_handler(b, pc, ins);
+			snprintf(cond, sizeof(cond), "*s->program_counter == 0x%03X", pc + 4);
+			emit_skip(b, pc, cond);
+			return;
+		case OP_JP:
+			if (closes_idle_loop(pc)) {
+				emit_handler(b, pc, ins);
+				fprintf(out, "\t\t\treturn n + 1;\n");
+				return;
+			}
+			emit_continue(b, "\t\t\t", pc, ins->nnn);
+			return;
+		case OP_CALL:
+			fprintf(out, "\t\t\ts->stack[(*s->stack_pointer)++] = 0x%03X;\n", pc);
+			emit_continue(b, "\t\t\t", pc, ins->nnn);
+			return;
+		case OP_RET:
+			fprintf(out, "\t\t\t*s->program_counter = s->stack[--*s->stack_pointer] + 2;\n\t\t\treturn n + 1;\n");
+			return;
+		case OP_JPREG:
+			fprintf(out, "\t\t\t*s->program_counter = v[0x0] + 0x%03X;\n\t\t\treturn n + 1;\n", ins->nnn);
+			return;
+		case OP_NOP:
+			// spins in place for the rest of the budget, like the interpreter
+			fprintf(out, "\t\t\t*s->program_counter = 0x%03X;\n\t\t\treturn budget;\n", pc);
+			b->uses_budget = true;
+			return;
+		case OP_STBCD:
+		case OP_STREG:
+			emit_handler(b, pc, ins);
+			fprintf(out, "\t\t\treturn n + 1;\n");
+			return;
+		default:
+			emit_handler(b, pc, ins);
+			break;
+	}
+	emit_continue(b, "\t\t\t", pc, pc + 2);
+}
+
+/* Emits the block starting at start and returns the address after it */
+static uint16_t emit_block(FILE* out, uint16_t start) {
+	static bool targeted[MEMORY_SIZE / 2];
+	struct block b;
+	char* body;
+	size_t size;
+	uint16_t pc;
+	int target;
+
+	b.start = start;
+	b.end = block_end(start);
+	b.uses_registers = false;
+	b.uses_budget = false;
+	b.uses_temp = false;
+	b.out = open_memstream(&body, &size);
+	if (!b.out) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(targeted, 0, sizeof(targeted));
+	for (pc = b.start; pc < b.end; pc += 2) {
+		target = branch_target(pc);
+		// the next instruction is fallen through to, not jumped to
+		if (in_block(&b, target) && target != pc + 2) {
+			targeted[target >> 1] = true;
+		}
+	}
+	for (pc = b.start; pc < b.end; pc += 2) {
+		fprintf(b.out, "\t\tcase 0x%03X:\n", pc);
+		if (targeted[pc >> 1]) {
+			fprintf(b.out, "\t\tl_%03X:\n", pc);
+		}
+		fprintf(b.out, "\t\t\t// %s\n", instruction_name(code[pc >> 1].op));
+		emit_instruction(&b, pc);
+	}
+	fclose(b.out);
+
+	fprintf(out, "static int block_%03X(const struct aot_state* s, uint16_t pc, int budget) {\n", start);
+	if (b.uses_registers) {
+		fprintf(out, "\tuint8_t* v;\n");
+	}
+	if (b.uses_temp) {
+		fprintf(out, "\tunsigned t;\n");
+	}
+	fprintf(out, "\tint n;\n\n");
+	if (b.uses_registers) {
+		fprintf(out, "\tv = s->v;\n");
+	}
+	if (!b.uses_budget) {
+		fprintf(out, "\t(void) budget;\n");
+	}
+	fprintf(out, "\tn = 0;\n\tswitch (pc) {\n%s\t\tdefault:\n\t\t\treturn n;\n\t}\n}\n\n", body);
+	free(body);
+	return b.end;
+}
+
+static int emit(FILE* out, const char* rom_name, size_t rom_size) {
+	static uint16_t starts[MEMORY_SIZE / 2];
+	static uint16_t ends[MEMORY_SIZE / 2];
+	size_t blocks;
+	size_t i;
+	uint16_t pc;
+
+	fprintf(out, "/* Translated by rom2c from %s, do not edit */\n\n#include <aot.h>\n\n", rom_name);
+	emit_instructions(out);
+	blocks = 0;
+	for (pc = ROM_START; pc < rom_end; ) {
+		if (!reachable[pc >> 1]) {
+			pc += 2;
+			continue;
+		}
+		starts[blocks] = pc;
+		pc = emit_block(out, pc);
+		ends[blocks++] = pc;
+	}
+	if (blocks == 0) {
+		fprintf(stderr, "No reachable code found in %s\n", rom_name);
+		return 1;
+	}
+	fprintf(out, "static const struct aot_block blocks[] = {\n");
+	for (i = 0; i < blocks; i++) {
+		fprintf(out, "\t{ 0x%03X, 0x%03X, block_%03X }%s\n", starts[i], ends[i], starts[i], i + 1 < blocks ? "," : "");
+	}
+	fprintf(out, "};\n\n");
+	fprintf(out, "const struct aot_module chip8_aot_module = {\n");
+	fprintf(out, "\tAOT_ABI_VERSION,\n\t%zu,\n\t0x%08Xu,\n\t%zu,\n\tblocks\n};\n",
+			rom_size, aot_checksum(memory + ROM_START, rom_size), blocks);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	FILE* f;
+	FILE* out;
+	size_t len;
+	int res;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <rom> [output.c]\n", argv[0]);
+		return 1;
+	}
+	f = fopen(argv[1], "rb");
+	if (!f) {
+		fprintf(stderr, "Unable to open file %s\n", argv[1]);
+		return 1;
+	}
+	len = fread(memory + ROM_START, 1, MEMORY_SIZE - ROM_START, f);
+	fclose(f);
+	rom_end = ROM_START + len;
+
+	walk();
+
+	out = argc > 2 ? fopen(argv[2], "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "Unable to open file %s\n", argv[2]);
+		return 1;
+	}
+	res = emit(out, argv[1], len);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return res;
+}